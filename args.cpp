@@ -20,6 +20,10 @@ limitations under the License.
 
 #include <cstdio>
 #include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <cctype>
+#include <algorithm>
 #include "parg/parg.h"
 #include "ims2tif.hpp"
 
@@ -27,13 +31,73 @@ limitations under the License.
 #define ARGDEF_PREFIX	'p'
 #define ARGDEF_METHOD	'm'
 #define ARGDEF_FORMAT	'f'
+#define ARGDEF_THREADS	'j'
+#define ARGDEF_VERBOSE	'v'
 #define ARGDEF_HELP		'h'
 
+/* Long-only options. */
+#define ARGDEF_INFLIGHT	256
+#define ARGDEF_ROWSPERSTRIP	257
+#define ARGDEF_WRITER	258
+#define ARGDEF_DUMPCHUNKMAP	259
+#define ARGDEF_BUFFERS	260
+#define ARGDEF_QUEUEDEPTH	261
+#define ARGDEF_MAXMEMORY	262
+#define ARGDEF_COMPRESSION	263
+#define ARGDEF_LEVEL	264
+#define ARGDEF_TILED	265
+#define ARGDEF_PLANAR	266
+#define ARGDEF_RESLEVEL	267
+#define ARGDEF_TIMEPOINTS	268
+#define ARGDEF_CHANNELS	269
+#define ARGDEF_ROI	270
+#define ARGDEF_MANIFEST	271
+#define ARGDEF_STATS	272
+#define ARGDEF_PROGRESS	273
+#define ARGDEF_PROGRESSINTERVAL	274
+#define ARGDEF_OVERWRITE	275
+#define ARGDEF_VERIFY	276
+#define ARGDEF_FOLLOW	277
+#define ARGDEF_FOLLOWINTERVAL	278
+#define ARGDEF_FOLLOWIDLE	279
+#define ARGDEF_ZARRCHUNKS	280
+#define ARGDEF_PYRAMID	281
+#define ARGDEF_PYRAMIDLEVELS	282
+
 static struct parg_option argdefs[] = {
 	{"outdir",  PARG_REQARG,    nullptr,	ARGDEF_OUTDIR},
 	{"prefix",  PARG_REQARG,    nullptr,	ARGDEF_PREFIX},
 	{"method",  PARG_REQARG,    nullptr,	ARGDEF_METHOD},
 	{"format",  PARG_REQARG,    nullptr,	ARGDEF_FORMAT},
+	{"zarr-chunks", PARG_REQARG, nullptr,	ARGDEF_ZARRCHUNKS},
+	{"writer",  PARG_REQARG,    nullptr,	ARGDEF_WRITER},
+	{"rows-per-strip", PARG_REQARG, nullptr, ARGDEF_ROWSPERSTRIP},
+	{"compression", PARG_REQARG, nullptr,	ARGDEF_COMPRESSION},
+	{"level",   PARG_REQARG,    nullptr,	ARGDEF_LEVEL},
+	{"tiled",   PARG_REQARG,    nullptr,	ARGDEF_TILED},
+	{"planar",  PARG_NOARG,     nullptr,	ARGDEF_PLANAR},
+	{"pyramid", PARG_NOARG,     nullptr,	ARGDEF_PYRAMID},
+	{"pyramid-levels", PARG_REQARG, nullptr, ARGDEF_PYRAMIDLEVELS},
+	{"resolution-level", PARG_REQARG, nullptr, ARGDEF_RESLEVEL},
+	{"timepoints", PARG_REQARG, nullptr,	ARGDEF_TIMEPOINTS},
+	{"channels", PARG_REQARG,   nullptr,	ARGDEF_CHANNELS},
+	{"roi",     PARG_REQARG,    nullptr,	ARGDEF_ROI},
+	{"manifest", PARG_REQARG,   nullptr,	ARGDEF_MANIFEST},
+	{"overwrite", PARG_NOARG,   nullptr,	ARGDEF_OVERWRITE},
+	{"verify",  PARG_NOARG,     nullptr,	ARGDEF_VERIFY},
+	{"follow",  PARG_NOARG,     nullptr,	ARGDEF_FOLLOW},
+	{"follow-interval", PARG_REQARG, nullptr, ARGDEF_FOLLOWINTERVAL},
+	{"follow-idle", PARG_REQARG, nullptr,	ARGDEF_FOLLOWIDLE},
+	{"threads", PARG_REQARG,    nullptr,	ARGDEF_THREADS},
+	{"inflight",PARG_REQARG,    nullptr,	ARGDEF_INFLIGHT},
+	{"buffers", PARG_REQARG,    nullptr,	ARGDEF_BUFFERS},
+	{"queue-depth", PARG_REQARG, nullptr,	ARGDEF_QUEUEDEPTH},
+	{"max-memory", PARG_REQARG, nullptr,	ARGDEF_MAXMEMORY},
+	{"verbose", PARG_NOARG,     nullptr,	ARGDEF_VERBOSE},
+	{"stats",   PARG_REQARG,    nullptr,	ARGDEF_STATS},
+	{"progress", PARG_NOARG,    nullptr,	ARGDEF_PROGRESS},
+	{"progress-interval", PARG_REQARG, nullptr, ARGDEF_PROGRESSINTERVAL},
+	{"dump-chunk-map", PARG_NOARG, nullptr, ARGDEF_DUMPCHUNKMAP},
 	{"help",	PARG_NOARG,		nullptr,	ARGDEF_HELP},
 	{nullptr,	0,			    nullptr,	0}
 };
@@ -47,33 +111,317 @@ static const char *USAGE_OPTIONS =
 "  -p, --prefix\n"
 "                          The prefix of the output file. If unspecified,\n"
 "                          use the base name of the input file plus a trailing _.\n"
+"                          Only allowed with a single input file.\n"
+"      --manifest\n"
+"                          Also convert the files listed in this file, one per line.\n"
+"                          Blank lines and lines starting with # are ignored. Relative\n"
+"                          paths are relative to the manifest.\n"
+"      --overwrite\n"
+"                          Convert every TimePoint, even those listed as done in the output\n"
+"                          directory's ims2tif.done. By default they're skipped.\n"
+"      --verify\n"
+"                          Check the CRC of each output listed as done before skipping it,\n"
+"                          rather than just its size.\n"
+"      --follow\n"
+"                          Keep converting TimePoints as they're written to a file that's still\n"
+"                          being acquired. Each is converted once the next one has started, the\n"
+"                          last once the file stops changing. Only allowed with a single input file.\n"
+"      --follow-interval\n"
+"                          Seconds between looks at the file with --follow. If unspecified, use 5.\n"
+"      --follow-idle\n"
+"                          Seconds the file must go unchanged before --follow decides it's\n"
+"                          finished, converts the last TimePoint and exits. If unspecified, use 120.\n"
 "  -m, --method\n"
 "                          The conversion method to use. If unspecified, use \"bigload\".\n"
-"                          Available methods are \"bigload\", \"chunked\", and \"hyperslab\".\n"
+"                          Available methods are \"bigload\", \"slab\", \"chunked\", \"hyperslab\", \"mmap\",\n"
+"                          and \"auto\". \"mmap\" implies --writer native.\n"
+"                          \"auto\" picks the fastest method that fits in --max-memory.\n"
+"      --max-memory\n"
+"                          The memory budget, in bytes or with a K, M, G or T suffix.\n"
+"                          Fewer TimePoints are run at once to stay within it.\n"
+"                          If unspecified, use the available memory with \"auto\", or no limit.\n"
+"      --resolution-level\n"
+"                          The resolution level to convert, 0 being full size. Each level\n"
+"                          down is usually half the size in X and Y (and sometimes Z).\n"
+"                          If unspecified, use 0.\n"
+"      --timepoints\n"
+"                          The TimePoints to convert, as \"first:end:step\" (end exclusive),\n"
+"                          e.g. \"10:20\", \"0::2\" or \"5\". Files keep their TimePoint's number.\n"
+"                          If unspecified, convert all of them.\n"
+"      --channels\n"
+"                          The channels to convert, in order, e.g. \"0,2\".\n"
+"                          If unspecified, convert all of them.\n"
+"      --roi\n"
+"                          Only convert the box \"x0,y0,z0,w,h,d\". Only the chunks it touches\n"
+"                          are read. If unspecified, convert the whole image.\n"
 "  -f, --format\n"
 "                          The output file format. If unspecified, use \"bigtiff\".\n"
-"                          Available formats are \"tiff\", \"bigtiff\".\n"
+"                          Available formats are \"tiff\", \"bigtiff\", and \"zarr\".\n"
+"                          \"zarr\" writes each input as an OME-Zarr store (TCZYX) instead of a\n"
+"                          TIFF per TimePoint. It takes --compression none, deflate or zstd.\n"
+"      --zarr-chunks\n"
+"                          The Zarr chunk size, as \"XxYxZ\". If unspecified, use the HDF5 chunk\n"
+"                          size, or 256x256x16 if the data isn't chunked.\n"
+"      --writer\n"
+"                          The TIFF writer to use. If unspecified, use \"libtiff\".\n"
+"                          Available writers are \"libtiff\" and \"native\".\n"
+"                          \"native\" writes uncompressed BigTIFF without libtiff.\n"
+"      --rows-per-strip\n"
+"                          The number of rows in each TIFF strip. If unspecified or 0,\n"
+"                          write each page as a single strip, or about 64KiB strips if compressed.\n"
+"      --tiled\n"
+"                          Write WxH tiles instead of strips, e.g. \"256x256\". Both must be\n"
+"                          multiples of 16. \"chunk\" matches the HDF5 chunk size (rounded up).\n"
+"      --planar\n"
+"                          Write each channel as a separate plane (PLANARCONFIG_SEPARATE)\n"
+"                          instead of interleaving them. Skips the interleave, and halves\n"
+"                          \"bigload\"'s memory.\n"
+"      --pyramid\n"
+"                          Write pyramidal OME-TIFFs: each page has its 2x, 4x, ... reductions\n"
+"                          in its SubIFDs, made as it's written, and OME-XML describes the file.\n"
+"                          Implies --tiled 256x256 unless --tiled is given. Not with --writer native.\n"
+"      --pyramid-levels\n"
+"                          The number of reduced levels with --pyramid. If unspecified, halve\n"
+"                          until a level fits in a tile.\n"
+"      --compression\n"
+"                          The TIFF (or Zarr) compression. If unspecified, use \"none\".\n"
+"                          Available compressions are \"none\", \"lzw\", \"deflate\", and \"zstd\".\n"
+"                          Strips are compressed on the TimePoint's threads.\n"
+"      --level\n"
+"                          The compression level, 1-9 for deflate, 1-22 for zstd.\n"
+"                          If unspecified, use the codec's default.\n"
+"  -j, --threads\n"
+"                          The number of worker threads. If unspecified, use 1.\n"
+"      --inflight\n"
+"                          The maximum number of TimePoints being converted at once.\n"
+"                          Each one needs the memory of its method, see README.md.\n"
+"                          If unspecified, use the number of threads.\n"
+"      --buffers\n"
+"                          The number of slab buffers the \"slab\" and \"chunked\" methods cycle through,\n"
+"                          so reading overlaps writing. If unspecified, use 2.\n"
+"                          1 reads and writes in series.\n"
+"      --queue-depth\n"
+"                          The number of read slabs allowed to wait for the writer.\n"
+"                          If unspecified, use one less than the number of buffers.\n"
+"  -v, --verbose\n"
+"                          Print timings and throughput to stderr.\n"
+"      --stats\n"
+"                          Write the time, bytes and calls of each stage (read, decompress,\n"
+"                          interleave, write) of each TimePoint to this file as JSON.\n"
+"                          \"-\" writes to stdout.\n"
+"      --progress\n"
+"                          Report TimePoints, pages and bytes done, the throughput and an ETA\n"
+"                          to stderr. A bar on a terminal, otherwise a line at a time.\n"
+"      --progress-interval\n"
+"                          Seconds between progress reports. If unspecified, use 0.5 on a\n"
+"                          terminal, otherwise 10.\n"
+"      --dump-chunk-map\n"
+"                          Print the file offset and size of every chunk to stdout,\n"
+"                          then exit without converting.\n"
 "";
 
 ims::args_t::args_t() noexcept :
 	bigtiff(true),
-	method(conversion_method_t::bigload)
+	method(conversion_method_t::bigload),
+	zarr(false),
+	zarr_chunks{0, 0, 0},
+	writer(writer_t::libtiff),
+	rows_per_strip(0),
+	tile_width(0),
+	tile_height(0),
+	tile_chunks(false),
+	threads(0),
+	inflight(0),
+	buffers(0),
+	queue_depth(0),
+	max_memory(0),
+	compression(compression_t::none),
+	level(0),
+	planar(false),
+	pyramid(false),
+	pyramid_levels(0),
+	resolution_level(0),
+	tp_begin(0),
+	tp_end(SIZE_MAX),
+	tp_step(1),
+	roi{0, 0, 0, 0, 0, 0},
+	verbose(false),
+	dump_chunk_map(false),
+	progress(false),
+	progress_interval(0.0),
+	overwrite(false),
+	verify(false),
+	follow(false),
+	follow_interval(5.0),
+	follow_idle(120.0)
 {}
 
+static int parse_size(const char *s, size_t& val) noexcept
+{
+	char *end;
+	errno = 0;
+	unsigned long long v = strtoull(s, &end, 10);
+	if(errno != 0 || end == s || *end != '\0' || s[0] == '-')
+		return -1;
+
+	val = static_cast<size_t>(v);
+	return 0;
+}
+
+/* Split s on sep, then parse_size() each piece. Empty pieces are nullopt. */
+static int parse_size_list(const char *s, char sep, std::vector<std::optional<size_t>>& vals)
+{
+	vals.clear();
+	for(const char *p = s; ; ++p)
+	{
+		const char *e = strchr(p, sep);
+		std::string piece(p, e == nullptr ? strlen(p) : static_cast<size_t>(e - p));
+
+		size_t v;
+		if(piece.empty())
+			vals.emplace_back();
+		else if(parse_size(piece.c_str(), v) < 0)
+			return -1;
+		else
+			vals.emplace_back(v);
+
+		if(e == nullptr)
+			return 0;
+		p = e;
+	}
+}
+
+/* first[:end[:step]], any of them may be empty. A lone first is just that TimePoint. */
+static int parse_timepoints(const char *s, size_t& begin, size_t& end, size_t& step)
+{
+	std::vector<std::optional<size_t>> vals;
+	if(parse_size_list(s, ':', vals) < 0 || vals.size() > 3)
+		return -1;
+
+	if(vals.size() == 1)
+	{
+		if(!vals[0])
+			return -1;
+
+		begin = *vals[0];
+		end = begin + 1;
+		step = 1;
+		return 0;
+	}
+
+	begin = vals[0].value_or(0);
+	end = vals[1].value_or(SIZE_MAX);
+	step = vals.size() > 2 ? vals[2].value_or(1) : 1;
+	if(step == 0 || begin >= end)
+		return -1;
+
+	return 0;
+}
+
+/* Append the files listed in a manifest, one per line. */
+static int read_manifest(const char *path, std::vector<std::filesystem::path>& files, FILE *err)
+{
+	FILE *f = fopen(path, "r");
+	if(f == nullptr)
+	{
+		fprintf(err, "Unable to open manifest %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	std::filesystem::path base = std::filesystem::u8path(path).parent_path();
+
+	char line[4096];
+	while(fgets(line, sizeof(line), f) != nullptr)
+	{
+		/* Trim the newline and any surrounding whitespace. */
+		char *s = line, *e = line + strlen(line);
+		while(s < e && isspace(static_cast<unsigned char>(*s)))
+			++s;
+		while(e > s && isspace(static_cast<unsigned char>(e[-1])))
+			--e;
+		*e = '\0';
+
+		if(*s == '\0' || *s == '#')
+			continue;
+
+		std::filesystem::path p = std::filesystem::u8path(s);
+		files.push_back(p.is_absolute() ? p : base / p);
+	}
+
+	bool failed = ferror(f) != 0;
+	fclose(f);
+	if(failed)
+	{
+		fprintf(err, "Error reading manifest %s.\n", path);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* WxH, both non-zero multiples of 16. */
+static int parse_tile_size(const char *s, size_t& w, size_t& h) noexcept
+{
+	unsigned long long tw, th;
+	char c;
+	if(sscanf(s, "%llux%llu%c", &tw, &th, &c) != 2)
+		return -1;
+
+	if(tw == 0 || th == 0 || tw % 16 != 0 || th % 16 != 0 || tw > UINT32_MAX || th > UINT32_MAX)
+		return -1;
+
+	w = static_cast<size_t>(tw);
+	h = static_cast<size_t>(th);
+	return 0;
+}
+
+/* A size in bytes, with an optional binary K/M/G/T suffix. */
+static int parse_memory(const char *s, uint64_t& val) noexcept
+{
+	char *end;
+	errno = 0;
+	unsigned long long v = strtoull(s, &end, 10);
+	if(errno != 0 || end == s || s[0] == '-')
+		return -1;
+
+	unsigned shift = 0;
+	switch(*end)
+	{
+		case '\0': break;
+		case 'k': case 'K': shift = 10; break;
+		case 'm': case 'M': shift = 20; break;
+		case 'g': case 'G': shift = 30; break;
+		case 't': case 'T': shift = 40; break;
+		default: return -1;
+	}
+
+	if(*end != '\0' && end[1] != '\0')
+		return -1;
+
+	if(v > (UINT64_MAX >> shift))
+		return -1;
+
+	val = static_cast<uint64_t>(v) << shift;
+	return 0;
+}
+
 int ims::parse_arguments(int argc, char **argv, FILE *out, FILE *err, args_t *args)
 {
 	parg_state ps;
 	parg_init(&ps);
 
 	auto usage = [&argv](int val, FILE *s){
-		fprintf(s, "Usage: %s [OPTIONS] <file.ims>\nOptions:\n%s", argv[0], USAGE_OPTIONS);
+		fprintf(s, "Usage: %s [OPTIONS] <file.ims>...\nOptions:\n%s", argv[0], USAGE_OPTIONS);
 		return val;
 	};
 
 	bool have_method = false;
 	bool have_format = false;
+	bool have_writer = false;
+	bool have_compression = false;
+	size_t level = 0;
 
-	for(int c; (c = parg_getopt_long(&ps, argc, argv, "ho:p:m:f:", argdefs, nullptr)) != -1; )
+	for(int c; (c = parg_getopt_long(&ps, argc, argv, "ho:p:m:f:j:v", argdefs, nullptr)) != -1; )
 	{
 		switch(c)
 		{
@@ -102,6 +450,12 @@ int ims::parse_arguments(int argc, char **argv, FILE *out, FILE *err, args_t *ar
 					args->method = conversion_method_t::chunked;
 				else if(!strcmp(ps.optarg, "hyperslab"))
 					args->method = conversion_method_t::hyperslab;
+				else if(!strcmp(ps.optarg, "slab"))
+					args->method = conversion_method_t::slab;
+				else if(!strcmp(ps.optarg, "mmap"))
+					args->method = conversion_method_t::mmap;
+				else if(!strcmp(ps.optarg, "auto"))
+					args->method = conversion_method_t::automatic;
 				else
 					return usage(2, out);
 
@@ -116,16 +470,229 @@ int ims::parse_arguments(int argc, char **argv, FILE *out, FILE *err, args_t *ar
 					args->bigtiff = false;
 				else if(!strcmp(ps.optarg, "bigtiff"))
 					args->bigtiff = true;
+				else if(!strcmp(ps.optarg, "zarr"))
+					args->zarr = true;
 				else
 					return usage(2, out);
 
 				have_format = true;
 				break;
 
-			case 1:
-				if(!args->file.empty())
+			case ARGDEF_THREADS:
+				if(args->threads != 0)
+					return usage(2, out);
+
+				if(parse_size(ps.optarg, args->threads) < 0 || args->threads == 0)
+					return usage(2, out);
+				break;
+
+			case ARGDEF_WRITER:
+				if(have_writer)
+					return usage(2, out);
+
+				if(!strcmp(ps.optarg, "libtiff"))
+					args->writer = writer_t::libtiff;
+				else if(!strcmp(ps.optarg, "native"))
+					args->writer = writer_t::native;
+				else
+					return usage(2, out);
+
+				have_writer = true;
+				break;
+
+			case ARGDEF_ROWSPERSTRIP:
+				if(parse_size(ps.optarg, args->rows_per_strip) < 0)
+					return usage(2, out);
+				break;
+
+			case ARGDEF_VERBOSE:
+				args->verbose = true;
+				break;
+
+			case ARGDEF_DUMPCHUNKMAP:
+				args->dump_chunk_map = true;
+				break;
+
+			case ARGDEF_OVERWRITE:
+				args->overwrite = true;
+				break;
+
+			case ARGDEF_VERIFY:
+				args->verify = true;
+				break;
+
+			case ARGDEF_FOLLOW:
+				args->follow = true;
+				break;
+
+			case ARGDEF_FOLLOWINTERVAL:
+			case ARGDEF_FOLLOWIDLE:
+			{
+				double& secs = c == ARGDEF_FOLLOWINTERVAL ? args->follow_interval : args->follow_idle;
+				char *end;
+				errno = 0;
+				secs = strtod(ps.optarg, &end);
+				if(errno != 0 || end == ps.optarg || *end != '\0' || !(secs > 0.0))
+					return usage(2, out);
+				args->follow = true;
+				break;
+			}
+
+			case ARGDEF_PROGRESS:
+				args->progress = true;
+				break;
+
+			case ARGDEF_PROGRESSINTERVAL:
+			{
+				char *end;
+				errno = 0;
+				args->progress_interval = strtod(ps.optarg, &end);
+				if(errno != 0 || end == ps.optarg || *end != '\0' || !(args->progress_interval > 0.0))
+					return usage(2, out);
+				args->progress = true;
+				break;
+			}
+
+			case ARGDEF_STATS:
+				if(!args->stats.empty())
+					return usage(2, out);
+				args->stats = ps.optarg;
+				break;
+
+			case ARGDEF_INFLIGHT:
+				if(args->inflight != 0)
+					return usage(2, out);
+
+				if(parse_size(ps.optarg, args->inflight) < 0 || args->inflight == 0)
+					return usage(2, out);
+				break;
+
+			case ARGDEF_BUFFERS:
+				if(parse_size(ps.optarg, args->buffers) < 0 || args->buffers == 0)
+					return usage(2, out);
+				break;
+
+			case ARGDEF_COMPRESSION:
+				if(have_compression)
+					return usage(2, out);
+
+				if(!strcmp(ps.optarg, "none"))
+					args->compression = compression_t::none;
+				else if(!strcmp(ps.optarg, "lzw"))
+					args->compression = compression_t::lzw;
+				else if(!strcmp(ps.optarg, "deflate"))
+					args->compression = compression_t::deflate;
+				else if(!strcmp(ps.optarg, "zstd"))
+					args->compression = compression_t::zstd;
+				else
+					return usage(2, out);
+
+				have_compression = true;
+				break;
+
+			case ARGDEF_TILED:
+				if(args->tile_width != 0 || args->tile_chunks)
+					return usage(2, out);
+
+				if(!strcmp(ps.optarg, "chunk"))
+					args->tile_chunks = true;
+				else if(parse_tile_size(ps.optarg, args->tile_width, args->tile_height) < 0)
+					return usage(2, out);
+				break;
+
+			case ARGDEF_ZARRCHUNKS:
+			{
+				std::vector<std::optional<size_t>> vals;
+				if(args->zarr_chunks[0] != 0 || parse_size_list(ps.optarg, 'x', vals) < 0 || vals.size() != 3)
+					return usage(2, out);
+
+				for(size_t i = 0; i < 3; ++i)
+				{
+					if(!vals[i] || *vals[i] == 0)
+						return usage(2, out);
+					args->zarr_chunks[i] = *vals[i];
+				}
+				break;
+			}
+
+			case ARGDEF_PLANAR:
+				args->planar = true;
+				break;
+
+			case ARGDEF_PYRAMID:
+				args->pyramid = true;
+				break;
+
+			case ARGDEF_PYRAMIDLEVELS:
+				if(args->pyramid_levels != 0 || parse_size(ps.optarg, args->pyramid_levels) < 0 || args->pyramid_levels == 0)
+					return usage(2, out);
+				args->pyramid = true;
+				break;
+
+			case ARGDEF_RESLEVEL:
+				if(parse_size(ps.optarg, args->resolution_level) < 0)
+					return usage(2, out);
+				break;
+
+			case ARGDEF_TIMEPOINTS:
+				if(parse_timepoints(ps.optarg, args->tp_begin, args->tp_end, args->tp_step) < 0)
+					return usage(2, out);
+				break;
+
+			case ARGDEF_CHANNELS:
+			{
+				std::vector<std::optional<size_t>> vals;
+				if(parse_size_list(ps.optarg, ',', vals) < 0)
+					return usage(2, out);
+
+				args->channels.clear();
+				for(const std::optional<size_t>& v : vals)
+				{
+					if(!v)
+						return usage(2, out);
+					args->channels.push_back(*v);
+				}
+				break;
+			}
+
+			case ARGDEF_ROI:
+			{
+				std::vector<std::optional<size_t>> vals;
+				if(parse_size_list(ps.optarg, ',', vals) < 0 || vals.size() != 6)
+					return usage(2, out);
+
+				for(size_t i = 0; i < 6; ++i)
+				{
+					/* Empty boxes aren't much use. */
+					if(!vals[i] || (i >= 3 && *vals[i] == 0))
+						return usage(2, out);
+					args->roi[i] = *vals[i];
+				}
+				break;
+			}
+
+			case ARGDEF_MANIFEST:
+				if(read_manifest(ps.optarg, args->files, err) < 0)
+					return 1;
+				break;
+
+			case ARGDEF_LEVEL:
+				if(parse_size(ps.optarg, level) < 0 || level == 0 || level > 22)
+					return usage(2, out);
+				break;
+
+			case ARGDEF_MAXMEMORY:
+				if(parse_memory(ps.optarg, args->max_memory) < 0 || args->max_memory == 0)
+					return usage(2, out);
+				break;
+
+			case ARGDEF_QUEUEDEPTH:
+				if(parse_size(ps.optarg, args->queue_depth) < 0 || args->queue_depth == 0)
 					return usage(2, out);
-				args->file = ps.optarg;
+				break;
+
+			case 1:
+				args->files.push_back(ps.optarg);
 				break;
 
 			case '?':
@@ -135,17 +702,80 @@ int ims::parse_arguments(int argc, char **argv, FILE *out, FILE *err, args_t *ar
 		}
 	}
 
-	if(args->file.empty())
+	if(args->files.empty())
+		return usage(2, out);
+
+	/* Every file would get the same name. */
+	if(!args->prefix.empty() && args->files.size() > 1)
+		return usage(2, out);
+
+	/* Following is one file at a time. Overwriting would redo everything on every pass. */
+	if(args->follow && (args->files.size() > 1 || args->overwrite || args->dump_chunk_map))
 		return usage(2, out);
 	
-	if(args->outdir.empty())
-		args->outdir = ".";
+	/* mmap reads straight into the native writer's file. */
+	if(args->method == conversion_method_t::mmap)
+	{
+		if(have_writer && args->writer != writer_t::native)
+			return usage(2, out);
+		args->writer = writer_t::native;
+	}
+
+	/* The native writer only does uncompressed, stripped BigTIFF. */
+	if(args->writer == writer_t::native && (!args->bigtiff || args->compression != compression_t::none || args->tile_width != 0 || args->tile_chunks))
+		return usage(2, out);
 
-	if(args->prefix.empty())
+	/* Zarr has no strips or tiles, and no LZW. Its chunks are per channel, so pages go to it planar. */
+	if(args->zarr)
 	{
-		args->prefix = args->file.stem().u8string();
-		args->prefix.append("_");
+		if(args->writer == writer_t::native || args->rows_per_strip != 0 || args->tile_width != 0 || args->tile_chunks || args->compression == compression_t::lzw)
+			return usage(2, out);
+		args->planar = true;
 	}
+	else if(args->zarr_chunks[0] != 0)
+	{
+		return usage(2, out);
+	}
+
+	/* Pyramids are libtiff SubIFDs, and viewers want them tiled. */
+	if(args->pyramid)
+	{
+		if(args->writer == writer_t::native || args->zarr)
+			return usage(2, out);
+
+		if(args->tile_width == 0 && !args->tile_chunks)
+			args->tile_width = args->tile_height = 256;
+	}
+
+	/* Only deflate and zstd have levels. */
+	if(level != 0 && args->compression != compression_t::deflate && args->compression != compression_t::zstd)
+		return usage(2, out);
+
+	if(args->compression == compression_t::deflate && level > 9)
+		return usage(2, out);
+
+	args->level = static_cast<int>(level);
+
+	if(!compression_supported(args->compression))
+	{
+		fprintf(err, "This build doesn't support %s compression.\n", args->compression == compression_t::zstd ? "zstd" : "deflate");
+		return 1;
+	}
+
+	if(args->outdir.empty())
+		args->outdir = ".";
+
+	if(args->threads == 0)
+		args->threads = 1;
+
+	if(args->inflight == 0)
+		args->inflight = args->threads;
+
+	if(args->buffers == 0)
+		args->buffers = 2;
+
+	if(args->queue_depth == 0)
+		args->queue_depth = std::max<size_t>(args->buffers - 1, 1);
 
 	return 0;
 }
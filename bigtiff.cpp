@@ -0,0 +1,395 @@
+/*
+Dragonfly IMS to TiFF converter
+https://github.com/UQ-RCC/ims2tif
+
+SPDX-License-Identifier: Apache-2.0
+Copyright (c) 2019 The University of Queensland
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+/*
+ * Native BigTIFF writer for uncompressed output.
+ *
+ * Every page has the same size and tags, so the whole file can be laid out up front:
+ *
+ *   header | IFD 0 | IFD 0 arrays | IFD 1 | ... | (pad) | page 0 | page 1 | ...
+ *
+ * All the metadata goes out in a single write when the file is created, then each
+ * page is written straight from the converter's buffer at its known offset.
+ * The tags match what tiff_writer produces.
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include "ims2tif.hpp"
+
+#if !defined(_WIN32)
+#	include <fcntl.h>
+#	include <unistd.h>
+#	include <sys/mman.h>
+#endif
+
+using namespace ims;
+
+/* TIFF tags and types, so we don't need libtiff's headers here. */
+enum : uint16_t
+{
+	TAG_SUBFILETYPE		= 254,
+	TAG_IMAGEWIDTH		= 256,
+	TAG_IMAGELENGTH		= 257,
+	TAG_BITSPERSAMPLE	= 258,
+	TAG_COMPRESSION		= 259,
+	TAG_PHOTOMETRIC		= 262,
+	TAG_STRIPOFFSETS	= 273,
+	TAG_SAMPLESPERPIXEL	= 277,
+	TAG_ROWSPERSTRIP	= 278,
+	TAG_STRIPBYTECOUNTS	= 279,
+	TAG_PLANARCONFIG	= 284,
+	TAG_RESOLUTIONUNIT	= 296,
+	TAG_PAGENUMBER		= 297,
+	TAG_EXTRASAMPLES	= 338,
+	TAG_SAMPLEFORMAT	= 339,
+};
+
+enum : uint16_t
+{
+	TYPE_SHORT	= 3,
+	TYPE_LONG	= 4,
+	TYPE_LONG8	= 16,
+};
+
+constexpr uint64_t BIGTIFF_HEADER_SIZE = 16;
+constexpr uint64_t BIGTIFF_ENTRY_SIZE = 20;
+constexpr uint64_t PAGE_ALIGN = 4096;
+
+static bool host_is_little_endian() noexcept
+{
+	uint16_t v = 1;
+	uint8_t b;
+	memcpy(&b, &v, 1);
+	return b == 1;
+}
+
+/* Builds an IFD in host byte order. Entries must be added in tag order. */
+struct ifd_builder
+{
+	struct entry_t
+	{
+		uint16_t tag;
+		uint16_t type;
+		std::vector<uint64_t> values;
+	};
+
+	void add(uint16_t tag, uint16_t type, std::vector<uint64_t> values)
+	{
+		entries.push_back({tag, type, std::move(values)});
+	}
+
+	static size_t type_size(uint16_t type) noexcept
+	{
+		return type == TYPE_SHORT ? 2 : type == TYPE_LONG ? 4 : 8;
+	}
+
+	/* Size of the IFD itself, plus anything that doesn't fit inline. */
+	uint64_t size() const noexcept
+	{
+		uint64_t s = 8 + entries.size() * BIGTIFF_ENTRY_SIZE + 8;
+		for(const entry_t& e : entries)
+		{
+			uint64_t vs = e.values.size() * type_size(e.type);
+			if(vs > 8)
+				s += (vs + 7) & ~uint64_t(7);
+		}
+		return s;
+	}
+
+	/* Serialise at buf, which lives at file offset "offset". */
+	void write(uint8_t *buf, uint64_t offset, uint64_t next) const noexcept
+	{
+		uint8_t *p = buf;
+		uint8_t *extra = buf + 8 + entries.size() * BIGTIFF_ENTRY_SIZE + 8;
+
+		uint64_t count = entries.size();
+		memcpy(p, &count, 8);
+		p += 8;
+
+		for(const entry_t& e : entries)
+		{
+			uint64_t n = e.values.size();
+			size_t ts = type_size(e.type);
+
+			memcpy(p + 0, &e.tag, 2);
+			memcpy(p + 2, &e.type, 2);
+			memcpy(p + 4, &n, 8);
+
+			uint8_t *vp = p + 12;
+			if(n * ts > 8)
+			{
+				uint64_t off = offset + static_cast<uint64_t>(extra - buf);
+				memcpy(vp, &off, 8);
+				vp = extra;
+				extra += (n * ts + 7) & ~uint64_t(7);
+			}
+
+			for(uint64_t v : e.values)
+			{
+				uint16_t v16 = static_cast<uint16_t>(v);
+				uint32_t v32 = static_cast<uint32_t>(v);
+				if(ts == 2)
+					memcpy(vp, &v16, 2);
+				else if(ts == 4)
+					memcpy(vp, &v32, 4);
+				else
+					memcpy(vp, &v, 8);
+				vp += ts;
+			}
+
+			p += BIGTIFF_ENTRY_SIZE;
+		}
+
+		memcpy(p, &next, 8);
+	}
+
+	std::vector<entry_t> entries;
+};
+
+ims::bigtiff_writer::bigtiff_writer(const std::filesystem::path& path, size_t w, size_t h, size_t num_channels, size_t npages, size_t rows_per_strip, bool planar) :
+	_fd(-1),
+	_num_channels(num_channels),
+	_planar(planar),
+	_page_size(w * h * num_channels * sizeof(uint16_t)),
+	_data_offset(0),
+	_file_size(0),
+	_map(nullptr)
+{
+#if defined(_WIN32)
+	(void)path; (void)rows_per_strip; (void)planar;
+	fprintf(stderr, "The native writer isn't supported on Windows.\n");
+	throw tiff_exception();
+#else
+	if(rows_per_strip == 0 || rows_per_strip > h)
+		rows_per_strip = h;
+
+	/* Planar pages are each channel's plane in turn, with its own strips. */
+	size_t nplanes = planar ? num_channels : 1;
+	size_t nstrips = h / rows_per_strip + static_cast<size_t>(!!(h % rows_per_strip));
+	uint64_t rowbytes = w * (planar ? 1 : num_channels) * sizeof(uint16_t);
+	uint64_t plane_size = rowbytes * h;
+
+	/* The IFDs only differ in their values, so build the first to get the size. */
+	auto build_ifd = [&](size_t page, uint64_t data_offset) {
+		ifd_builder ifd;
+
+		std::vector<uint64_t> offsets(nstrips * nplanes), counts(nstrips * nplanes);
+		for(size_t p = 0; p < nplanes; ++p)
+		{
+			for(size_t s = 0; s < nstrips; ++s)
+			{
+				size_t rows = std::min(rows_per_strip, h - s * rows_per_strip);
+				offsets[p * nstrips + s] = data_offset + p * plane_size + s * rows_per_strip * rowbytes;
+				counts[p * nstrips + s] = rows * rowbytes;
+			}
+		}
+
+		ifd.add(TAG_SUBFILETYPE, TYPE_LONG, {2}); /* FILETYPE_PAGE */
+		ifd.add(TAG_IMAGEWIDTH, TYPE_LONG, {w});
+		ifd.add(TAG_IMAGELENGTH, TYPE_LONG, {h});
+		ifd.add(TAG_BITSPERSAMPLE, TYPE_SHORT, std::vector<uint64_t>(num_channels, 16));
+		ifd.add(TAG_COMPRESSION, TYPE_SHORT, {1}); /* COMPRESSION_NONE */
+		ifd.add(TAG_PHOTOMETRIC, TYPE_SHORT, {2}); /* PHOTOMETRIC_RGB */
+		ifd.add(TAG_STRIPOFFSETS, TYPE_LONG8, std::move(offsets));
+		ifd.add(TAG_SAMPLESPERPIXEL, TYPE_SHORT, {num_channels});
+		ifd.add(TAG_ROWSPERSTRIP, TYPE_LONG, {rows_per_strip});
+		ifd.add(TAG_STRIPBYTECOUNTS, TYPE_LONG8, std::move(counts));
+		ifd.add(TAG_PLANARCONFIG, TYPE_SHORT, {planar ? 2u : 1u}); /* PLANARCONFIG_SEPARATE or PLANARCONFIG_CONTIG */
+		ifd.add(TAG_RESOLUTIONUNIT, TYPE_SHORT, {1});
+		ifd.add(TAG_PAGENUMBER, TYPE_SHORT, {page, npages});
+		if(num_channels > 3)
+			ifd.add(TAG_EXTRASAMPLES, TYPE_SHORT, std::vector<uint64_t>(num_channels - 3, 0)); /* EXTRASAMPLE_UNSPECIFIED */
+		ifd.add(TAG_SAMPLEFORMAT, TYPE_SHORT, std::vector<uint64_t>(num_channels, 1)); /* SAMPLEFORMAT_UINT */
+		return ifd;
+	};
+
+	uint64_t ifd_size = build_ifd(0, 0).size();
+	uint64_t meta_size = BIGTIFF_HEADER_SIZE + ifd_size * npages;
+	_data_offset = (meta_size + PAGE_ALIGN - 1) & ~(PAGE_ALIGN - 1);
+	uint64_t file_size = _data_offset + _page_size * npages;
+	_file_size = file_size;
+
+	std::vector<uint8_t> meta(meta_size, 0);
+
+	/* Header */
+	uint16_t magic = 43, offsize = 8, zero = 0;
+	uint64_t first_ifd = npages > 0 ? BIGTIFF_HEADER_SIZE : 0;
+	memcpy(&meta[0], host_is_little_endian() ? "II" : "MM", 2);
+	memcpy(&meta[2], &magic, 2);
+	memcpy(&meta[4], &offsize, 2);
+	memcpy(&meta[6], &zero, 2);
+	memcpy(&meta[8], &first_ifd, 8);
+
+	for(size_t p = 0; p < npages; ++p)
+	{
+		uint64_t off = BIGTIFF_HEADER_SIZE + p * ifd_size;
+		uint64_t next = p + 1 < npages ? off + ifd_size : 0;
+		build_ifd(p, _data_offset + p * _page_size).write(&meta[off], off, next);
+	}
+
+	/* Read access is only for map_pages(), which needs it for MAP_SHARED. */
+	_fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if(_fd < 0)
+	{
+		fprintf(stderr, "Error opening %s: %s\n", path.c_str(), strerror(errno));
+		throw tiff_exception();
+	}
+
+	/* Reserve the whole file up front. Not every filesystem can, so fall back to just sizing it. */
+	int r = -1;
+#if defined(__linux__)
+	r = fallocate(_fd, 0, 0, static_cast<off_t>(file_size));
+#endif
+	if(r < 0 && ftruncate(_fd, static_cast<off_t>(file_size)) < 0)
+	{
+		fprintf(stderr, "Error allocating %s: %s\n", path.c_str(), strerror(errno));
+		close(_fd);
+		throw tiff_exception();
+	}
+
+	/* The destructor won't run if this throws. */
+	try
+	{
+		pwrite_all(meta.data(), meta.size(), 0);
+	}
+	catch(...)
+	{
+		close(_fd);
+		_fd = -1;
+		throw;
+	}
+#endif
+}
+
+ims::bigtiff_writer::~bigtiff_writer()
+{
+#if !defined(_WIN32)
+	if(_map != nullptr)
+		munmap(_map, static_cast<size_t>(_file_size));
+
+	if(_fd >= 0)
+		close(_fd);
+#endif
+}
+
+void ims::bigtiff_writer::finish()
+{
+#if !defined(_WIN32)
+	/* Errors writing back what was written through the mapping only show up in fsync(). */
+	if(_map != nullptr)
+	{
+		int r = munmap(_map, static_cast<size_t>(_file_size));
+		_map = nullptr;
+		if(r < 0)
+		{
+			fprintf(stderr, "Error unmapping TIFF: %s\n", strerror(errno));
+			throw tiff_exception();
+		}
+	}
+
+	if(fsync(_fd) < 0)
+	{
+		fprintf(stderr, "Error writing TIFF: %s\n", strerror(errno));
+		throw tiff_exception();
+	}
+
+	/* The descriptor's gone either way. */
+	int r = close(_fd);
+	_fd = -1;
+	if(r < 0)
+	{
+		fprintf(stderr, "Error closing TIFF: %s\n", strerror(errno));
+		throw tiff_exception();
+	}
+#else
+	throw tiff_exception();
+#endif
+}
+
+void ims::bigtiff_writer::pwrite_all(const void *data, size_t size, uint64_t offset)
+{
+#if !defined(_WIN32)
+	const uint8_t *p = reinterpret_cast<const uint8_t*>(data);
+	while(size > 0)
+	{
+		ssize_t n = pwrite(_fd, p, size, static_cast<off_t>(offset));
+		if(n < 0 && errno == EINTR)
+			continue;
+
+		if(n <= 0)
+		{
+			fprintf(stderr, "Error writing TIFF: %s\n", strerror(errno));
+			throw tiff_exception();
+		}
+
+		p += n;
+		size -= static_cast<size_t>(n);
+		offset += static_cast<uint64_t>(n);
+	}
+#else
+	(void)data; (void)size; (void)offset;
+	throw tiff_exception();
+#endif
+}
+
+void ims::bigtiff_writer::write_page_contig(size_t page, uint16_t *data)
+{
+	if(_planar)
+		throw tiff_exception();
+
+	pwrite_all(data, _page_size, _data_offset + page * _page_size);
+}
+
+void ims::bigtiff_writer::write_page_planar(size_t page, const uint16_t* const *planes)
+{
+	if(!_planar)
+		throw tiff_exception();
+
+	uint64_t plane_size = _page_size / _num_channels;
+	for(size_t c = 0; c < _num_channels; ++c)
+		pwrite_all(planes[c], plane_size, _data_offset + page * _page_size + c * plane_size);
+}
+
+/*
+ * The file's fully allocated by now, so running out of space won't SIGBUS us.
+ * Except where fallocate() isn't supported, but there's not much we can do about that.
+ */
+uint16_t *ims::bigtiff_writer::map_pages()
+{
+#if !defined(_WIN32)
+	if(_map == nullptr)
+	{
+		void *p = mmap(nullptr, static_cast<size_t>(_file_size), PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+		if(p == MAP_FAILED)
+		{
+			fprintf(stderr, "Error mapping TIFF: %s\n", strerror(errno));
+			throw tiff_exception();
+		}
+		_map = p;
+	}
+
+	return reinterpret_cast<uint16_t*>(reinterpret_cast<uint8_t*>(_map) + _data_offset);
+#else
+	return nullptr;
+#endif
+}
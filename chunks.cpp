@@ -0,0 +1,608 @@
+/*
+Dragonfly IMS to TiFF converter
+https://github.com/UQ-RCC/ims2tif
+
+SPDX-License-Identifier: Apache-2.0
+Copyright (c) 2019 The University of Queensland
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+/*
+ * Direct chunk reader.
+ *
+ * H5Dread() runs the filter pipeline on the calling thread, and as we have to hold
+ * the HDF5 lock for it, decompression ends up single-threaded. Instead, pull the raw
+ * chunks out with H5Dread_chunk() under the lock, then undo the filters ourselves
+ * and scatter straight into the (interleaved or planar) destination on the worker threads.
+ *
+ * Only the filters Imaris uses (deflate, shuffle) on native uint16 data are handled,
+ * anything else is left to H5Dread().
+ *
+ * With HDF5 1.10.5+ we can also find out where each chunk lives in the file. The chunks
+ * are then read in ascending file order, with neighbours merged into single reads,
+ * straight from the file rather than through HDF5.
+ */
+
+#include <cstring>
+#include <algorithm>
+#include <iterator>
+#include <condition_variable>
+#include "ims2tif.hpp"
+
+#if defined(IMS2TIF_HAVE_ZLIB)
+#	include <zlib.h>
+#endif
+
+using namespace ims;
+
+static bool filter_supported(H5Z_filter_t filter) noexcept
+{
+	switch(filter)
+	{
+		case H5Z_FILTER_SHUFFLE:
+			return true;
+#if defined(IMS2TIF_HAVE_ZLIB)
+		case H5Z_FILTER_DEFLATE:
+			return true;
+#endif
+		default:
+			return false;
+	}
+}
+
+std::unique_ptr<chunk_reader> ims::chunk_reader::open(hid_t timepoint, const region_t& region, size_t xs, size_t ys, size_t zs, size_t nchan, stage_stats *stats)
+{
+#if H5_VERSION_GE(1, 10, 3)
+	hdf5_lock l(hdf5_mutex());
+
+	std::unique_ptr<chunk_reader> r(new chunk_reader());
+	r->_xs = xs;
+	r->_ys = ys;
+	r->_zs = zs;
+	r->_x0 = region.x0;
+	r->_y0 = region.y0;
+	r->_z0 = region.z0;
+	r->_stats = stats;
+	r->_channels.reserve(nchan);
+
+	for(size_t c = 0; c < nchan; ++c)
+	{
+		char cbuf[32];
+		sprintf(cbuf, "Channel %zu", region.channel(c));
+		h5g_ptr chan(H5Gopen2(timepoint, cbuf, H5P_DEFAULT));
+		if(!chan)
+			return nullptr;
+
+		r->_channels.push_back({h5d_ptr(H5Dopen2(chan.get(), "Data", H5P_DEFAULT)), {}, 0});
+		channel_t& ch = r->_channels.back();
+		if(!ch.dataset)
+			return nullptr;
+
+		if(!dataset_is_native_u16(ch.dataset.get()))
+			return nullptr;
+
+		h5p_ptr cparms(H5Dget_create_plist(ch.dataset.get()));
+		if(!cparms)
+			return nullptr;
+
+		if(H5D_CHUNKED != H5Pget_layout(cparms.get()))
+			return nullptr;
+
+		hsize_t dims[3];
+		if(H5Pget_chunk(cparms.get(), 3, dims) != 3)
+			return nullptr;
+
+		if(c > 0 && (dims[0] != r->_zcs || dims[1] != r->_ycs || dims[2] != r->_xcs))
+			return nullptr;
+
+		r->_zcs = dims[0];
+		r->_ycs = dims[1];
+		r->_xcs = dims[2];
+
+		int nfilters = H5Pget_nfilters(cparms.get());
+		if(nfilters < 0)
+			return nullptr;
+
+		for(int i = 0; i < nfilters; ++i)
+		{
+			unsigned int flags;
+			size_t ncd = 0;
+			H5Z_filter_t f = H5Pget_filter2(cparms.get(), static_cast<unsigned>(i), &flags, &ncd, nullptr, 0, nullptr, nullptr);
+			if(!filter_supported(f))
+				return nullptr;
+
+			ch.filters.push_back(f);
+		}
+
+		uint16_t fill = 0;
+		H5D_fill_value_t fvstat;
+		if(H5Pfill_value_defined(cparms.get(), &fvstat) >= 0 && fvstat != H5D_FILL_VALUE_UNDEFINED)
+		{
+			if(H5Pget_fill_value(cparms.get(), H5T_NATIVE_UINT16, &fill) < 0)
+				return nullptr;
+		}
+		ch.fill = fill;
+	}
+
+	l.unlock();
+
+	/* If we can index the chunks, read them ourselves in file order. */
+	std::vector<chunk_info_t> index;
+	if(build_chunk_index(timepoint, region, nchan, index) == 0)
+		r->build_runs(timepoint, std::move(index));
+
+	return r;
+#else
+	(void)timepoint; (void)region; (void)xs; (void)ys; (void)zs; (void)nchan;
+	return nullptr;
+#endif
+}
+
+/* Gaps up to this size are read through rather than seeking over. */
+constexpr uint64_t COALESCE_GAP = 64 * 1024;
+
+/* Don't let a single run grow past this. */
+constexpr uint64_t COALESCE_MAX = 64 * 1024 * 1024;
+
+static bool chunk_allocated(const chunk_info_t& ci) noexcept
+{
+	return ci.addr != HADDR_UNDEF && ci.size > 0;
+}
+
+/* Does chunk b continue the run [start, end)? */
+static bool chunk_coalesces(uint64_t start, uint64_t end, const chunk_info_t& b) noexcept
+{
+	return chunk_allocated(b) && b.addr >= end && b.addr - end <= COALESCE_GAP && b.addr + b.size - start <= COALESCE_MAX;
+}
+
+int ims::build_chunk_index(hid_t timepoint, const region_t& region, size_t nchan, std::vector<chunk_info_t>& index) noexcept
+{
+#if H5_VERSION_GE(1, 10, 5)
+	hdf5_lock l(hdf5_mutex());
+
+	index.clear();
+	for(size_t c = 0; c < nchan; ++c)
+	{
+		char cbuf[32];
+		sprintf(cbuf, "Channel %zu", region.channel(c));
+		h5g_ptr chan(H5Gopen2(timepoint, cbuf, H5P_DEFAULT));
+		if(!chan)
+			return -1;
+
+		h5d_ptr dataset(H5Dopen2(chan.get(), "Data", H5P_DEFAULT));
+		if(!dataset)
+			return -1;
+
+		h5p_ptr cparms(H5Dget_create_plist(dataset.get()));
+		if(!cparms || H5Pget_layout(cparms.get()) != H5D_CHUNKED)
+			return -1;
+
+		hsize_t cdims[3];
+		if(H5Pget_chunk(cparms.get(), 3, cdims) != 3)
+			return -1;
+
+		h5s_ptr dspace(H5Dget_space(dataset.get()));
+		hsize_t dims[3];
+		if(!dspace || H5Sget_simple_extent_dims(dspace.get(), dims, nullptr) != 3)
+			return -1;
+
+		/* Walk the grid so unallocated chunks show up too. */
+		for(hsize_t z = 0; z < dims[0]; z += cdims[0])
+		{
+			for(hsize_t y = 0; y < dims[1]; y += cdims[1])
+			{
+				for(hsize_t x = 0; x < dims[2]; x += cdims[2])
+				{
+					chunk_info_t ci;
+					ci.channel = c;
+					ci.offset[0] = z;
+					ci.offset[1] = y;
+					ci.offset[2] = x;
+					if(H5Dget_chunk_info_by_coord(dataset.get(), ci.offset, &ci.filter_mask, &ci.addr, &ci.size) < 0)
+						return -1;
+
+					index.push_back(ci);
+				}
+			}
+		}
+	}
+
+	return 0;
+#else
+	(void)timepoint; (void)region; (void)nchan; (void)index;
+	return -1;
+#endif
+}
+
+void ims::dump_chunk_map(FILE *out, size_t timepoint, const std::vector<chunk_info_t>& index)
+{
+	fprintf(out, "# timepoint\tchannel\tz\ty\tx\taddress\tsize\tfilter_mask\n");
+
+	uint64_t total = 0, backward = 0, unallocated = 0;
+	haddr_t last = 0;
+	for(const chunk_info_t& ci : index)
+	{
+		if(!chunk_allocated(ci))
+		{
+			fprintf(out, "%zu\t%zu\t%llu\t%llu\t%llu\t-\t0\t-\n", timepoint, ci.channel,
+				static_cast<unsigned long long>(ci.offset[0]), static_cast<unsigned long long>(ci.offset[1]), static_cast<unsigned long long>(ci.offset[2])
+			);
+			++unallocated;
+			continue;
+		}
+
+		fprintf(out, "%zu\t%zu\t%llu\t%llu\t%llu\t%llu\t%llu\t0x%x\n", timepoint, ci.channel,
+			static_cast<unsigned long long>(ci.offset[0]), static_cast<unsigned long long>(ci.offset[1]), static_cast<unsigned long long>(ci.offset[2]),
+			static_cast<unsigned long long>(ci.addr), static_cast<unsigned long long>(ci.size), ci.filter_mask
+		);
+
+		total += ci.size;
+		if(ci.addr < last)
+			++backward;
+		last = ci.addr;
+	}
+
+	/* How many sequential reads it takes in file order. */
+	std::vector<chunk_info_t> sorted;
+	std::copy_if(index.begin(), index.end(), std::back_inserter(sorted), chunk_allocated);
+	std::sort(sorted.begin(), sorted.end(), [](const chunk_info_t& a, const chunk_info_t& b) { return a.addr < b.addr; });
+
+	uint64_t nruns = 0;
+	for(size_t i = 0; i < sorted.size(); )
+	{
+		uint64_t start = sorted[i].addr, end = start + sorted[i].size;
+		for(++i; i < sorted.size() && chunk_coalesces(start, end, sorted[i]); ++i)
+			end = sorted[i].addr + sorted[i].size;
+		++nruns;
+	}
+
+	fprintf(out, "# TimePoint %zu: %zu chunks (%llu unallocated), %llu bytes, %llu backward seeks in channel order, %llu reads in file order\n",
+		timepoint, index.size(), static_cast<unsigned long long>(unallocated), static_cast<unsigned long long>(total),
+		static_cast<unsigned long long>(backward), static_cast<unsigned long long>(nruns)
+	);
+}
+
+/*
+ * Undo the filter pipeline, in reverse. Returns the unfiltered chunk, which is
+ * either data itself or one of the scratch buffers.
+ */
+static const uint8_t *unfilter(const std::vector<H5Z_filter_t>& filters, uint32_t mask, const uint8_t *data, size_t size, std::vector<uint8_t>& a, std::vector<uint8_t>& b, size_t chunk_bytes)
+{
+	const uint8_t *in = data;
+	std::vector<uint8_t> *out = &a;
+
+	for(size_t i = filters.size(); i-- > 0; )
+	{
+		/* Skipped for this chunk. */
+		if(mask & (1u << i))
+			continue;
+
+		out->resize(chunk_bytes);
+
+		if(filters[i] == H5Z_FILTER_SHUFFLE)
+		{
+			/* Byte b of element e was stored at b * nelem + e. */
+			constexpr size_t esize = sizeof(uint16_t);
+			size_t nelem = size / esize;
+			if(size != chunk_bytes)
+				throw hdf5_exception();
+
+			uint8_t *dst = out->data();
+			for(size_t e = 0; e < nelem; ++e)
+			{
+				for(size_t j = 0; j < esize; ++j)
+					dst[e * esize + j] = in[j * nelem + e];
+			}
+		}
+#if defined(IMS2TIF_HAVE_ZLIB)
+		else if(filters[i] == H5Z_FILTER_DEFLATE)
+		{
+			uLongf dlen = static_cast<uLongf>(chunk_bytes);
+			if(uncompress(out->data(), &dlen, in, static_cast<uLong>(size)) != Z_OK || dlen != chunk_bytes)
+				throw hdf5_exception();
+		}
+#endif
+		else
+		{
+			throw hdf5_exception();
+		}
+
+		in = out->data();
+		size = chunk_bytes;
+		out = out == &a ? &b : &a;
+	}
+
+	if(size != chunk_bytes)
+		throw hdf5_exception();
+
+	return in;
+}
+
+size_t ims::chunk_reader::scratch_size(size_t chunk_bytes, uint64_t layer_bytes) noexcept
+{
+	/* A coalesced read (which never spans layers), and two buffers to unfilter into. */
+	return static_cast<size_t>(std::min(std::max<uint64_t>(layer_bytes, chunk_bytes), COALESCE_MAX)) + 2 * chunk_bytes;
+}
+
+ims::chunk_reader::~chunk_reader()
+{
+	if(_raw)
+		fclose(_raw);
+}
+
+/* Set up reading straight from the file, in file order. */
+void ims::chunk_reader::build_runs(hid_t timepoint, std::vector<chunk_info_t>&& index)
+{
+	/* Without filters, there's nothing to do but copy, so read them straight from a mapping. */
+	bool unfiltered = std::all_of(_channels.begin(), _channels.end(), [](const channel_t& ch) { return ch.filters.empty(); });
+	if(unfiltered && (_map = source_map::open(timepoint)) != nullptr)
+	{
+		_map->advise_sequential(0, _map->size());
+	}
+	else
+	{
+		std::string name = get_raw_file_name(timepoint);
+		if(name.empty() || (_raw = fopen(name.c_str(), "rb")) == nullptr)
+			return;
+
+		/* Every read is big, don't double-buffer. */
+		setvbuf(_raw, nullptr, _IONBF, 0);
+	}
+
+	/* Only what's in the region, grouped by chunk layer, then in file order. */
+	index.erase(std::remove_if(index.begin(), index.end(), [this](const chunk_info_t& ci) {
+		return ci.offset[0] >= _z0 + _zs || ci.offset[0] + _zcs <= _z0 ||
+			ci.offset[1] >= _y0 + _ys || ci.offset[1] + _ycs <= _y0 ||
+			ci.offset[2] >= _x0 + _xs || ci.offset[2] + _xcs <= _x0;
+	}), index.end());
+
+	std::sort(index.begin(), index.end(), [this](const chunk_info_t& a, const chunk_info_t& b) {
+		hsize_t la = a.offset[0] / _zcs, lb = b.offset[0] / _zcs;
+		if(la != lb)
+			return la < lb;
+		return a.addr < b.addr;
+	});
+
+	/* By the source's layers, most of them may be empty. */
+	const size_t nlayers = (_z0 + _zs) / _zcs + static_cast<size_t>(!!((_z0 + _zs) % _zcs));
+	_layer_runs.assign(nlayers + 1, 0);
+
+	for(size_t i = 0; i < index.size(); )
+	{
+		size_t layer = index[i].offset[0] / _zcs;
+
+		run_t run;
+		run.first = i;
+		run.addr = chunk_allocated(index[i]) ? index[i].addr : 0;
+		run.size = chunk_allocated(index[i]) ? index[i].size : 0;
+
+		/* Unallocated chunks get a run of their own. */
+		for(++i; run.size > 0 && i < index.size() && index[i].offset[0] / _zcs == layer && chunk_coalesces(run.addr, run.addr + run.size, index[i]); ++i)
+			run.size = index[i].addr + index[i].size - run.addr;
+
+		run.count = i - run.first;
+		_runs.push_back(run);
+		_layer_runs[layer + 1] = _runs.size();
+	}
+
+	/* Layers without any chunks. */
+	for(size_t k = 1; k <= nlayers; ++k)
+		_layer_runs[k] = std::max(_layer_runs[k], _layer_runs[k - 1]);
+
+	_index = std::move(index);
+}
+
+void ims::chunk_reader::read_raw(uint64_t addr, uint8_t *buf, size_t size)
+{
+#if defined(_WIN32)
+	int r = _fseeki64(_raw, static_cast<__int64>(addr), SEEK_SET);
+#else
+	int r = fseeko(_raw, static_cast<off_t>(addr), SEEK_SET);
+#endif
+	if(r != 0 || fread(buf, 1, size, _raw) != size)
+	{
+		fprintf(stderr, "Error reading chunks from file.\n");
+		throw hdf5_exception();
+	}
+}
+
+/*
+ * Copy the part of a chunk inside the region and its planes [z0, z0 + nz) into dst. src of nullptr means
+ * the fill value. Planar slabs are nz planes of channel 0, then nz of channel 1, etc.
+ */
+void ims::chunk_reader::scatter(size_t c, const hsize_t *offset, const uint16_t *src, size_t z0, size_t nz, uint16_t *dst, bool planar) const noexcept
+{
+	const size_t nchan = planar ? 1 : _channels.size();
+	const uint16_t fill = _channels[c].fill;
+
+	if(planar)
+		dst += c * nz * _ys * _xs;
+	else
+		dst += c;
+
+	/* In dataset coordinates. */
+	z0 += _z0;
+	size_t zb = std::max<size_t>(offset[0], z0), ze = std::min<size_t>({offset[0] + _zcs, z0 + nz, _z0 + _zs});
+	size_t yb = std::max<size_t>(offset[1], _y0), ye = std::min<size_t>(offset[1] + _ycs, _y0 + _ys);
+	size_t xb = std::max<size_t>(offset[2], _x0), xe = std::min<size_t>(offset[2] + _xcs, _x0 + _xs);
+	if(zb >= ze || yb >= ye || xb >= xe)
+		return;
+
+	stage_timer t(_stats, stage_t::interleave, (ze - zb) * (ye - yb) * (xe - xb) * sizeof(uint16_t));
+	for(size_t z = zb; z < ze; ++z)
+	{
+		for(size_t y = yb; y < ye; ++y)
+		{
+			uint16_t *d = dst + (((z - z0) * _ys + (y - _y0)) * _xs + (xb - _x0)) * nchan;
+			if(src == nullptr)
+			{
+				for(size_t x = 0; x < xe - xb; ++x)
+					d[x * nchan] = fill;
+				continue;
+			}
+
+			const uint16_t *s = src + ((z - offset[0]) * _ycs + (y - offset[1])) * _xcs + (xb - offset[2]);
+			for(size_t x = 0; x < xe - xb; ++x)
+				d[x * nchan] = s[x];
+		}
+	}
+}
+
+void ims::chunk_reader::read_slab_contig(size_t z0, size_t nz, uint16_t *dst, size_t nthreads)
+{
+	read_slab(z0, nz, dst, false, nthreads);
+}
+
+void ims::chunk_reader::read_slab_planar(size_t z0, size_t nz, uint16_t *dst, size_t nthreads)
+{
+	read_slab(z0, nz, dst, true, nthreads);
+}
+
+void ims::chunk_reader::read_slab(size_t z0, size_t nz, uint16_t *dst, bool planar, size_t nthreads)
+{
+	const size_t nchan = _channels.size();
+	const size_t chunk_bytes = _zcs * _ycs * _xcs * sizeof(uint16_t);
+
+	/* Every chunk layer touching [z0, z0 + nz) of the region */
+	const size_t zend = _z0 + std::min(z0 + nz, _zs);
+	const size_t zc0 = (_z0 + z0) / _zcs;
+	const size_t zc1 = zend / _zcs + static_cast<size_t>(!!(zend % _zcs));
+
+	if(_map)
+	{
+		/* Chunks are scattered straight from the mapping, the page cache does the rest. */
+		const size_t r0 = _layer_runs[zc0], r1 = _layer_runs[zc1];
+		parallel_for(r1 - r0, nthreads, [&](size_t n) {
+			const run_t& run = _runs[r0 + n];
+			for(size_t i = run.first; i < run.first + run.count; ++i)
+			{
+				const chunk_info_t& ci = _index[i];
+				const uint16_t *src = nullptr;
+				if(chunk_allocated(ci))
+				{
+					if(ci.addr + ci.size > _map->size() || ci.size != chunk_bytes)
+						throw hdf5_exception();
+
+					src = reinterpret_cast<const uint16_t*>(_map->data() + ci.addr);
+				}
+
+				scatter(ci.channel, ci.offset, src, z0, nz, dst, planar);
+			}
+		});
+		return;
+	}
+
+	if(_raw)
+	{
+		/*
+		 * Reads are issued one at a time in file order, so the disk sees one long sequential
+		 * stream. Everything else (decompression, scattering) overlaps on the other threads.
+		 */
+		const size_t r0 = _layer_runs[zc0], r1 = _layer_runs[zc1];
+		std::mutex m;
+		std::condition_variable cv;
+		size_t turn = r0;
+
+		parallel_for(r1 - r0, nthreads, [&](size_t n) {
+			const run_t& run = _runs[r0 + n];
+			thread_local std::vector<uint8_t> buf, a, b;
+
+			{
+				std::unique_lock<std::mutex> l(m);
+				cv.wait(l, [&]() { return turn == r0 + n; });
+
+				/* Always pass the turn on, even if the read fails. */
+				auto next = [&]() { ++turn; cv.notify_all(); };
+				try
+				{
+					if(run.size > 0)
+					{
+						buf.resize(run.size);
+						stage_timer t(_stats, stage_t::read, run.size);
+						read_raw(run.addr, buf.data(), run.size);
+					}
+				}
+				catch(...)
+				{
+					next();
+					throw;
+				}
+				next();
+			}
+
+			for(size_t i = run.first; i < run.first + run.count; ++i)
+			{
+				const chunk_info_t& ci = _index[i];
+				const uint16_t *src = nullptr;
+				if(chunk_allocated(ci))
+				{
+					const uint8_t *data = buf.data() + (ci.addr - run.addr);
+					stage_timer t(_stats, stage_t::decompress, chunk_bytes);
+					src = reinterpret_cast<const uint16_t*>(unfilter(_channels[ci.channel].filters, ci.filter_mask, data, ci.size, a, b, chunk_bytes));
+				}
+
+				scatter(ci.channel, ci.offset, src, z0, nz, dst, planar);
+			}
+		});
+		return;
+	}
+
+#if H5_VERSION_GE(1, 10, 3)
+	/* Only the chunks the region touches. */
+	const size_t yc0 = _y0 / _ycs, yc1 = (_y0 + _ys) / _ycs + static_cast<size_t>(!!((_y0 + _ys) % _ycs));
+	const size_t xc0 = _x0 / _xcs, xc1 = (_x0 + _xs) / _xcs + static_cast<size_t>(!!((_x0 + _xs) % _xcs));
+	const size_t nychunks = yc1 - yc0;
+	const size_t nxchunks = xc1 - xc0;
+	const size_t njobs = (zc1 - zc0) * nchan * nychunks * nxchunks;
+
+	parallel_for(njobs, nthreads, [&](size_t n) {
+		size_t i = xc0 + n % nxchunks; n /= nxchunks;
+		size_t j = yc0 + n % nychunks; n /= nychunks;
+		size_t c = n % nchan; n /= nchan;
+		size_t k = zc0 + n;
+
+		const channel_t& ch = _channels[c];
+		hsize_t offset[3] = {k * _zcs, j * _ycs, i * _xcs};
+
+		thread_local std::vector<uint8_t> raw, a, b;
+		uint32_t mask = 0;
+		hsize_t size = 0;
+		{
+			hdf5_lock l(hdf5_mutex());
+			if(H5Dget_chunk_storage_size(ch.dataset.get(), offset, &size) < 0)
+				size = 0;
+
+			if(size > 0)
+			{
+				raw.resize(size);
+				stage_timer t(_stats, stage_t::read, size);
+				if(H5Dread_chunk(ch.dataset.get(), H5P_DEFAULT, offset, &mask, raw.data()) < 0)
+					throw hdf5_exception();
+			}
+		}
+
+		const uint16_t *src = nullptr;
+		if(size > 0)
+		{
+			stage_timer t(_stats, stage_t::decompress, chunk_bytes);
+			src = reinterpret_cast<const uint16_t*>(unfilter(ch.filters, mask, raw.data(), raw.size(), a, b, chunk_bytes));
+		}
+
+		scatter(c, offset, src, z0, nz, dst, planar);
+	});
+#else
+	(void)nchan; (void)chunk_bytes; (void)nthreads;
+	throw hdf5_exception();
+#endif
+}
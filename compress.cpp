@@ -0,0 +1,231 @@
+/*
+Dragonfly IMS to TiFF converter
+https://github.com/UQ-RCC/ims2tif
+
+SPDX-License-Identifier: Apache-2.0
+Copyright (c) 2019 The University of Queensland
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+/*
+ * Strip encoders for compressed TIFF output. Each strip is encoded independently
+ * so they can be done in parallel, then written raw with TIFFWriteRawStrip().
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include "ims2tif.hpp"
+
+#if defined(IMS2TIF_HAVE_ZLIB)
+#	include <zlib.h>
+#endif
+
+#if defined(IMS2TIF_HAVE_ZSTD)
+#	include <zstd.h>
+#endif
+
+using namespace ims;
+
+bool ims::compression_supported(compression_t c) noexcept
+{
+	switch(c)
+	{
+		case compression_t::none:
+		case compression_t::lzw:
+			return true;
+		case compression_t::deflate:
+#if defined(IMS2TIF_HAVE_ZLIB)
+			return true;
+#else
+			return false;
+#endif
+		case compression_t::zstd:
+#if defined(IMS2TIF_HAVE_ZSTD)
+			return true;
+#else
+			return false;
+#endif
+	}
+	return false;
+}
+
+/*
+ * TIFF-flavoured LZW: MSB-first codes of 9 to 12 bits, starting with a Clear code,
+ * widening one code early, and clearing before the table is full.
+ */
+namespace {
+
+constexpr uint32_t LZW_CLEAR = 256;
+constexpr uint32_t LZW_EOI = 257;
+constexpr uint32_t LZW_FIRST = 258;
+constexpr uint32_t LZW_BITS_MIN = 9;
+constexpr uint32_t LZW_BITS_MAX = 12;
+constexpr uint32_t LZW_CODE_MAX = (1u << LZW_BITS_MAX) - 1;
+constexpr size_t LZW_HASH_SIZE = 8192; /* Power of 2, comfortably more than 4096 codes. */
+
+struct lzw_encoder
+{
+	explicit lzw_encoder(std::vector<uint8_t>& out) :
+		out(out),
+		keys(LZW_HASH_SIZE),
+		vals(LZW_HASH_SIZE)
+	{}
+
+	void put(uint32_t code)
+	{
+		bitbuf = (bitbuf << nbits) | code;
+		nbitbuf += nbits;
+		while(nbitbuf >= 8)
+		{
+			nbitbuf -= 8;
+			out.push_back(static_cast<uint8_t>(bitbuf >> nbitbuf));
+		}
+	}
+
+	void flush()
+	{
+		if(nbitbuf > 0)
+			out.push_back(static_cast<uint8_t>(bitbuf << (8 - nbitbuf)));
+		nbitbuf = 0;
+	}
+
+	void reset()
+	{
+		std::fill(keys.begin(), keys.end(), 0);
+		next = LZW_FIRST;
+		nbits = LZW_BITS_MIN;
+	}
+
+	/* Slot for (prefix, byte), either holding it or empty. */
+	size_t find(uint32_t key) const noexcept
+	{
+		size_t h = (key * 2654435761u) & (LZW_HASH_SIZE - 1);
+		while(keys[h] != 0 && keys[h] != key)
+			h = (h + 1) & (LZW_HASH_SIZE - 1);
+		return h;
+	}
+
+	/* A code has been written and an entry added, widen or clear as needed. */
+	void bump()
+	{
+		if(++next == LZW_CODE_MAX - 1)
+		{
+			put(LZW_CLEAR);
+			reset();
+		}
+		else if(next > (1u << nbits) - 1)
+		{
+			++nbits;
+		}
+	}
+
+	void encode(const uint8_t *src, size_t size)
+	{
+		reset();
+		put(LZW_CLEAR);
+		if(size == 0)
+		{
+			put(LZW_EOI);
+			flush();
+			return;
+		}
+
+		uint32_t ent = src[0];
+		for(size_t i = 1; i < size; ++i)
+		{
+			uint32_t key = ((ent << 8) | src[i]) + 1;
+			size_t h = find(key);
+			if(keys[h] != 0)
+			{
+				ent = vals[h];
+				continue;
+			}
+
+			put(ent);
+			keys[h] = key;
+			vals[h] = static_cast<uint16_t>(next);
+			bump();
+			ent = src[i];
+		}
+
+		put(ent);
+		bump();
+		put(LZW_EOI);
+		flush();
+	}
+
+	std::vector<uint8_t>& out;
+	std::vector<uint32_t> keys; /* ((prefix << 8) | byte) + 1, 0 if empty. */
+	std::vector<uint16_t> vals;
+	uint32_t next = LZW_FIRST;
+	uint32_t nbits = LZW_BITS_MIN;
+	uint64_t bitbuf = 0;
+	uint32_t nbitbuf = 0;
+};
+
+}
+
+void ims::compress_strip(compression_t c, int level, const uint8_t *src, size_t size, std::vector<uint8_t>& out)
+{
+	out.clear();
+
+	if(c == compression_t::none)
+	{
+		out.assign(src, src + size);
+		return;
+	}
+
+	if(c == compression_t::lzw)
+	{
+		/* Can expand by up to 12/8, plus the Clear and EOI codes. */
+		out.reserve(size + size / 2 + 8);
+		lzw_encoder(out).encode(src, size);
+		return;
+	}
+
+#if defined(IMS2TIF_HAVE_ZLIB)
+	if(c == compression_t::deflate)
+	{
+		uLongf len = compressBound(static_cast<uLong>(size));
+		out.resize(len);
+		if(compress2(out.data(), &len, src, static_cast<uLong>(size), level > 0 ? level : Z_DEFAULT_COMPRESSION) != Z_OK)
+		{
+			fprintf(stderr, "Error compressing strip.\n");
+			throw tiff_exception();
+		}
+		out.resize(len);
+		return;
+	}
+#endif
+
+#if defined(IMS2TIF_HAVE_ZSTD)
+	if(c == compression_t::zstd)
+	{
+		/* Same default as libtiff. */
+		out.resize(ZSTD_compressBound(size));
+		size_t len = ZSTD_compress(out.data(), out.size(), src, size, level > 0 ? level : 9);
+		if(ZSTD_isError(len))
+		{
+			fprintf(stderr, "Error compressing strip: %s\n", ZSTD_getErrorName(len));
+			throw tiff_exception();
+		}
+		out.resize(len);
+		return;
+	}
+#endif
+
+	(void)level;
+	throw tiff_exception();
+}
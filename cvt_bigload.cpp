@@ -18,6 +18,7 @@ See the License for the specific language governing permissions and
 limitations under the License.
 */
 
+#include <chrono>
 #include "ims2tif.hpp"
 
 using namespace ims;
@@ -52,52 +53,85 @@ static void planar_to_contig_3chan(uint16_t *planar, size_t xs, size_t ys, size_
 	}
 }
 
-/* TODO: Optimise this. Or just do it on a GPU. */
-static void planar_to_contig(uint16_t *planar, size_t xs, size_t ys, size_t zs, size_t num_channels, uint16_t *contig)
+void ims::converter_bigload(page_writer& out, hid_t timepoint, size_t xs, size_t ys, size_t zs, size_t nchan, const convert_opts_t& opts)
 {
-	size_t chansize = xs * ys * zs;
-	size_t imgsize = xs * ys * num_channels;
+	const size_t chansize = xs * ys * zs;
+	const size_t bufsize = xs * ys * zs * nchan;
 
-	for(size_t z = 0; z < zs; ++z)
+	/* If the channels are stored as-is, use them where they are. */
+	std::shared_ptr<source_map> map = source_map::open(timepoint);
+	std::vector<const uint16_t*> chans(nchan, nullptr);
+	bool mapped = map != nullptr;
+	for(size_t c = 0; mapped && c < nchan; ++c)
+		mapped = (chans[c] = map->map_channel(timepoint, opts.region, c, xs, ys, zs)) != nullptr;
+
+	if(mapped)
 	{
-		uint16_t *imgstart = contig + (z * imgsize);
+		for(size_t c = 0; c < nchan; ++c)
+			map->advise_sequential(reinterpret_cast<const uint8_t*>(chans[c]) - map->data(), chansize * sizeof(uint16_t));
+	}
+	else
+	{
+		map.reset();
+	}
 
-		for(size_t i = 0; i < xs * ys; ++i)
+	/* Need 2 buffers, unless writing planar. Don't need the first if mapped. */
+	size_t nbufs = (mapped ? 0 : 1) + (opts.planar ? 0 : 1);
+	std::unique_ptr<uint16_t[]> buffer = std::make_unique<uint16_t[]>(bufsize * nbufs);
+
+	uint16_t *imgbuf = buffer.get();
+	uint16_t *contigbuf = mapped ? buffer.get() : buffer.get() + bufsize;
+
+	/* Read the channel data. It's planar, so we have to read the entire timepoint. */
+	if(!mapped)
+	{
+		hdf5_lock l(hdf5_mutex());
+		for(size_t c = 0; c < nchan; ++c)
 		{
-			for(size_t c = 0; c < num_channels; ++c)
-			{
-				uint16_t *croot = planar + (c * chansize);
-				uint16_t *cstart = croot + (z * xs * ys) + i;
-				*imgstart++ = *cstart;
-			}
+			uint16_t *chanstart = imgbuf + (chansize * c);
+			stage_timer t(opts.stats, stage_t::read, chansize * sizeof(uint16_t));
+			if(read_channel(timepoint, opts.region, c, chanstart, xs, ys, zs) < 0)
+				throw hdf5_exception();
+
+			chans[c] = chanstart;
 		}
 	}
-}
 
-void ims::converter_bigload(TIFF *tiff, hid_t timepoint, size_t xs, size_t ys, size_t zs, size_t nchan)
-{
-	const size_t chansize = xs * ys * zs;
-	const size_t bufsize = xs * ys * zs * nchan;
+	if(opts.verbose && mapped)
+		fprintf(stderr, "bigload: reading channels straight from the source file\n");
 
-	/* Need 2 buffers. */
-	std::unique_ptr<uint16_t[]> buffer = std::make_unique<uint16_t[]>(bufsize * 2);
+	/* Already planar, straight out. */
+	if(opts.planar)
+	{
+		std::vector<const uint16_t*> planes(nchan);
+		for(size_t z = 0; z < zs; ++z)
+		{
+			for(size_t c = 0; c < nchan; ++c)
+				planes[c] = chans[c] + (z * xs * ys);
 
-	uint16_t *imgbuf = buffer.get();
-	uint16_t *contigbuf = buffer.get() + bufsize;
+			out.write_page_planar(z, planes.data());
+		}
+		return;
+	}
 
-	/* Read the channel data. It's planar, so we have to read the entire timepoint. */
-	for(size_t c = 0; c < nchan; ++c)
+	auto start = std::chrono::steady_clock::now();
 	{
-		uint16_t *chanstart = imgbuf + (chansize * c);
-		if(read_channel(timepoint, c, chanstart, xs, ys, zs) < 0)
-			throw hdf5_exception();
+		stage_timer t(opts.stats, stage_t::interleave, bufsize * sizeof(uint16_t));
+		interleave_tiled(chans.data(), nchan, xs * ys, zs, contigbuf, opts.threads);
+	}
+	std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+	if(opts.verbose)
+	{
+		/* Count both the read and the write, that's what the memory bus sees. */
+		double gb = 2.0 * bufsize * sizeof(uint16_t) / 1e9;
+		fprintf(stderr, "interleave: %.3f GB in %.3f s, %.2f GB/s (%s, %zu threads)\n",
+			gb, secs.count(), gb / secs.count(), interleave_isa(), opts.threads
+		);
 	}
-
-	planar_to_contig(imgbuf, xs, ys, zs, nchan, contigbuf);
 
 	for(size_t z = 0; z < zs; ++z)
 	{
 		uint16_t *imgstart = contigbuf + (z * (xs * ys * nchan));
-		tiff_write_page_contig(tiff, xs, ys, nchan, z, zs, imgstart);
+		out.write_page_contig(z, imgstart);
 	}
 }
@@ -30,14 +30,13 @@ static h5g_ptr h5g_open_channel(hid_t tp, size_t c)
 	return h5g_ptr(H5Gopen2(tp, cbuf, H5P_DEFAULT));
 }
 
-/* Get the chunk size and make sure it's the same for all channels. */
-static int get_chunk_size(hid_t tp, size_t nchan, hsize_t& xs, hsize_t& ys, hsize_t& zs)
+int ims::get_chunk_size(hid_t tp, const region_t& region, size_t nchan, hsize_t& xs, hsize_t& ys, hsize_t& zs)
 {
 	xs = ys = zs = 0;
 
 	for(size_t i = 0; i < nchan; ++i)
 	{
-		h5g_ptr chan = h5g_open_channel(tp, i);
+		h5g_ptr chan = h5g_open_channel(tp, region.channel(i));
 		if(!chan)
 			return -1;
 
@@ -68,74 +67,127 @@ static int get_chunk_size(hid_t tp, size_t nchan, hsize_t& xs, hsize_t& ys, hsiz
 	return 0;
 }
 
-void ims::converter_chunk(TIFF *tiff, hid_t timepoint, size_t xs, size_t ys, size_t zs, size_t nchan)
+void ims::converter_chunk(page_writer& out, hid_t timepoint, size_t xs, size_t ys, size_t zs, size_t nchan, const convert_opts_t& opts)
 {
+	hdf5_lock l(hdf5_mutex());
+
 	hsize_t xcs, ycs, zcs;
-	if(get_chunk_size(timepoint, nchan, xcs, ycs, zcs) < 0)
+	if(get_chunk_size(timepoint, opts.region, nchan, xcs, ycs, zcs) < 0)
 		throw hdf5_exception(); /* FIXME: not really */
 
-	std::unique_ptr<uint16_t[]> buffer = std::make_unique<uint16_t[]>(zcs * ys * xs * nchan);
+	const size_t slab_size = zcs * ys * xs * nchan;
+	std::vector<std::unique_ptr<uint16_t[]>> buffers(std::max<size_t>(opts.buffers, 1));
+	for(std::unique_ptr<uint16_t[]>& buf : buffers)
+		buf = std::make_unique<uint16_t[]>(slab_size);
 
 	hsize_t memdims[] = {zcs, ys, xs * nchan};
 	h5s_ptr memspace(H5Screate_simple(sizeof(memdims) / sizeof(memdims[0]), memdims, nullptr));
 	if(!memspace)
 		throw hdf5_exception();
 
-	size_t nzchunks = zs / zcs + static_cast<size_t>(!!(zs % zcs));
-	size_t nychunks = ys / ycs + static_cast<size_t>(!!(ys % ycs));
-	size_t nxchunks = xs / xcs + static_cast<size_t>(!!(xs % xcs));
+	l.unlock();
 
-	size_t npages = 0;
+	/* Slabs are the chunk layers the region touches, and only the chunks it touches within them. */
+	const region_t& region = opts.region;
+	const slabs_t slabs(region.z0, zs, zcs);
+	const size_t nzchunks = slabs.count();
+	const size_t ychunk0 = region.y0 / ycs, ychunk1 = (region.y0 + ys) / ycs + static_cast<size_t>(!!((region.y0 + ys) % ycs));
+	const size_t xchunk0 = region.x0 / xcs, xchunk1 = (region.x0 + xs) / xcs + static_cast<size_t>(!!((region.x0 + xs) % xcs));
+
+	/* If we understand the filters, skip H5Dread() and decompress in parallel. */
+	std::unique_ptr<chunk_reader> reader = chunk_reader::open(timepoint, region, xs, ys, zs, nchan, opts.stats);
+
+	/* Read slab z into buffer b. */
+	auto read_slab = [&](size_t z, size_t b) {
+		uint16_t *buffer = buffers[b].get();
+		const size_t z0 = slabs.first(z), nz = slabs.size(z);
+
+		if(reader)
+		{
+			if(opts.planar)
+				reader->read_slab_planar(z0, nz, buffer, opts.threads);
+			else
+				reader->read_slab_contig(z0, nz, buffer, opts.threads);
+			return;
+		}
+
+		hdf5_lock l(hdf5_mutex());
+
+		/* Planar slabs are whole planes of each channel, no need to go chunk by chunk. */
+		if(opts.planar)
+		{
+			for(size_t c = 0; c < nchan; ++c)
+			{
+				stage_timer t(opts.stats, stage_t::read, nz * ys * xs * sizeof(uint16_t));
+				if(read_channel_slab(timepoint, region, c, buffer + c * nz * ys * xs, xs, ys, z0, nz) < 0)
+					throw hdf5_exception();
+			}
+			return;
+		}
 
-	for(size_t z = 0; z < nzchunks; ++z)
-	{
 		for(size_t c = 0; c < nchan; ++c)
 		{
-			h5g_ptr chan = h5g_open_channel(timepoint, c);
+			h5g_ptr chan = h5g_open_channel(timepoint, region.channel(c));
 			h5d_ptr dataset(H5Dopen2(chan.get(), "Data", H5P_DEFAULT));
 			h5s_ptr dspace(H5Dget_space(dataset.get()));
-			for(size_t j = 0; j < nychunks; ++j)
+			for(size_t j = ychunk0; j < ychunk1; ++j)
 			{
-				for(size_t i = 0; i < nxchunks; ++i)
+				for(size_t i = xchunk0; i < xchunk1; ++i)
 				{
-					hsize_t offset[3] = {z * zcs, j * ycs, i * xcs};
+					/* Edge chunks may hang off the region, only read what's in it. */
+					hsize_t yb = std::max<hsize_t>(j * ycs, region.y0), ye = std::min<hsize_t>((j + 1) * ycs, region.y0 + ys);
+					hsize_t xb = std::max<hsize_t>(i * xcs, region.x0), xe = std::min<hsize_t>((i + 1) * xcs, region.x0 + xs);
+
+					hsize_t offset[3] = {region.z0 + z0, yb, xb};
 					hsize_t stride[3] = {1, 1, 1};
-					hsize_t count[3] = {zcs, ycs, xcs};
+					hsize_t count[3] = {nz, ye - yb, xe - xb};
 					hsize_t blocksize[3] = {1, 1, 1};
 
-					// fprintf(stderr, "    offset = {%4zu, %4zu, %4zu},     stride = {%zu, %zu, %zu},     count = {%zu, %zu, %zu},     blocksize = {%zu, %zu, %zu}\n",
-					// 	offset[0], offset[1], offset[2],
-					// 	stride[0], stride[1], stride[2],
-					// 	count[0], count[1], count[2],
-					// 	blocksize[0], blocksize[1], blocksize[2]
-					// );
 					if(H5Sselect_hyperslab(dspace.get(), H5S_SELECT_SET, offset, stride, count, blocksize) < 0)
 						throw hdf5_exception();
 
-					hsize_t mem_offset[3] = {0, j * ycs, (i * xcs * nchan) + c};
+					hsize_t mem_offset[3] = {0, yb - region.y0, ((xb - region.x0) * nchan) + c};
 					hsize_t mem_stride[3] = {1, 1, nchan};
-					hsize_t mem_count[3] = {zcs, ycs, xcs};
+					hsize_t mem_count[3] = {count[0], count[1], count[2]};
 					hsize_t mem_blocksize[3] = {1, 1, 1};
-					// fprintf(stderr, "mem_offset = {%4zu, %4zu, %4zu}, mem_stride = {%zu, %zu, %zu}, mem_count = {%zu, %zu, %zu}, mem_blocksize = {%zu, %zu, %zu}\n",
-					// 	mem_offset[0], mem_offset[1], mem_offset[2],
-					// 	mem_stride[0], mem_stride[1], mem_stride[2],
-					// 	mem_count[0], mem_count[1], mem_count[2],
-					// 	mem_blocksize[0], mem_blocksize[1], mem_blocksize[2]
-					// );
 					if(H5Sselect_hyperslab(memspace.get(), H5S_SELECT_SET, mem_offset, mem_stride, mem_count, mem_blocksize) < 0)
 						throw hdf5_exception();
 
-					if(H5Dread(dataset.get(), H5T_NATIVE_UINT16, memspace.get(), dspace.get(), H5P_DEFAULT, buffer.get()) < 0)
+					stage_timer t(opts.stats, stage_t::read, count[0] * count[1] * count[2] * sizeof(uint16_t));
+					if(H5Dread(dataset.get(), H5T_NATIVE_UINT16, memspace.get(), dspace.get(), H5P_DEFAULT, buffer) < 0)
 						throw hdf5_exception();
 				}
 			}
 		}
+	};
 
-		/* Here, we should have zcs images to write. */
-		for(size_t i = 0; i < zcs && npages < zs; ++i, ++npages)
+	/* Here, we should have up to zcs images to write. */
+	auto write_slab = [&](size_t z, size_t b) {
+		const size_t z0 = slabs.first(z), nz = slabs.size(z);
+		std::vector<const uint16_t*> planes(nchan);
+		for(size_t i = 0; i < nz; ++i)
 		{
-			uint16_t *imgstart = buffer.get() + (i * (xs * ys * nchan));
-			tiff_write_page_contig(tiff, xs, ys, nchan, npages, zs, imgstart);
+			if(!opts.planar)
+			{
+				out.write_page_contig(z0 + i, buffers[b].get() + (i * (xs * ys * nchan)));
+				continue;
+			}
+
+			for(size_t c = 0; c < nchan; ++c)
+				planes[c] = buffers[b].get() + (c * nz + i) * xs * ys;
+
+			out.write_page_planar(z0 + i, planes.data());
 		}
+	};
+
+	/* Read slab N + 1 while slab N is being written. */
+	pipeline_stats_t stats;
+	run_pipeline(nzchunks, buffers.size(), opts.queue_depth, read_slab, write_slab, stats);
+
+	if(opts.verbose)
+	{
+		fprintf(stderr, "pipeline: %zu slabs, %zu buffers, reader stalled %zu times (%.3f s), writer stalled %zu times (%.3f s)\n",
+			nzchunks, buffers.size(), stats.read_stalls, stats.read_stall_time, stats.write_stalls, stats.write_stall_time
+		);
 	}
 }
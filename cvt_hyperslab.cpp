@@ -22,10 +22,10 @@ limitations under the License.
 
 using namespace ims;
 
-static int chan_read_hyperslab(hid_t tp, size_t channel, uint16_t *data, size_t z, size_t xs, size_t ys, size_t zs, hsize_t nchan)
+static int chan_read_hyperslab(hid_t tp, const region_t& region, size_t channel, uint16_t *data, size_t z, size_t xs, size_t ys, hsize_t nchan)
 {
 	char cbuf[32];
-	sprintf(cbuf, "Channel %zu", channel);
+	sprintf(cbuf, "Channel %zu", region.channel(channel));
 	h5g_ptr chan(H5Gopen2(tp, cbuf, H5P_DEFAULT));
 	if(!chan)
 		return -1;
@@ -38,7 +38,7 @@ static int chan_read_hyperslab(hid_t tp, size_t channel, uint16_t *data, size_t
 	if(!dataspace)
 		return -1;
 
-	hsize_t offset[3] = {z, 0, 0};
+	hsize_t offset[3] = {region.z0 + z, region.y0, region.x0};
 	hsize_t count[3] = {1, ys, xs};
 	hsize_t stride[3] = {1, 1, 1};
 	hsize_t blocksize[3] = {1, 1, 1};
@@ -53,7 +53,6 @@ static int chan_read_hyperslab(hid_t tp, size_t channel, uint16_t *data, size_t
 	hsize_t mem_offset[3] = {0, 0, channel};
 	hsize_t mem_stride[3] = {1, 1, nchan};
 	hsize_t mem_count[3] = {1, ys, xs};
-	hsize_t mem_blocksize[3] = {1, 1, 1};
 	if(H5Sselect_hyperslab(memspace.get(), H5S_SELECT_SET, mem_offset, mem_stride, mem_count, nullptr) < 0)
 		return -1;
 
@@ -63,18 +62,43 @@ static int chan_read_hyperslab(hid_t tp, size_t channel, uint16_t *data, size_t
 	return 0;
 }
 
-void ims::converter_hyperslab(TIFF *tiff, hid_t timepoint, size_t xs, size_t ys, size_t zs, size_t nchan)
+void ims::converter_hyperslab(page_writer& out, hid_t timepoint, size_t xs, size_t ys, size_t zs, size_t nchan, const convert_opts_t& opts)
 {
 	std::unique_ptr<uint16_t[]> buffer = std::make_unique<uint16_t[]>(xs * ys * nchan);
 
+	/* Planar is just a contiguous read per channel. */
+	if(opts.planar)
+	{
+		std::vector<const uint16_t*> planes(nchan);
+		for(size_t z = 0; z < zs; ++z)
+		{
+			hdf5_lock l(hdf5_mutex());
+			for(size_t c = 0; c < nchan; ++c)
+			{
+				planes[c] = buffer.get() + c * xs * ys;
+				stage_timer t(opts.stats, stage_t::read, xs * ys * sizeof(uint16_t));
+				if(read_channel_slab(timepoint, opts.region, c, buffer.get() + c * xs * ys, xs, ys, z, 1) < 0)
+					throw hdf5_exception();
+			}
+			l.unlock();
+
+			out.write_page_planar(z, planes.data());
+		}
+		return;
+	}
+
 	for(size_t z = 0; z < zs; ++z)
 	{
-		for(size_t c = 0; c < nchan; ++c)
 		{
-			if(chan_read_hyperslab(timepoint, c, buffer.get(), z, xs, ys, zs, nchan) < 0)
-				throw hdf5_exception();
+			hdf5_lock l(hdf5_mutex());
+			for(size_t c = 0; c < nchan; ++c)
+			{
+				stage_timer t(opts.stats, stage_t::read, xs * ys * sizeof(uint16_t));
+				if(chan_read_hyperslab(timepoint, opts.region, c, buffer.get(), z, xs, ys, nchan) < 0)
+					throw hdf5_exception();
+			}
 		}
 
-		tiff_write_page_contig(tiff, xs, ys, nchan, z, zs, buffer.get());
+		out.write_page_contig(z, buffer.get());
 	}
 }
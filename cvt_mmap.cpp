@@ -0,0 +1,131 @@
+/*
+Dragonfly IMS to TiFF converter
+https://github.com/UQ-RCC/ims2tif
+
+SPDX-License-Identifier: Apache-2.0
+Copyright (c) 2019 The University of Queensland
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+/*
+ * Read straight into the output file. The writer maps its page data, and HDF5
+ * reads into it directly.
+ *
+ * Planar, each channel is a contiguous run of rows in each page, so a plain
+ * memory dataspace selection lands the data in its final place, no copies at all.
+ *
+ * Interleaved, the obvious thing is a strided memory selection (like hyperslab's),
+ * but HDF5 scatters those one element at a time, which is hundreds of times slower
+ * than reading. So read one channel's chunk layer into a small buffer and scatter
+ * it into the pages ourselves, on the TimePoint's threads.
+ *
+ * Needs a writer that can map its pages, i.e. the native one.
+ */
+
+#include <algorithm>
+#include "ims2tif.hpp"
+
+using namespace ims;
+
+/* Read planes [z0, z0 + nz) of the region's channel c into their places in planar pages, [z][c][y][x]. */
+static int read_planar_layer(hid_t tp, const region_t& region, size_t c, uint16_t *pages, size_t xs, size_t ys, size_t zs, size_t nchan, size_t z0, size_t nz)
+{
+	char cbuf[32];
+	sprintf(cbuf, "Channel %zu", region.channel(c));
+	h5g_ptr chan(H5Gopen2(tp, cbuf, H5P_DEFAULT));
+	if(!chan)
+		return -1;
+
+	h5d_ptr dataset(H5Dopen2(chan.get(), "Data", H5P_DEFAULT));
+	if(!dataset)
+		return -1;
+
+	h5s_ptr dspace(H5Dget_space(dataset.get()));
+	if(!dspace)
+		return -1;
+
+	hsize_t offset[3] = {region.z0 + z0, region.y0, region.x0};
+	hsize_t count[3] = {nz, ys, xs};
+	if(H5Sselect_hyperslab(dspace.get(), H5S_SELECT_SET, offset, nullptr, count, nullptr) < 0)
+		return -1;
+
+	/* Each page is nchan planes of ys rows, channel c's are a contiguous block of them. */
+	hsize_t memdims[3] = {zs, ys * nchan, xs};
+	h5s_ptr memspace(H5Screate_simple(3, memdims, nullptr));
+	if(!memspace)
+		return -1;
+
+	hsize_t mem_offset[3] = {z0, c * ys, 0};
+	if(H5Sselect_hyperslab(memspace.get(), H5S_SELECT_SET, mem_offset, nullptr, count, nullptr) < 0)
+		return -1;
+
+	if(H5Dread(dataset.get(), H5T_NATIVE_UINT16, memspace.get(), dspace.get(), H5P_DEFAULT, pages) < 0)
+		return -1;
+
+	return 0;
+}
+
+void ims::converter_mmap(page_writer& out, hid_t timepoint, size_t xs, size_t ys, size_t zs, size_t nchan, const convert_opts_t& opts)
+{
+	uint16_t *pages = out.map_pages();
+	if(pages == nullptr)
+	{
+		fprintf(stderr, "The mmap method needs the native writer.\n");
+		throw tiff_exception();
+	}
+
+	/* Go a chunk layer at a time, so each chunk is read once. */
+	const slabs_t slabs(opts.region.z0, zs, get_slab_depth(timepoint, opts.region, xs, ys, zs, nchan));
+	const size_t plane_size = xs * ys;
+
+	std::unique_ptr<uint16_t[]> staging;
+	if(!opts.planar)
+		staging = std::make_unique<uint16_t[]>(slabs.depth * plane_size);
+
+	for(size_t s = 0; s < slabs.count(); ++s)
+	{
+		const size_t z = slabs.first(s), nz = slabs.size(s);
+		for(size_t c = 0; c < nchan; ++c)
+		{
+			if(opts.planar)
+			{
+				hdf5_lock l(hdf5_mutex());
+				stage_timer t(opts.stats, stage_t::read, nz * plane_size * sizeof(uint16_t));
+				if(read_planar_layer(timepoint, opts.region, c, pages, xs, ys, zs, nchan, z, nz) < 0)
+					throw hdf5_exception();
+				continue;
+			}
+
+			{
+				hdf5_lock l(hdf5_mutex());
+				stage_timer t(opts.stats, stage_t::read, nz * plane_size * sizeof(uint16_t));
+				if(read_channel_slab(timepoint, opts.region, c, staging.get(), xs, ys, z, nz) < 0)
+					throw hdf5_exception();
+			}
+
+			/* Every nchan'th sample. */
+			stage_timer t(opts.stats, stage_t::interleave, nz * plane_size * sizeof(uint16_t));
+			parallel_for(nz * ys, opts.threads, [&](size_t row) {
+				const uint16_t *src = staging.get() + row * xs;
+				uint16_t *dst = pages + (z * plane_size + row * xs) * nchan + c;
+				for(size_t x = 0; x < xs; ++x)
+					dst[x * nchan] = src[x];
+			});
+		}
+
+		/* Pages are filled in place, the writer never sees them. */
+		if(opts.progress != nullptr)
+			opts.progress->add_pages(nz, nz * plane_size * nchan * sizeof(uint16_t));
+	}
+}
@@ -0,0 +1,187 @@
+/*
+Dragonfly IMS to TiFF converter
+https://github.com/UQ-RCC/ims2tif
+
+SPDX-License-Identifier: Apache-2.0
+Copyright (c) 2019 The University of Queensland
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+/*
+ * Like bigload, but a Z-slab at a time. Each channel's slab is read with a single
+ * contiguous H5Dread(), then interleaved with the SIMD kernels.
+ *
+ * Slabs line up with the chunks, so every chunk is read and decompressed exactly once.
+ * When writing planar, the slabs go straight to the writer without interleaving.
+ * The next slab is read while the current one is interleaved and written.
+ * If the channels can be mapped straight from the source file, there's nothing to read.
+ */
+
+#include <chrono>
+#include <algorithm>
+#include "ims2tif.hpp"
+
+using namespace ims;
+
+/* Slab size to aim for when the data isn't chunked. */
+constexpr size_t UNCHUNKED_SLAB_BYTES = 64 * 1024 * 1024;
+
+size_t ims::get_slab_depth(hid_t timepoint, const region_t& region, size_t xs, size_t ys, size_t zs, size_t nchan)
+{
+	hdf5_lock l(hdf5_mutex());
+
+	hsize_t xcs, ycs, zcs;
+	if(get_chunk_size(timepoint, region, nchan, xcs, ycs, zcs) == 0 && zcs > 0)
+		return std::min<size_t>(zcs, zs);
+
+	size_t plane_bytes = xs * ys * nchan * sizeof(uint16_t);
+	return std::clamp<size_t>(UNCHUNKED_SLAB_BYTES / plane_bytes, 1, zs);
+}
+
+ims::slabs_t::slabs_t(size_t z0, size_t zs, size_t depth) noexcept :
+	zs(zs),
+	depth(depth),
+	lead(z0 % depth)
+{}
+
+size_t ims::slabs_t::count() const noexcept
+{
+	return (lead + zs) / depth + static_cast<size_t>(!!((lead + zs) % depth));
+}
+
+size_t ims::slabs_t::first(size_t s) const noexcept
+{
+	return s == 0 ? 0 : s * depth - lead;
+}
+
+size_t ims::slabs_t::size(size_t s) const noexcept
+{
+	return std::min((s + 1) * depth - lead, zs) - first(s);
+}
+
+void ims::converter_slab(page_writer& out, hid_t timepoint, size_t xs, size_t ys, size_t zs, size_t nchan, const convert_opts_t& opts)
+{
+	const size_t depth = get_slab_depth(timepoint, opts.region, xs, ys, zs, nchan);
+	const slabs_t slabs(opts.region.z0, zs, depth);
+	const size_t nslabs = slabs.count();
+	const size_t plane_size = xs * ys;
+	const size_t slab_size = plane_size * depth * nchan;
+
+	/* If the channels are stored as-is, the slabs are already in memory. */
+	std::shared_ptr<source_map> map = source_map::open(timepoint);
+	std::vector<const uint16_t*> chans(nchan, nullptr);
+	bool mapped = map != nullptr;
+	for(size_t c = 0; mapped && c < nchan; ++c)
+		mapped = (chans[c] = map->map_channel(timepoint, opts.region, c, xs, ys, zs)) != nullptr;
+
+	if(mapped)
+	{
+		for(size_t c = 0; c < nchan; ++c)
+			map->advise_sequential(reinterpret_cast<const uint8_t*>(chans[c]) - map->data(), plane_size * zs * sizeof(uint16_t));
+	}
+
+	/* Planar slabs cycle through the pipeline, there's only one contiguous one. */
+	std::vector<std::unique_ptr<uint16_t[]>> planar(mapped ? 0 : std::max<size_t>(opts.buffers, 1));
+	for(std::unique_ptr<uint16_t[]>& buf : planar)
+		buf = std::make_unique<uint16_t[]>(slab_size);
+
+	std::unique_ptr<uint16_t[]> contig;
+	if(!opts.planar)
+		contig = std::make_unique<uint16_t[]>(slab_size);
+
+	double interleave_secs = 0.0;
+
+	/* Read slab s into buffer b, each channel's planes back to back. */
+	auto read_slab = [&](size_t s, size_t b) {
+		size_t z0 = slabs.first(s), nz = slabs.size(s);
+
+		hdf5_lock l(hdf5_mutex());
+		for(size_t c = 0; c < nchan; ++c)
+		{
+			stage_timer t(opts.stats, stage_t::read, plane_size * nz * sizeof(uint16_t));
+			if(read_channel_slab(timepoint, opts.region, c, planar[b].get() + c * plane_size * nz, xs, ys, z0, nz) < 0)
+				throw hdf5_exception();
+		}
+	};
+
+	/* Where channel c of slab s starts, in buffer b. */
+	auto slab_channel = [&](size_t s, size_t b, size_t c) -> const uint16_t* {
+		size_t z0 = slabs.first(s), nz = slabs.size(s);
+		if(mapped)
+			return chans[c] + z0 * plane_size;
+
+		return planar[b].get() + c * plane_size * nz;
+	};
+
+	auto write_slab = [&](size_t s, size_t b) {
+		size_t z0 = slabs.first(s), nz = slabs.size(s);
+
+		std::vector<const uint16_t*> planes(nchan);
+		if(opts.planar)
+		{
+			for(size_t z = 0; z < nz; ++z)
+			{
+				for(size_t c = 0; c < nchan; ++c)
+					planes[c] = slab_channel(s, b, c) + z * plane_size;
+
+				out.write_page_planar(z0 + z, planes.data());
+			}
+			return;
+		}
+
+		for(size_t c = 0; c < nchan; ++c)
+			planes[c] = slab_channel(s, b, c);
+
+		auto start = std::chrono::steady_clock::now();
+		{
+			stage_timer t(opts.stats, stage_t::interleave, plane_size * nz * nchan * sizeof(uint16_t));
+			interleave_tiled(planes.data(), nchan, plane_size, nz, contig.get(), opts.threads);
+		}
+		interleave_secs += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		for(size_t z = 0; z < nz; ++z)
+			out.write_page_contig(z0 + z, contig.get() + z * plane_size * nchan);
+	};
+
+	pipeline_stats_t stats;
+	if(mapped)
+	{
+		/* Nothing to read, the page cache reads ahead for us. */
+		for(size_t s = 0; s < nslabs; ++s)
+			write_slab(s, 0);
+	}
+	else
+	{
+		run_pipeline(nslabs, planar.size(), opts.queue_depth, read_slab, write_slab, stats);
+	}
+
+	if(opts.verbose && !opts.planar)
+	{
+		double gb = 2.0 * plane_size * zs * nchan * sizeof(uint16_t) / 1e9;
+		fprintf(stderr, "interleave: %.3f GB in %.3f s, %.2f GB/s (%s, %zu threads)\n",
+			gb, interleave_secs, gb / interleave_secs, interleave_isa(), opts.threads
+		);
+	}
+
+	if(opts.verbose && mapped)
+	{
+		fprintf(stderr, "pipeline: %zu slabs of %zu planes, read straight from the source file\n", nslabs, depth);
+	}
+	else if(opts.verbose)
+	{
+		fprintf(stderr, "pipeline: %zu slabs of %zu planes, %zu buffers, reader stalled %zu times (%.3f s), writer stalled %zu times (%.3f s)\n",
+			nslabs, depth, planar.size(), stats.read_stalls, stats.read_stall_time, stats.write_stalls, stats.write_stall_time
+		);
+	}
+}
@@ -0,0 +1,118 @@
+/*
+Dragonfly IMS to TiFF converter
+https://github.com/UQ-RCC/ims2tif
+
+SPDX-License-Identifier: Apache-2.0
+Copyright (c) 2019 The University of Queensland
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+/*
+ * Following a file that's still being written.
+ *
+ * The file is reopened on every poll rather than held open, so each pass sees whatever the
+ * writer has flushed since. If the writer is using SWMR, it's opened for SWMR reading, which
+ * guarantees a consistent view. Otherwise we rely on the writer not touching a TimePoint once
+ * it's moved on to the next, which is how the Dragonfly (and Imaris) write them.
+ */
+
+#include <system_error>
+#include "ims2tif.hpp"
+
+namespace fs = std::filesystem;
+
+using namespace ims;
+
+/* See xH5Fopen() in ims2tif.cpp. */
+static hid_t open_file(const fs::path& path, unsigned flags, hid_t fapl) noexcept
+{
+#if defined(_WIN32)
+	return H5Fopen(path.u8string().c_str(), flags, fapl);
+#else
+	return H5Fopen(path.c_str(), flags, fapl);
+#endif
+}
+
+hid_t ims::open_growing_file(const fs::path& path) noexcept
+{
+	h5p_ptr fapl(H5Pcreate(H5P_FILE_ACCESS));
+	if(!fapl)
+		return H5I_INVALID_HID;
+
+#if H5_VERSION_GE(1, 10, 7)
+	/* The writer may hold a lock on it. We only ever read. */
+	if(H5Pset_file_locking(fapl.get(), false, true) < 0)
+		return H5I_INVALID_HID;
+#endif
+
+	/*
+	 * A writer not using SWMR makes this fail, so try again without it. A file that's only
+	 * just been created may not open either way yet, so keep quiet and let the caller say.
+	 */
+	H5E_auto2_t func;
+	void *data;
+	if(H5Eget_auto2(H5E_DEFAULT, &func, &data) < 0 || H5Eset_auto2(H5E_DEFAULT, nullptr, nullptr) < 0)
+		return H5I_INVALID_HID;
+
+	hid_t fd = open_file(path, H5F_ACC_RDONLY | H5F_ACC_SWMR_READ, fapl.get());
+	if(fd < 0)
+		fd = open_file(path, H5F_ACC_RDONLY, fapl.get());
+
+	H5Eset_auto2(H5E_DEFAULT, func, data);
+	return fd;
+}
+
+size_t ims::count_timepoints(hid_t rlevel) noexcept
+{
+	char tpbuf[32];
+	size_t n = 0;
+	for(;; ++n)
+	{
+		sprintf(tpbuf, "TimePoint %zu", n);
+		if(H5Lexists(rlevel, tpbuf, H5P_DEFAULT) <= 0)
+			return n;
+	}
+}
+
+growth_watch::growth_watch(const fs::path& path) :
+	_path(path),
+	_size(UINTMAX_MAX),
+	_changed(std::chrono::steady_clock::now())
+{
+	poll();
+}
+
+bool growth_watch::poll()
+{
+	std::error_code ec;
+	uintmax_t size = fs::file_size(_path, ec);
+	if(ec)
+		size = UINTMAX_MAX;
+
+	fs::file_time_type mtime = fs::last_write_time(_path, ec);
+	if(ec)
+		mtime = fs::file_time_type::min();
+
+	if(size == _size && mtime == _mtime)
+		return false;
+
+	_size = size;
+	_mtime = mtime;
+	_changed = std::chrono::steady_clock::now();
+	return true;
+}
+
+double growth_watch::idle_seconds() const noexcept
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - _changed).count();
+}
@@ -20,9 +20,14 @@ limitations under the License.
 
 #include <cstring>
 #include <array>
+#include <algorithm>
 #include <tiffio.h>
 #include "ims2tif.hpp"
 
+using namespace ims;
+
+void ims::tiff_deleter::operator()(pointer t) noexcept { TIFFClose(t); }
+
 std::optional<std::string> ims::hdf5_read_attribute(hid_t id, const char *name) noexcept
 {
 	h5a_ptr att(H5Aopen_by_name(id, ".", name, H5P_DEFAULT, H5P_DEFAULT));
@@ -57,10 +62,15 @@ std::optional<size_t> ims::hdf5_read_uint_attribute(hid_t id, const char *name)
 	return v;
 }
 
-int ims::read_channel(hid_t tp, size_t channel, uint16_t *data, size_t xs, size_t ys, size_t zs) noexcept
+int ims::read_channel(hid_t tp, const region_t& region, size_t channel, uint16_t *data, size_t xs, size_t ys, size_t zs) noexcept
+{
+	return read_channel_slab(tp, region, channel, data, xs, ys, 0, zs);
+}
+
+int ims::read_channel_slab(hid_t tp, const region_t& region, size_t channel, uint16_t *data, size_t xs, size_t ys, size_t z0, size_t nz) noexcept
 {
 	char cbuf[32];
-	sprintf(cbuf, "Channel %zu", channel);
+	sprintf(cbuf, "Channel %zu", region.channel(channel));
 	h5g_ptr chan(H5Gopen2(tp, cbuf, H5P_DEFAULT));
 	if(!chan)
 		return -1;
@@ -73,54 +83,295 @@ int ims::read_channel(hid_t tp, size_t channel, uint16_t *data, size_t xs, size_
 	if(!dataspace)
 		return -1;
 
-	/* Sometimes if the dataset isn't POT, it's padded up to the next POT. Account for this. */
-	hsize_t offset[3] = {0, 0, 0};
-	hsize_t count[3] = {zs, ys, xs};
+	/*
+	 * Sometimes if the dataset isn't POT, it's padded up to the next POT. Account for this.
+	 * Only the region is selected, so only the chunks it touches are read.
+	 */
+	hsize_t offset[3] = {region.z0 + z0, region.y0, region.x0};
+	hsize_t count[3] = {nz, ys, xs};
 	hsize_t stride[3] = {1, 1, 1};
 	hsize_t blocksize[3] = {1, 1, 1};
 	if(H5Sselect_hyperslab(dataspace.get(), H5S_SELECT_SET, offset, stride, count, blocksize) < 0)
 		return -1;
 
-	if(H5Dread(d.get(), H5T_NATIVE_UINT16, H5S_ALL, dataspace.get(), H5P_DEFAULT, data) < 0)
+	/* The memory side is the unpadded size. */
+	h5s_ptr memspace(H5Screate_simple(3, count, nullptr));
+	if(!memspace)
+		return -1;
+
+	if(H5Dread(d.get(), H5T_NATIVE_UINT16, memspace.get(), dataspace.get(), H5P_DEFAULT, data) < 0)
 		return -1;
 
 	return 0;
 }
 
-void ims::tiff_write_page_contig(TIFF *tiff, size_t w, size_t h, size_t num_channels, size_t page, size_t maxPage, uint16_t *data)
+/* Compressed strips default to about this size, so a page can be spread over threads. */
+constexpr size_t COMPRESSED_STRIP_BYTES = 64 * 1024;
+
+static size_t default_rows_per_strip(size_t w, size_t h, size_t spp, compression_t compression) noexcept
 {
-	TIFFSetField(tiff, TIFFTAG_IMAGEWIDTH, static_cast<uint32_t>(w));
-	TIFFSetField(tiff, TIFFTAG_IMAGELENGTH, static_cast<uint32_t>(h));
-	TIFFSetField(tiff, TIFFTAG_COMPRESSION, COMPRESSION_NONE);
-	TIFFSetField(tiff, TIFFTAG_SUBFILETYPE, FILETYPE_PAGE);
-	TIFFSetField(tiff, TIFFTAG_PAGENUMBER, static_cast<uint16_t>(page), static_cast<uint16_t>(maxPage));
-	TIFFSetField(tiff, TIFFTAG_RESOLUTIONUNIT, static_cast<uint16_t>(1));
+	if(compression == compression_t::none)
+		return h;
 
-	TIFFSetField(tiff, TIFFTAG_PLANARCONFIG, static_cast<uint16_t>(PLANARCONFIG_CONTIG));
+	size_t rowbytes = w * spp * sizeof(uint16_t);
+	return std::clamp<size_t>(COMPRESSED_STRIP_BYTES / rowbytes, 1, h);
+}
 
+/* Width or height of a pyramid level, rounding up each time like downsample_2x(). */
+static uint32_t level_size(uint32_t size, size_t level) noexcept
+{
+	for(size_t l = 0; l < level; ++l)
+		size = (size + 1) / 2;
+	return size;
+}
 
-	TIFFSetField(tiff, TIFFTAG_SAMPLESPERPIXEL, static_cast<uint16_t>(num_channels));
-	for(size_t i = 0; i < num_channels; ++i)
+static uint16_t get_compression_tag(compression_t compression)
+{
+	switch(compression)
 	{
-		TIFFSetField(tiff, TIFFTAG_SAMPLEFORMAT, static_cast<uint16_t>(SAMPLEFORMAT_UINT));
-		TIFFSetField(tiff, TIFFTAG_BITSPERSAMPLE, static_cast<uint32_t>(16));
+		case compression_t::none:		return COMPRESSION_NONE;
+		case compression_t::lzw:		return COMPRESSION_LZW;
+		case compression_t::deflate:	return COMPRESSION_ADOBE_DEFLATE;
+#if defined(COMPRESSION_ZSTD)
+		case compression_t::zstd:		return COMPRESSION_ZSTD;
+#else
+		case compression_t::zstd:		return 50000; /* Not in libtiff < 4.0.10 */
+#endif
 	}
+	throw tiff_exception();
+}
 
+ims::tiff_writer::tiff_writer(tiff_ptr&& tiff, size_t w, size_t h, size_t num_channels, size_t npages, const tiff_opts_t& opts) :
+	_tiff(std::move(tiff)),
+	_width(static_cast<uint32_t>(w)),
+	_height(static_cast<uint32_t>(h)),
+	_num_channels(static_cast<uint16_t>(num_channels)),
+	_npages(static_cast<uint16_t>(npages)),
+	_rows_per_strip(static_cast<uint32_t>(opts.rows_per_strip == 0 || opts.rows_per_strip > h ? default_rows_per_strip(w, h, opts.planar ? 1 : num_channels, opts.compression) : opts.rows_per_strip)),
+	_tile_width(static_cast<uint32_t>(opts.tile_width)),
+	_tile_height(static_cast<uint32_t>(opts.tile_height)),
+	_compression(opts.compression),
+	_level(opts.level),
+	_nthreads(opts.threads),
+	_planar(opts.planar),
+	_pyramid_levels(opts.pyramid_levels),
+	_description(opts.description)
+{
+	/* Anything past RGB is an extra sample. */
+	if(num_channels > 3)
+		_extrasamples.resize(num_channels - 3, EXTRASAMPLE_UNSPECIFIED);
+}
+
+/*
+ * libtiff resets the directory after TIFFWriteDirectory(), so the tags have
+ * to be set again for each page. Keep it to one call per tag.
+ */
+void ims::tiff_writer::apply_tags(size_t page, size_t level)
+{
+	TIFF *tiff = _tiff.get();
+
+	TIFFSetField(tiff, TIFFTAG_IMAGEWIDTH, level_size(_width, level));
+	TIFFSetField(tiff, TIFFTAG_IMAGELENGTH, level_size(_height, level));
+	TIFFSetField(tiff, TIFFTAG_COMPRESSION, get_compression_tag(_compression));
+	if(level == 0)
+	{
+		TIFFSetField(tiff, TIFFTAG_SUBFILETYPE, FILETYPE_PAGE);
+		TIFFSetField(tiff, TIFFTAG_PAGENUMBER, static_cast<uint16_t>(page), _npages);
+	}
+	else
+	{
+		TIFFSetField(tiff, TIFFTAG_SUBFILETYPE, FILETYPE_REDUCEDIMAGE);
+	}
+	TIFFSetField(tiff, TIFFTAG_RESOLUTIONUNIT, static_cast<uint16_t>(1));
+	TIFFSetField(tiff, TIFFTAG_PLANARCONFIG, static_cast<uint16_t>(_planar ? PLANARCONFIG_SEPARATE : PLANARCONFIG_CONTIG));
+	TIFFSetField(tiff, TIFFTAG_SAMPLESPERPIXEL, _num_channels);
+	TIFFSetField(tiff, TIFFTAG_SAMPLEFORMAT, static_cast<uint16_t>(SAMPLEFORMAT_UINT));
+	TIFFSetField(tiff, TIFFTAG_BITSPERSAMPLE, static_cast<uint16_t>(16));
 	TIFFSetField(tiff, TIFFTAG_PHOTOMETRIC, static_cast<uint16_t>(PHOTOMETRIC_RGB));
 
-	/* Extra samples */
-	if(num_channels > 3)
+	if(_tile_width > 0)
 	{
-		uint16_t extra[2] = {EXTRASAMPLE_UNSPECIFIED, EXTRASAMPLE_UNSPECIFIED};
-		TIFFSetField(tiff, TIFFTAG_EXTRASAMPLES, num_channels - 3, extra);
+		TIFFSetField(tiff, TIFFTAG_TILEWIDTH, _tile_width);
+		TIFFSetField(tiff, TIFFTAG_TILELENGTH, _tile_height);
 	}
+	else
+	{
+		TIFFSetField(tiff, TIFFTAG_ROWSPERSTRIP, std::min(_rows_per_strip, level_size(_height, level)));
+	}
+
+	if(!_extrasamples.empty())
+		TIFFSetField(tiff, TIFFTAG_EXTRASAMPLES, static_cast<uint16_t>(_extrasamples.size()), _extrasamples.data());
+}
+
+/* Strips of each plane in turn. Contiguous pages are a single plane of every sample. */
+void ims::tiff_writer::write_strips(const uint16_t* const *planes, size_t nplanes, size_t w, size_t h)
+{
+	TIFF *tiff = _tiff.get();
 
-	for(size_t j = 0; j < h; ++j)
+	const size_t spp = _planar ? 1 : _num_channels;
+	const size_t rowsize = w * spp;
+	const size_t rps = std::min<size_t>(_rows_per_strip, h);
+	const size_t nstrips = h / rps + static_cast<size_t>(!!(h % rps));
+	auto strip_data = [&](size_t strip) {
+		return planes[strip / nstrips] + rowsize * rps * (strip % nstrips);
+	};
+	auto strip_size = [&](size_t strip) {
+		size_t s = strip % nstrips;
+		return rowsize * std::min<size_t>(rps, h - s * rps) * sizeof(uint16_t);
+	};
+
+	/* Uncompressed strips go straight to disk, one write each. */
+	if(_compression == compression_t::none)
+	{
+		for(size_t strip = 0; strip < nstrips * nplanes; ++strip)
+		{
+			tmsize_t size = static_cast<tmsize_t>(strip_size(strip));
+			if(TIFFWriteEncodedStrip(tiff, static_cast<uint32_t>(strip), const_cast<uint16_t*>(strip_data(strip)), size) != size)
+				throw tiff_exception();
+		}
+		return;
+	}
+
+	/* Compress every strip at once, then write them in order. */
+	_encoded.resize(nstrips * nplanes);
+	parallel_for(nstrips * nplanes, _nthreads, [&](size_t strip) {
+		const uint8_t *src = reinterpret_cast<const uint8_t*>(strip_data(strip));
+		compress_strip(_compression, _level, src, strip_size(strip), _encoded[strip]);
+	});
+
+	for(size_t strip = 0; strip < nstrips * nplanes; ++strip)
 	{
-		if(TIFFWriteScanline(tiff, data + (w * j) * num_channels, j, 0) < 0)
+		tmsize_t size = static_cast<tmsize_t>(_encoded[strip].size());
+		if(TIFFWriteRawStrip(tiff, static_cast<uint32_t>(strip), _encoded[strip].data(), size) != size)
 			throw tiff_exception();
 	}
+}
+
+/* Cut the page into tiles and encode them all at once, then write them in order. */
+void ims::tiff_writer::write_tiles(const uint16_t* const *planes, size_t nplanes, size_t w, size_t h)
+{
+	TIFF *tiff = _tiff.get();
+
+	const size_t spp = _planar ? 1 : _num_channels;
+	const size_t tw = _tile_width, th = _tile_height;
+	const size_t ntx = w / tw + static_cast<size_t>(!!(w % tw));
+	const size_t nty = h / th + static_cast<size_t>(!!(h % th));
+	const size_t ntiles = ntx * nty;
+	const size_t tile_size = tw * th * spp;
+	const size_t rowsize = w * spp;
+
+	_encoded.resize(ntiles * nplanes);
+	parallel_for(ntiles * nplanes, _nthreads, [&](size_t t) {
+		const uint16_t *data = planes[t / ntiles];
+		size_t x0 = (t % ntiles % ntx) * tw, y0 = (t % ntiles / ntx) * th;
+		size_t ncols = std::min<size_t>(tw, w - x0), nrows = std::min<size_t>(th, h - y0);
 
-    if(!TIFFWriteDirectory(tiff))
+		/* Uncompressed tiles are built in place. */
+		thread_local std::vector<uint16_t> tmp;
+		uint16_t *tile;
+		if(_compression == compression_t::none)
+		{
+			_encoded[t].resize(tile_size * sizeof(uint16_t));
+			tile = reinterpret_cast<uint16_t*>(_encoded[t].data());
+		}
+		else
+		{
+			tmp.resize(tile_size);
+			tile = tmp.data();
+		}
+
+		/* Tiles are always full size, pad the edges. */
+		if(ncols < tw || nrows < th)
+			std::fill(tile, tile + tile_size, 0);
+
+		for(size_t y = 0; y < nrows; ++y)
+			memcpy(tile + y * tw * spp, data + (y0 + y) * rowsize + x0 * spp, ncols * spp * sizeof(uint16_t));
+
+		if(_compression != compression_t::none)
+			compress_strip(_compression, _level, reinterpret_cast<const uint8_t*>(tile), tile_size * sizeof(uint16_t), _encoded[t]);
+	});
+
+	for(size_t t = 0; t < ntiles * nplanes; ++t)
+	{
+		tmsize_t size = static_cast<tmsize_t>(_encoded[t].size());
+		if(TIFFWriteRawTile(tiff, static_cast<uint32_t>(t), _encoded[t].data(), size) != size)
+			throw tiff_exception();
+	}
+}
+
+void ims::tiff_writer::write_directory(size_t page, size_t level, const uint16_t* const *planes, size_t nplanes)
+{
+	TIFF *tiff = _tiff.get();
+	apply_tags(page, level);
+
+	/* Placeholders, libtiff fills them in as the levels after it are written. */
+	if(level == 0 && _pyramid_levels > 0)
+	{
+		std::vector<toff_t> subifds(_pyramid_levels, 0);
+		TIFFSetField(tiff, TIFFTAG_SUBIFD, static_cast<uint16_t>(_pyramid_levels), subifds.data());
+	}
+
+	if(level == 0 && page == 0 && !_description.empty())
+		TIFFSetField(tiff, TIFFTAG_IMAGEDESCRIPTION, _description.c_str());
+
+	if(_tile_width > 0)
+		write_tiles(planes, nplanes, level_size(_width, level), level_size(_height, level));
+	else
+		write_strips(planes, nplanes, level_size(_width, level), level_size(_height, level));
+
+	if(!TIFFWriteDirectory(tiff))
+		throw tiff_exception();
+}
+
+/* The page, then each level of its pyramid made from the one before, into its SubIFDs. */
+void ims::tiff_writer::write_page(size_t page, const uint16_t* const *planes, size_t nplanes)
+{
+	write_directory(page, 0, planes, nplanes);
+
+	const size_t spp = _planar ? 1 : _num_channels;
+	std::vector<const uint16_t*> src(planes, planes + nplanes), dst(nplanes);
+	for(size_t level = 1; level <= _pyramid_levels; ++level)
+	{
+		const size_t sw = level_size(_width, level - 1), sh = level_size(_height, level - 1);
+		const size_t plane_size = static_cast<size_t>(level_size(_width, level)) * level_size(_height, level) * spp;
+
+		std::vector<uint16_t>& buf = _levels[level % 2];
+		buf.resize(plane_size * nplanes);
+		for(size_t p = 0; p < nplanes; ++p)
+		{
+			dst[p] = buf.data() + p * plane_size;
+			downsample_2x(src[p], sw, sh, spp, buf.data() + p * plane_size, _nthreads);
+		}
+
+		write_directory(page, level, dst.data(), nplanes);
+		src = dst;
+	}
+}
+
+void ims::tiff_writer::write_page_contig(size_t page, uint16_t *data)
+{
+	if(_planar)
 		throw tiff_exception();
-}
\ No newline at end of file
+
+	write_page(page, &data, 1);
+}
+
+void ims::tiff_writer::write_page_planar(size_t page, const uint16_t* const *planes)
+{
+	if(!_planar)
+		throw tiff_exception();
+
+	write_page(page, planes, _num_channels);
+}
+
+void ims::tiff_writer::finish()
+{
+	/* TIFFClose() can't fail, so flush first to find out if anything did. */
+	if(!TIFFFlush(_tiff.get()))
+	{
+		fprintf(stderr, "Error writing TIFF.\n");
+		throw tiff_exception();
+	}
+
+	_tiff.reset();
+}
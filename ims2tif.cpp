@@ -25,6 +25,10 @@ limitations under the License.
 #include <filesystem>
 #include <sstream>
 #include <iomanip>
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <cerrno>
 #include <tiffio.h>
 #include "ims2tif.hpp"
 
@@ -32,8 +36,6 @@ namespace fs = std::filesystem;
 
 using namespace ims;
 
-void ims::tiff_deleter::operator()(pointer t) noexcept { TIFFClose(t); }
-
 struct ims_info_t
 {
 	size_t x;
@@ -95,6 +97,118 @@ static ims_info_t read_image_info(hid_t file)
 	return imsinfo;
 }
 
+/*
+ * DataSetInfo/Image only has the size of ResolutionLevel 0. Each channel of the other levels
+ * has its own in ImageSizeX/Y/Z. If they're not there, fall back to the dataset size, which
+ * may be padded.
+ */
+static int read_level_size(hid_t rlevel, ims_info_t& imsinfo) noexcept
+{
+	h5g_ptr tp(H5Gopen2(rlevel, "TimePoint 0", H5P_DEFAULT));
+	if(!tp)
+		return -1;
+
+	h5g_ptr chan(H5Gopen2(tp.get(), "Channel 0", H5P_DEFAULT));
+	if(!chan)
+		return -1;
+
+	/* Check first, HDF5 complains about missing attributes. */
+	auto read_size = [&chan](const char *name) {
+		if(H5Aexists(chan.get(), name) <= 0)
+			return std::optional<size_t>();
+		return hdf5_read_uint_attribute(chan.get(), name);
+	};
+
+	std::optional<size_t> x = read_size("ImageSizeX");
+	std::optional<size_t> y = read_size("ImageSizeY");
+	std::optional<size_t> z = read_size("ImageSizeZ");
+	if(x && y && z && *x > 0 && *y > 0 && *z > 0)
+	{
+		imsinfo.x = *x;
+		imsinfo.y = *y;
+		imsinfo.z = *z;
+		return 0;
+	}
+
+	h5d_ptr data(H5Dopen2(chan.get(), "Data", H5P_DEFAULT));
+	if(!data)
+		return -1;
+
+	h5s_ptr space(H5Dget_space(data.get()));
+	hsize_t dims[3];
+	if(!space || H5Sget_simple_extent_dims(space.get(), dims, nullptr) != 3)
+		return -1;
+
+	imsinfo.x = static_cast<size_t>(dims[2]);
+	imsinfo.y = static_cast<size_t>(dims[1]);
+	imsinfo.z = static_cast<size_t>(dims[0]);
+	return 0;
+}
+
+/*
+ * The size of a voxel of a level, and where the image starts, from DataSetInfo/Image's
+ * ExtMin and ExtMax, which are its bounds in its Unit. A unit voxel at 0 if they're not there.
+ */
+static void read_voxel_size(hid_t file, const ims_info_t& imsinfo, double scale[3], double origin[3], std::string& unit)
+{
+	std::fill(scale, scale + 3, 1.0);
+	std::fill(origin, origin + 3, 0.0);
+	unit.clear();
+
+	h5g_ptr image(H5Gopen2(file, "DataSetInfo/Image", H5P_DEFAULT));
+	if(!image)
+		return;
+
+	/* They're strings, like everything else in there. */
+	auto read_number = [&image](const char *name) {
+		if(H5Aexists(image.get(), name) <= 0)
+			return std::optional<double>();
+
+		std::optional<std::string> s = hdf5_read_attribute(image.get(), name);
+		char *end;
+		double v = s ? strtod(s->c_str(), &end) : 0.0;
+		if(!s || end == s->c_str())
+			return std::optional<double>();
+		return std::optional<double>(v);
+	};
+
+	const size_t size[3] = {imsinfo.x, imsinfo.y, imsinfo.z};
+	double lo[3], hi[3];
+	for(int i = 0; i < 3; ++i)
+	{
+		char minbuf[16], maxbuf[16];
+		sprintf(minbuf, "ExtMin%d", i);
+		sprintf(maxbuf, "ExtMax%d", i);
+
+		std::optional<double> mn = read_number(minbuf), mx = read_number(maxbuf);
+		if(!mn || !mx || !(*mx > *mn))
+			return;
+
+		lo[i] = *mn;
+		hi[i] = *mx;
+	}
+
+	for(int i = 0; i < 3; ++i)
+	{
+		scale[i] = (hi[i] - lo[i]) / static_cast<double>(size[i]);
+		origin[i] = lo[i];
+	}
+
+	/* OME-Zarr wants the unit's full name. */
+	std::optional<std::string> u = H5Aexists(image.get(), "Unit") > 0 ? hdf5_read_attribute(image.get(), "Unit") : std::nullopt;
+	if(!u)
+		return;
+
+	if(*u == "um" || *u == "\xc2\xb5m")
+		unit = "micrometer";
+	else if(*u == "nm")
+		unit = "nanometer";
+	else if(*u == "mm")
+		unit = "millimeter";
+	else if(*u == "m")
+		unit = "meter";
+}
+
 static size_t get_num_digits(size_t num) noexcept
 {
 	size_t c = 0;
@@ -141,37 +255,483 @@ static TIFF *xTIFFOpen(const fs::path& path, const char *m) noexcept
 #endif
 }
 
-int main(int argc, char **argv)
+/* An input file, ready to have its TimePoints converted. */
+struct input_t
 {
-	args_t args;
-	int aret = parse_arguments(argc, argv, stdout, stderr, &args);
-	if(aret != 0)
-		return aret;
+	fs::path path;
+	h5f_ptr file;
+	h5g_ptr rlevel;
+	ims_info_t info;
+	size_t xs, ys, zs, nchan; /* Of the region. */
+	std::vector<size_t> timepoints;
+	std::vector<fs::path> outputs; /* By TimePoint. */
+	conversion_method_t method;
+	convert_proc conv;
+	convert_opts_t opts;
+	tiff_opts_t topts;
+	uint64_t tp_memory; /* Estimated peak memory of a TimePoint, 0 if unknown. */
+	std::string source; /* Absolute path, for the manifest. */
+	fs::path store; /* The Zarr store, with --format zarr. Empty otherwise. */
+	zarr_image_t zimage;
+	zarr_opts_t zopts;
+	std::string settings; /* Everything else that changes the outputs, for the manifest. */
+};
 
-	convert_proc conv = nullptr;
-	if(args.method == conversion_method_t::bigload)
-		conv = converter_bigload;
-	else if(args.method == conversion_method_t::chunked)
-		conv = converter_chunk;
-	else if(args.method == conversion_method_t::hyperslab)
-		conv = converter_hyperslab;
-	else
-		std::terminate(); /* Will never happen. */
+static convert_proc get_converter(conversion_method_t method) noexcept
+{
+	switch(method)
+	{
+		case conversion_method_t::bigload:		return converter_bigload;
+		case conversion_method_t::chunked:		return converter_chunk;
+		case conversion_method_t::hyperslab:	return converter_hyperslab;
+		case conversion_method_t::slab:			return converter_slab;
+		case conversion_method_t::mmap:			return converter_mmap;
+		case conversion_method_t::automatic:	break;
+	}
+	std::terminate(); /* Will never happen. */
+}
 
-	h5f_ptr file(xH5Fopen(args.file, H5F_ACC_RDONLY, H5P_DEFAULT));
-	if(!file)
-		return 1;
+/* A pass over a file that's still being written, with --follow. */
+struct follow_t
+{
+	bool settled; /* The writer's finished, so the newest TimePoint is complete too. */
+	size_t pass;
+	bool planned; /* The plan's been printed. */
+};
+
+/*
+ * Open an input and work out what to convert and how. budget is 0 if there isn't one.
+ * follow is nullptr unless following it. Returns the exit code on failure, or -1 if it
+ * can't be read yet because it's still being written.
+ */
+static int open_input(const fs::path& path, const args_t& args, uint64_t budget, input_t& in, follow_t *follow)
+{
+	/* A file that's half-written may not have everything yet. */
+	const int unreadable = follow != nullptr && !follow->settled ? -1 : 1;
+
+	in.path = path;
+	in.file.reset(follow != nullptr ? open_growing_file(path) : xH5Fopen(path, H5F_ACC_RDONLY, H5P_DEFAULT));
+	if(!in.file)
+	{
+		/* Only once the writer's finished is it worth saying, HDF5 hasn't. */
+		if(follow != nullptr && unreadable > 0)
+			fprintf(stderr, "Unable to open %s.\n", path.u8string().c_str());
 
-	ims_info_t imsinfo = read_image_info(file.get());
+		return unreadable;
+	}
+
+	ims_info_t& imsinfo = in.info;
+	try
+	{
+		imsinfo = read_image_info(in.file.get());
+	}
+	catch(std::exception&)
+	{
+		return unreadable;
+	}
 
-	h5g_ptr ds(H5Gopen2(file.get(), "DataSet", H5P_DEFAULT));
+	h5g_ptr ds(H5Gopen2(in.file.get(), "DataSet", H5P_DEFAULT));
 	if(!ds)
+		return unreadable;
+
+	char rlbuf[32];
+	sprintf(rlbuf, "ResolutionLevel %zu", args.resolution_level);
+	if(H5Lexists(ds.get(), rlbuf, H5P_DEFAULT) <= 0)
+	{
+		if(unreadable < 0)
+			return unreadable;
+
+		fprintf(stderr, "No %s in %s.\n", rlbuf, path.u8string().c_str());
+		return 1;
+	}
+
+	in.rlevel.reset(H5Gopen2(ds.get(), rlbuf, H5P_DEFAULT));
+	if(!in.rlevel)
+		return unreadable;
+
+	if(args.resolution_level > 0 && read_level_size(in.rlevel.get(), imsinfo) < 0)
+		return unreadable;
+
+	if(args.verbose && args.resolution_level > 0)
+		fprintf(stderr, "%s: %s: %zu x %zu x %zu\n", path.u8string().c_str(), rlbuf, imsinfo.x, imsinfo.y, imsinfo.z);
+
+	/* What to convert. The converters only ever see the selected box and channels. */
+	region_t region;
+	in.xs = imsinfo.x;
+	in.ys = imsinfo.y;
+	in.zs = imsinfo.z;
+	in.nchan = imsinfo.c;
+	if(args.roi[3] != 0)
+	{
+		if(args.roi[0] + args.roi[3] > imsinfo.x || args.roi[1] + args.roi[4] > imsinfo.y || args.roi[2] + args.roi[5] > imsinfo.z)
+		{
+			fprintf(stderr, "%s: ROI doesn't fit in the %zu x %zu x %zu image.\n", path.u8string().c_str(), imsinfo.x, imsinfo.y, imsinfo.z);
+			return 1;
+		}
+
+		region.x0 = args.roi[0];
+		region.y0 = args.roi[1];
+		region.z0 = args.roi[2];
+		in.xs = args.roi[3];
+		in.ys = args.roi[4];
+		in.zs = args.roi[5];
+	}
+
+	if(!args.channels.empty())
+	{
+		for(size_t c : args.channels)
+		{
+			if(c >= imsinfo.c)
+			{
+				fprintf(stderr, "%s: No channel %zu, there are %zu.\n", path.u8string().c_str(), c, imsinfo.c);
+				return 1;
+			}
+		}
+
+		region.channels = args.channels;
+		in.nchan = region.channels.size();
+	}
+
+	size_t ntp = imsinfo.t;
+	if(follow != nullptr)
+	{
+		/* The newest TimePoint may still be being written, unless the writer's finished. */
+		size_t present = count_timepoints(in.rlevel.get());
+		ntp = std::min(ntp, follow->settled || present == 0 ? present : present - 1);
+	}
+	else if(args.tp_begin >= imsinfo.t)
+	{
+		fprintf(stderr, "%s: No TimePoint %zu, there are %zu.\n", path.u8string().c_str(), args.tp_begin, imsinfo.t);
 		return 1;
+	}
+
+	for(size_t i = args.tp_begin; i < std::min(args.tp_end, ntp); i += args.tp_step)
+		in.timepoints.push_back(i);
 
-	h5g_ptr rlevel(H5Gopen2(ds.get(), "ResolutionLevel 0", H5P_DEFAULT));
-	if(!rlevel)
+	/* None are ready yet. */
+	if(in.timepoints.empty())
+		return 0;
+
+	conversion_method_t method = args.method;
+	size_t buffers = args.buffers;
+	size_t queue_depth = args.queue_depth;
+	in.tp_memory = 0;
+
+	/* The first TimePoint stands in for the rest. */
+	char tpbuf[32];
+	sprintf(tpbuf, "TimePoint %zu", in.timepoints[0]);
+	h5g_ptr tp0(H5Gopen2(in.rlevel.get(), tpbuf, H5P_DEFAULT));
+	if(!tp0)
 		return 1;
 
+	/* Whatever the budget, there have to be chunks to read. */
+	if(args.method == conversion_method_t::chunked && !args.dump_chunk_map)
+	{
+		hsize_t xcs, ycs, zcs;
+		if(get_chunk_size(tp0.get(), region, in.nchan, xcs, ycs, zcs) < 0)
+		{
+			fprintf(stderr, "%s isn't chunked, --method chunked can't be used.\n", path.u8string().c_str());
+			return 1;
+		}
+	}
+
+	/* Size each TimePoint to the memory budget, and pick the method if asked. */
+	if(budget != 0 && !args.dump_chunk_map)
+	{
+		plan_t plan;
+		try
+		{
+			plan = plan_conversion(tp0.get(), region, in.xs, in.ys, in.zs, in.nchan, in.timepoints.size(), args, budget);
+		}
+		catch(std::exception&)
+		{
+			return 1;
+		}
+
+		if((args.method == conversion_method_t::automatic || args.verbose) && (follow == nullptr || !follow->planned))
+		{
+			if(args.files.size() > 1)
+				fprintf(stderr, "%s:\n", path.u8string().c_str());
+			print_plan(stderr, plan, args.threads);
+
+			if(follow != nullptr)
+				follow->planned = true;
+		}
+
+		method = plan.method;
+		buffers = plan.buffers;
+		queue_depth = std::min(queue_depth, std::max<size_t>(buffers - 1, 1));
+		in.tp_memory = plan.peak_memory / std::max<size_t>(plan.inflight, 1);
+	}
+
+	tiff_opts_t& topts = in.topts;
+	topts.rows_per_strip = args.rows_per_strip;
+	topts.tile_width = args.tile_width;
+	topts.tile_height = args.tile_height;
+	topts.compression = args.compression;
+	topts.level = args.level;
+	topts.threads = 1;
+	topts.planar = args.planar;
+
+	/* Tiles the size of the chunks, TIFF wants multiples of 16. */
+	if(args.tile_chunks && !args.dump_chunk_map)
+	{
+		h5g_ptr tp(H5Gopen2(in.rlevel.get(), "TimePoint 0", H5P_DEFAULT));
+		if(!tp)
+			return 1;
+
+		hsize_t xcs, ycs, zcs;
+		if(get_chunk_size(tp.get(), region, in.nchan, xcs, ycs, zcs) < 0)
+		{
+			fprintf(stderr, "%s: Data isn't chunked, use --tiled WxH.\n", path.u8string().c_str());
+			return 1;
+		}
+
+		topts.tile_width = (static_cast<size_t>(xcs) + 15) & ~size_t(15);
+		topts.tile_height = (static_cast<size_t>(ycs) + 15) & ~size_t(15);
+	}
+
+	/* Halve until a level fits in a tile, unless told how many. Never past 1x1. */
+	topts.pyramid_levels = 0;
+	if(args.pyramid)
+	{
+		size_t levels = args.pyramid_levels;
+		if(levels == 0)
+			levels = count_pyramid_levels(in.xs, in.ys, std::max(topts.tile_width, topts.tile_height));
+		topts.pyramid_levels = std::min(levels, count_pyramid_levels(in.xs, in.ys, 1));
+
+		ome_image_t ome;
+		ome.name = path.stem().u8string();
+		ome.x = in.xs;
+		ome.y = in.ys;
+		ome.z = in.zs;
+		ome.c = in.nchan;
+		ome.planar = args.planar;
+		double origin[3];
+		read_voxel_size(in.file.get(), imsinfo, ome.scale, origin, ome.unit);
+		topts.description = build_ome_xml(ome);
+	}
+
+	/* The Zarr chunks, and the physical size of what they're of. */
+	zarr_opts_t& zopts = in.zopts;
+	if(args.zarr)
+	{
+		size_t shape[3];
+		get_zarr_chunk_shape(tp0.get(), region, in.nchan, in.xs, in.ys, in.zs, args, shape);
+		zopts.chunk_x = shape[0];
+		zopts.chunk_y = shape[1];
+		zopts.chunk_z = shape[2];
+		zopts.compression = args.compression;
+		zopts.level = args.level;
+		zopts.threads = 1;
+
+		zarr_image_t& zi = in.zimage;
+		zi.name = path.stem().u8string();
+		zi.t = imsinfo.t;
+		zi.c = in.nchan;
+		zi.z = in.zs;
+		zi.y = in.ys;
+		zi.x = in.xs;
+		read_voxel_size(in.file.get(), imsinfo, zi.scale, zi.origin, zi.unit);
+
+		const size_t offset[3] = {region.x0, region.y0, region.z0};
+		for(int i = 0; i < 3; ++i)
+			zi.origin[i] += offset[i] * zi.scale[i];
+	}
+
+	convert_opts_t& opts = in.opts;
+	opts.threads = 1;
+	opts.buffers = buffers;
+	opts.queue_depth = queue_depth;
+	opts.planar = args.planar;
+	opts.verbose = args.verbose;
+	opts.region = region;
+	opts.stats = nullptr;
+	opts.progress = nullptr;
+
+	in.method = method;
+	if(!args.dump_chunk_map)
+		in.conv = get_converter(method);
+
+	/* If any of this changes, the outputs have to be redone. */
+	std::ostringstream ss;
+	ss << "level=" << args.resolution_level
+		<< ";roi=" << region.x0 << "," << region.y0 << "," << region.z0 << "," << in.xs << "," << in.ys << "," << in.zs
+		<< ";channels=";
+	for(size_t c = 0; c < in.nchan; ++c)
+		ss << (c == 0 ? "" : ",") << region.channel(c);
+	ss << ";bigtiff=" << args.bigtiff << ";writer=" << static_cast<int>(args.writer)
+		<< ";compression=" << static_cast<int>(args.compression) << ":" << args.level
+		<< ";rows_per_strip=" << args.rows_per_strip << ";tiles=" << topts.tile_width << "x" << topts.tile_height
+		<< ";planar=" << args.planar;
+	if(args.zarr)
+		ss << ";zarr=" << zopts.chunk_x << "x" << zopts.chunk_y << "x" << zopts.chunk_z;
+	if(args.pyramid)
+		ss << ";pyramid=" << topts.pyramid_levels;
+	in.settings = ss.str();
+
+	std::error_code ec;
+	in.source = fs::absolute(path, ec).u8string();
+	if(ec)
+		in.source = path.u8string();
+
+	/* A store per input, with a directory per TimePoint. */
+	if(args.zarr)
+	{
+		in.store = args.outdir / fs::u8path((args.prefix.empty() ? path.stem().u8string() : args.prefix) + ".zarr");
+		for(size_t i = 0; i < imsinfo.t; ++i)
+			in.outputs.push_back(zarr_timepoint_path(in.store, i));
+		return 0;
+	}
+
+	std::string prefix = args.prefix;
+	if(prefix.empty())
+		prefix = path.stem().u8string() + "_";
+
+	in.outputs = build_output_paths(prefix.c_str(), args.outdir, imsinfo.t);
+	return 0;
+}
+
+static int dump_input(const input_t& in)
+{
+	for(size_t i : in.timepoints)
+	{
+		char tpbuf[32];
+		sprintf(tpbuf, "TimePoint %zu", i);
+		h5g_ptr tp(H5Gopen2(in.rlevel.get(), tpbuf, H5P_DEFAULT));
+		if(!tp)
+			return 1;
+
+		std::vector<chunk_info_t> index;
+		if(build_chunk_index(tp.get(), region_t(), in.info.c, index) < 0)
+		{
+			fprintf(stderr, "Unable to index chunks, the data isn't chunked or HDF5 is older than 1.10.5.\n");
+			return 1;
+		}
+
+		dump_chunk_map(stdout, i, index);
+	}
+	return 0;
+}
+
+/* What the manifest should say about a TimePoint's output, bar its size and CRC. */
+static manifest_entry_t expected_entry(const input_t& in, size_t timepoint)
+{
+	manifest_entry_t e;
+	/* Relative to the output directory. */
+	if(in.store.empty())
+		e.output = in.outputs[timepoint].filename().u8string();
+	else
+		e.output = in.outputs[timepoint].lexically_relative(in.store.parent_path()).generic_u8string();
+	e.size = 0;
+	e.pages = in.zs;
+	e.source = in.source;
+	e.timepoint = timepoint;
+	e.x = in.info.x;
+	e.y = in.info.y;
+	e.z = in.info.z;
+	e.c = in.info.c;
+	e.crc32 = 0;
+	e.settings = in.settings;
+	return e;
+}
+
+/* A TimePoint of an input. */
+struct task_t
+{
+	input_t *in;
+	size_t timepoint;
+	uint64_t size;
+	size_t id; /* In file, then TimePoint, order. */
+};
+
+struct task_stats_t
+{
+	stage_stats stages;
+	size_t threads = 0;
+	double seconds = 0.0; /* Wall time, including opening and closing the output. */
+};
+
+/* What --stats records of a converted TimePoint. */
+struct stats_row_t
+{
+	fs::path file;
+	size_t timepoint;
+	fs::path output;
+	conversion_method_t method;
+	size_t threads;
+	double seconds;
+	uint64_t bytes;
+	stage_stats stages;
+};
+
+/* --stats for the whole run, every pass of it if following. */
+struct stats_log_t
+{
+	std::deque<stats_row_t> rows;
+	double seconds = 0.0; /* Spent converting, not waiting between passes. */
+};
+
+/* Write --stats to f. */
+static void write_stats(FILE *f, const args_t& args, const stats_log_t& log)
+{
+	stage_stats total;
+	uint64_t bytes = 0;
+	for(const stats_row_t& r : log.rows)
+	{
+		total.merge(r.stages);
+		bytes += r.bytes;
+	}
+
+	fprintf(f, "{\n  \"threads\": %zu,\n  \"seconds\": %.6f,\n  \"bytes\": %llu,\n  \"mb_per_sec\": %.1f,\n  \"stages\": ",
+		args.threads, log.seconds, static_cast<unsigned long long>(bytes), log.seconds > 0.0 ? bytes / log.seconds / 1e6 : 0.0
+	);
+	write_stats_json(f, total);
+	fprintf(f, ",\n  \"timepoints\": [\n");
+
+	for(size_t i = 0; i < log.rows.size(); ++i)
+	{
+		const stats_row_t& r = log.rows[i];
+		fprintf(f, "    {\"file\": ");
+		write_json_string(f, r.file.u8string());
+		fprintf(f, ", \"timepoint\": %zu, \"output\": ", r.timepoint);
+		write_json_string(f, r.output.u8string());
+		fprintf(f, ", \"method\": \"%s\", \"threads\": %zu, \"seconds\": %.6f, \"bytes\": %llu, \"stages\": ",
+			method_name(r.method), r.threads, r.seconds, static_cast<unsigned long long>(r.bytes)
+		);
+		write_stats_json(f, r.stages);
+		fprintf(f, "}%s\n", i + 1 < log.rows.size() ? "," : "");
+	}
+
+	fprintf(f, "  ]\n}\n");
+}
+
+/*
+ * Convert everything that isn't already done. follow is nullptr unless following the
+ * (only) input. What's converted is added to log, unless it's nullptr. Returns the exit
+ * code, or -1 if it should be tried again later.
+ */
+static int convert_inputs(const args_t& args, uint64_t budget, follow_t *follow, stats_log_t *log)
+{
+	std::vector<std::unique_ptr<input_t>> inputs;
+	for(const fs::path& path : args.files)
+	{
+		inputs.push_back(std::make_unique<input_t>());
+		if(int r = open_input(path, args, budget, *inputs.back(), follow))
+			return r;
+
+		if(args.dump_chunk_map)
+		{
+			if(int r = dump_input(*inputs.back()))
+				return r;
+
+			inputs.pop_back();
+		}
+	}
+
+	if(args.dump_chunk_map)
+		return 0;
+
 	/* Create the output directory if it doesn't exist. */
 	std::error_code ec;
 	fs::create_directories(args.outdir, ec);
@@ -181,21 +741,309 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
-	std::vector<fs::path> paths = build_output_paths(args.prefix.c_str(), args.outdir, imsinfo.t);
+	/* The stores have to be there before their TimePoints. */
+	for(const std::unique_ptr<input_t>& in : inputs)
+	{
+		if(in->store.empty() || in->timepoints.empty())
+			continue;
+
+		try
+		{
+			write_zarr_metadata(in->store, in->zimage, in->zopts);
+		}
+		catch(std::exception&)
+		{
+			return 1;
+		}
+	}
+
+	/* Every (file, TimePoint) pair, biggest first so the small ones fill in at the end. */
+	std::unique_ptr<output_manifest> manifest = output_manifest::open(args.outdir);
+	if(!manifest)
+		return 1;
+
+	std::vector<task_t> tasks;
+	std::vector<fs::path> outputs;
+	size_t skipped = 0;
+	for(const std::unique_ptr<input_t>& in : inputs)
+	{
+		uint64_t size = static_cast<uint64_t>(in->xs) * in->ys * in->zs * in->nchan;
+		for(size_t i : in->timepoints)
+		{
+			outputs.push_back(in->outputs[i]);
+
+			/* Already done by an earlier run. */
+			manifest_entry_t e = expected_entry(*in, i);
+			if(!args.overwrite && output_complete(e, manifest->find(e.output), in->outputs[i], args.verify))
+			{
+				++skipped;
+				continue;
+			}
+
+			tasks.push_back({in.get(), i, size, tasks.size()});
+		}
+	}
+
+	if(skipped > 0 && (args.verbose || args.progress) && (follow == nullptr || follow->pass == 0))
+		fprintf(stderr, "Skipping %zu TimePoint(s) already done, use --overwrite to redo them.\n", skipped);
 
-	for(size_t i = 0; i < imsinfo.t; ++i)
+	std::sort(outputs.begin(), outputs.end());
+	auto dup = std::adjacent_find(outputs.begin(), outputs.end());
+	if(dup != outputs.end())
 	{
-		/* Open the tif */
-		tiff_ptr tif(xTIFFOpen(paths[i].c_str(), args.bigtiff ? "w8" : "w"));
+		fprintf(stderr, "More than one input would write %s.\n", dup->u8string().c_str());
+		return 1;
+	}
 
-		/* Get the timepoint */
-		char tpbuf[32];
-		sprintf(tpbuf, "TimePoint %zu", i);
-		h5g_ptr tp(H5Gopen2(rlevel.get(), tpbuf, H5P_DEFAULT));
-		if(!tp)
+	/* Nothing new since the last pass. */
+	if(follow != nullptr && tasks.empty())
+		return 0;
+
+	if(follow != nullptr && args.verbose)
+		fprintf(stderr, "follow: %zu new TimePoint(s)%s\n", tasks.size(), follow->settled ? ", the writer's finished" : "");
+
+	/* Stats and timings of each task, by id. */
+	std::vector<task_t> order = tasks;
+	std::unique_ptr<task_stats_t[]> stats;
+	if(log != nullptr)
+		stats = std::make_unique<task_stats_t[]>(tasks.size());
+
+	std::stable_sort(tasks.begin(), tasks.end(), [](const task_t& a, const task_t& b) { return a.size > b.size; });
+
+	std::vector<uint64_t> costs(tasks.size());
+	std::transform(tasks.begin(), tasks.end(), costs.begin(), [](const task_t& t) { return t.in->tp_memory; });
+
+	/*
+	 * TimePoints are independent, so hand them out to workers. Each one has its own
+	 * output file. The converters serialise their HDF5 access on hdf5_mutex(), everything
+	 * else (interleaving, writing) runs concurrently. Any threads not used for TimePoints
+	 * go to the converters.
+	 */
+	size_t nworkers = std::min({args.threads, args.inflight, tasks.size()});
+
+	if(args.verbose && inputs.size() > 1)
+		fprintf(stderr, "batch: %zu files, %zu TimePoints, %zu workers\n", inputs.size(), tasks.size(), nworkers);
+
+	std::unique_ptr<progress_meter> progress;
+	if(args.progress)
+	{
+		uint64_t pages = 0, bytes = 0;
+		for(const task_t& t : tasks)
+		{
+			pages += t.in->zs;
+			bytes += t.size * sizeof(uint16_t);
+		}
+
+		progress = std::make_unique<progress_meter>(stderr, args.progress_interval, pages, bytes, tasks.size());
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	try
+	{
+		run_scheduled(costs, nworkers, args.threads, budget == 0 ? UINT64_MAX : budget, [&](size_t n, size_t nthreads) {
+			const input_t& in = *tasks[n].in;
+			size_t i = tasks[n].timepoint;
+
+			auto tpstart = std::chrono::steady_clock::now();
+
+			convert_opts_t opts = in.opts;
+			opts.threads = nthreads;
+			if(stats)
+				opts.stats = &stats[tasks[n].id].stages;
+			opts.progress = progress.get();
+
+			tiff_opts_t topts = in.topts;
+			topts.threads = nthreads;
+
+			/* Open the tif, under a temporary name until it's complete. */
+			const fs::path partial = partial_path(in.outputs[i]);
+			std::unique_ptr<page_writer> out;
+			try
+			{
+				if(args.zarr)
+				{
+					zarr_opts_t zopts = in.zopts;
+					zopts.threads = nthreads;
+					out = std::make_unique<zarr_writer>(partial, in.xs, in.ys, in.nchan, in.zs, zopts);
+				}
+				else if(args.writer == writer_t::native)
+				{
+					out = std::make_unique<bigtiff_writer>(partial, in.xs, in.ys, in.nchan, in.zs, args.rows_per_strip, args.planar);
+				}
+				else
+				{
+					tiff_ptr tif(xTIFFOpen(partial, args.bigtiff ? "w8" : "w"));
+					if(!tif)
+						throw tiff_exception();
+
+					out = std::make_unique<tiff_writer>(std::move(tif), in.xs, in.ys, in.nchan, in.zs, topts);
+				}
+
+				/* Get the timepoint */
+				char tpbuf[32];
+				sprintf(tpbuf, "TimePoint %zu", i);
+
+				hdf5_lock l(hdf5_mutex());
+				h5g_ptr tp(H5Gopen2(in.rlevel.get(), tpbuf, H5P_DEFAULT));
+				l.unlock();
+				if(!tp)
+					throw hdf5_exception();
+
+				/* Count pages on their way to the writer. */
+				const size_t page_bytes = in.xs * in.ys * in.nchan * sizeof(uint16_t);
+				std::unique_ptr<page_writer> timed, counted;
+				page_writer *w = out.get();
+				if(opts.stats != nullptr)
+					w = (timed = std::make_unique<timed_writer>(*w, *opts.stats, page_bytes)).get();
+				if(opts.progress != nullptr)
+					w = (counted = std::make_unique<progress_writer>(*w, *opts.progress, page_bytes)).get();
+
+				in.conv(*w, tp.get(), in.xs, in.ys, in.zs, in.nchan, opts);
+
+				/* Through the wrappers, so closing the file counts as writing. */
+				w->finish();
+				counted.reset();
+				timed.reset();
+				out.reset();
+			}
+			catch(...)
+			{
+				std::error_code ec;
+				out.reset();
+				fs::remove_all(partial, ec);
+				throw;
+			}
+
+			manifest_entry_t e = expected_entry(in, i);
+			e.crc32 = crc32_file(partial);
+
+			/* A directory can't be renamed over, a file can. */
+			std::error_code ec;
+			e.size = output_size(partial, ec);
+			if(!ec && fs::is_directory(in.outputs[i]))
+				fs::remove_all(in.outputs[i], ec);
+			if(!ec)
+				fs::rename(partial, in.outputs[i], ec);
+
+			if(ec)
+			{
+				fprintf(stderr, "Error finishing %s: %s\n", partial.u8string().c_str(), ec.message().c_str());
+				throw tiff_exception();
+			}
+
+			manifest->append(e);
+
+			if(progress)
+				progress->add_timepoint();
+
+			if(stats)
+			{
+				stats[tasks[n].id].threads = nthreads;
+				stats[tasks[n].id].seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - tpstart).count();
+			}
+		});
+	}
+	catch(std::exception&)
+	{
+		/* Errors have already been reported to console. */
+		return 1;
+	}
+
+	if(progress)
+		progress->finish();
+
+	if(stats)
+	{
+		for(const task_t& t : order)
+		{
+			stats_row_t& r = log->rows.emplace_back();
+			r.file = t.in->path;
+			r.timepoint = t.timepoint;
+			r.output = t.in->outputs[t.timepoint];
+			r.method = t.in->method;
+			r.threads = stats[t.id].threads;
+			r.seconds = stats[t.id].seconds;
+			r.bytes = t.size * sizeof(uint16_t);
+			r.stages.merge(stats[t.id].stages);
+		}
+
+		log->seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	return 0;
+}
+
+/*
+ * Convert TimePoints as they're written. Each pass reopens the file and converts the new
+ * ones that are complete, the manifest skips those already done. A TimePoint's complete once
+ * the next one's been started. The last one is once the file hasn't changed for --follow-idle
+ * seconds, which is also when we stop.
+ */
+static int follow_input(const args_t& args, uint64_t budget, stats_log_t *log)
+{
+	growth_watch watch(args.files[0]);
+	follow_t follow = {false, 0, false};
+	for(;; ++follow.pass)
+	{
+		watch.poll();
+		follow.settled = watch.idle_seconds() >= args.follow_idle;
+
+		int r = convert_inputs(args, budget, &follow, log);
+		if(r > 0)
+			return r;
+
+		/* Unless it started again while we were converting. */
+		if(follow.settled && !watch.poll())
+			return 0;
+
+		std::this_thread::sleep_for(std::chrono::duration<double>(args.follow_interval));
+	}
+}
+
+int main(int argc, char **argv)
+{
+	args_t args;
+	int aret = parse_arguments(argc, argv, stdout, stderr, &args);
+	if(aret != 0)
+		return aret;
+
+	/* One budget for everything. */
+	uint64_t budget = 0;
+	if((args.method == conversion_method_t::automatic || args.max_memory != 0) && !args.dump_chunk_map)
+	{
+		budget = args.max_memory;
+		if(budget == 0 && (budget = get_available_memory()) == 0)
+		{
+			fprintf(stderr, "Unable to determine available memory, use --max-memory.\n");
+			return 1;
+		}
+	}
+
+	/* Open --stats now, rather than find out it can't be after converting everything. */
+	FILE *statsfile = nullptr;
+	std::unique_ptr<stats_log_t> log;
+	if(!args.stats.empty() && !args.dump_chunk_map)
+	{
+		statsfile = stdout;
+		if(args.stats != "-" && (statsfile = fopen(args.stats.u8string().c_str(), "w")) == nullptr)
+		{
+			fprintf(stderr, "Unable to open %s: %s\n", args.stats.u8string().c_str(), strerror(errno));
 			return 1;
+		}
+
+		log = std::make_unique<stats_log_t>();
+	}
+	std::unique_ptr<FILE, int(*)(FILE*)> statsclose(statsfile != stdout ? statsfile : nullptr, fclose);
+
+	int r = args.follow ? follow_input(args, budget, log.get()) : convert_inputs(args, budget, nullptr, log.get());
+	if(r != 0 || !log)
+		return r;
 
-		conv(tif.get(), tp.get(), imsinfo.x, imsinfo.y, imsinfo.z, imsinfo.c);
+	write_stats(statsfile, args, *log);
+	if(fflush(statsfile) != 0 || ferror(statsfile) || (statsfile != stdout && fclose(statsclose.release()) != 0))
+	{
+		fprintf(stderr, "Error writing %s.\n", args.stats.u8string().c_str());
+		return 1;
 	}
 
 	return 0;
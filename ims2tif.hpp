@@ -25,8 +25,16 @@ limitations under the License.
 #include <memory>
 #include <vector>
 #include <iosfwd>
+#include <cstdio>
 #include <filesystem>
 #include <optional>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <chrono>
+#include <thread>
+#include <condition_variable>
+#include <unordered_map>
 #include "hdf5.h"
 
 using TIFF = struct tiff;
@@ -45,13 +53,22 @@ class tiff_exception : public std::exception
 	using std::exception::exception;
 };
 
+/*
+ * HDF5 isn't built thread-safe in our static builds, so anything that touches it
+ * from a worker thread must hold this. It's recursive so the handle deleters can
+ * take it too.
+ */
+std::recursive_mutex& hdf5_mutex() noexcept;
+using hdf5_lock = std::unique_lock<std::recursive_mutex>;
+
 struct h5_hid
 {
 	h5_hid(void) : _desc(H5I_INVALID_HID) {}
 	h5_hid(hid_t fd) : _desc(fd) {}
 	h5_hid(std::nullptr_t) : _desc(H5I_INVALID_HID) {}
 
-	operator hid_t() { return _desc; }
+	operator hid_t() const { return _desc; }
+	explicit operator bool() const { return _desc != H5I_INVALID_HID; }
 
 	bool operator==(const h5_hid &other) const { return _desc == other._desc; }
 	bool operator!=(const h5_hid &other) const { return _desc != other._desc; }
@@ -64,42 +81,42 @@ struct h5_hid
 struct h5f_deleter
 {
 	using pointer = h5_hid;
-	void operator()(pointer hid) noexcept { H5Fclose(hid); }
+	void operator()(pointer hid) noexcept { hdf5_lock l(hdf5_mutex()); H5Fclose(hid); }
 };
 using h5f_ptr = std::unique_ptr<h5f_deleter::pointer, h5f_deleter>;
 
 struct h5g_deleter
 {
 	using pointer = h5_hid;
-	void operator()(pointer hid) noexcept { H5Gclose(hid); }
+	void operator()(pointer hid) noexcept { hdf5_lock l(hdf5_mutex()); H5Gclose(hid); }
 };
 using h5g_ptr = std::unique_ptr<h5g_deleter::pointer, h5g_deleter>;
 
 struct h5a_deleter
 {
 	using pointer = h5_hid;
-	void operator()(pointer hid) noexcept { H5Aclose(hid); }
+	void operator()(pointer hid) noexcept { hdf5_lock l(hdf5_mutex()); H5Aclose(hid); }
 };
 using h5a_ptr = std::unique_ptr<h5a_deleter::pointer, h5a_deleter>;
 
 struct h5s_deleter
 {
 	using pointer = h5_hid;
-	void operator()(pointer hid) noexcept { H5Sclose(hid); }
+	void operator()(pointer hid) noexcept { hdf5_lock l(hdf5_mutex()); H5Sclose(hid); }
 };
 using h5s_ptr = std::unique_ptr<h5s_deleter::pointer, h5s_deleter>;
 
 struct h5d_deleter
 {
 	using pointer = h5_hid;
-	void operator()(pointer hid) noexcept { H5Dclose(hid); }
+	void operator()(pointer hid) noexcept { hdf5_lock l(hdf5_mutex()); H5Dclose(hid); }
 };
 using h5d_ptr = std::unique_ptr<h5d_deleter::pointer, h5d_deleter>;
 
 struct h5p_deleter
 {
 	using pointer = h5_hid;
-	void operator()(pointer hid) noexcept { H5Pclose(hid); }
+	void operator()(pointer hid) noexcept { hdf5_lock l(hdf5_mutex()); H5Pclose(hid); }
 };
 using h5p_ptr = std::unique_ptr<h5p_deleter::pointer, h5p_deleter>;
 
@@ -110,17 +127,84 @@ struct tiff_deleter
 };
 using tiff_ptr = std::unique_ptr<tiff_deleter::pointer, tiff_deleter>;
 
-enum class conversion_method_t { bigload, chunked, hyperslab };
+enum class conversion_method_t { bigload, chunked, hyperslab, slab, mmap, automatic };
+
+enum class writer_t { libtiff, native };
+
+enum class compression_t { none, lzw, deflate, zstd };
+
+/*
+ * The part of each TimePoint to convert: a box starting at {x0, y0, z0} (its size is the
+ * converters' xs, ys and zs), and a subset of the channels. Everything, by default.
+ */
+struct region_t
+{
+	size_t x0 = 0;
+	size_t y0 = 0;
+	size_t z0 = 0;
+	std::vector<size_t> channels; /* Source channel of each output channel. Empty for all of them. */
+
+	size_t channel(size_t c) const noexcept { return channels.empty() ? c : channels[c]; }
+};
+
+class stage_stats;
+class progress_meter;
+
+/* Options passed through to the converters. */
+struct convert_opts_t
+{
+	size_t threads; /* Threads available to each TimePoint. */
+	size_t buffers; /* Slab buffers in the read/write pipeline. */
+	size_t queue_depth; /* Filled slabs allowed to wait for the writer. */
+	bool planar; /* Write pages with write_page_planar(), skipping the interleave. */
+	bool verbose;
+	region_t region;
+	stage_stats *stats; /* Where to count the time spent in each stage, nullptr if not. */
+	progress_meter *progress; /* Where to count pages filled in place, nullptr if not. */
+};
 
 struct args_t
 {
 	args_t() noexcept;
 
-	std::filesystem::path file;
-	std::string prefix;
+	std::vector<std::filesystem::path> files;
+	std::string prefix; /* Empty for each file's base name and a _. */
 	std::filesystem::path outdir;
 	conversion_method_t method;
 	bool bigtiff;
+	bool zarr; /* Write an OME-Zarr store per input instead. */
+	size_t zarr_chunks[3]; /* x, y, z. All 0 if unspecified. */
+	writer_t writer;
+	size_t rows_per_strip;
+	size_t tile_width;
+	size_t tile_height;
+	bool tile_chunks; /* Tile size from the chunk size. */
+	size_t threads;
+	size_t inflight;
+	size_t buffers;
+	size_t queue_depth;
+	uint64_t max_memory; /* 0 if unspecified. */
+	compression_t compression;
+	int level;
+	bool planar;
+	bool pyramid; /* Pyramidal OME-TIFF. */
+	size_t pyramid_levels; /* 0 if unspecified. */
+	size_t resolution_level;
+	size_t tp_begin; /* TimePoints [tp_begin, tp_end) every tp_step. */
+	size_t tp_end; /* SIZE_MAX if unspecified. */
+	size_t tp_step;
+	std::vector<size_t> channels; /* Empty if unspecified. */
+	size_t roi[6]; /* x0, y0, z0, w, h, d. All 0 if unspecified. */
+	bool verbose;
+	bool dump_chunk_map;
+	std::filesystem::path stats; /* Empty if unspecified. */
+	bool progress;
+	double progress_interval; /* Seconds, 0 if unspecified. */
+	bool overwrite; /* Ignore the manifest and convert everything. */
+	bool verify; /* Check the CRC of outputs in the manifest before skipping them. */
+	bool follow; /* Convert TimePoints as they're written. */
+	double follow_interval; /* Seconds between passes. */
+	double follow_idle; /* Seconds unchanged before the writer's taken to be finished. */
 };
 /* args.cpp */
 int parse_arguments(int argc, char **argv, FILE *out, FILE *err, args_t *args);
@@ -129,20 +213,676 @@ std::optional<std::string> hdf5_read_attribute(hid_t id, const char *name) noexc
 
 std::optional<size_t> hdf5_read_uint_attribute(hid_t id, const char *name) noexcept;
 
-int read_channel(hid_t tp, size_t channel, uint16_t *data, size_t xs, size_t ys, size_t zs) noexcept;
+/* Read a channel of the region. */
+int read_channel(hid_t tp, const region_t& region, size_t channel, uint16_t *data, size_t xs, size_t ys, size_t zs) noexcept;
+
+/* Read planes [z0, z0 + nz) of a channel of the region. */
+int read_channel_slab(hid_t tp, const region_t& region, size_t channel, uint16_t *data, size_t xs, size_t ys, size_t z0, size_t nz) noexcept;
+
+/* Where the converters send their pages. */
+class page_writer
+{
+public:
+	virtual ~page_writer() = default;
+
+	/* data is w * h * num_channels interleaved samples. */
+	virtual void write_page_contig(size_t page, uint16_t *data) = 0;
+
+	/* planes[c] is w * h samples of channel c. */
+	virtual void write_page_planar(size_t page, const uint16_t* const *planes) = 0;
+
+	/*
+	 * If pages can be filled in place, returns where page 0 starts in memory, with
+	 * the rest following it back to back, in the page's layout. Otherwise nullptr.
+	 */
+	virtual uint16_t *map_pages() { return nullptr; }
+
+	/*
+	 * Get everything written out and close the output, throwing if any of it failed.
+	 * Nothing may be written after. Only once this returns is the output complete.
+	 */
+	virtual void finish() = 0;
+};
+
+/*
+ * Writes a stack of uint16 pages to a TIFF. Every page has the same tags,
+ * so they're worked out once up front.
+ */
+struct tiff_opts_t
+{
+	size_t rows_per_strip; /* 0 for one strip per page if uncompressed, or about 64KiB strips if not. */
+	size_t tile_width; /* Multiples of 16, 0 for strips. */
+	size_t tile_height;
+	compression_t compression;
+	int level; /* 0 for the codec's default. */
+	size_t threads; /* Strips and tiles are encoded on this many threads. */
+	bool planar; /* PLANARCONFIG_SEPARATE, only write_page_planar() is allowed. */
+	size_t pyramid_levels; /* Reduced levels in each page's SubIFDs, 0 for none. */
+	std::string description; /* The first page's ImageDescription, empty for none. */
+};
+
+class tiff_writer : public page_writer
+{
+public:
+	tiff_writer(tiff_ptr&& tiff, size_t w, size_t h, size_t num_channels, size_t npages, const tiff_opts_t& opts);
+
+	void write_page_contig(size_t page, uint16_t *data) override;
+	void write_page_planar(size_t page, const uint16_t* const *planes) override;
+	void finish() override;
+
+private:
+	void apply_tags(size_t page, size_t level);
+	void write_page(size_t page, const uint16_t* const *planes, size_t nplanes);
+	void write_directory(size_t page, size_t level, const uint16_t* const *planes, size_t nplanes);
+	void write_strips(const uint16_t* const *planes, size_t nplanes, size_t w, size_t h);
+	void write_tiles(const uint16_t* const *planes, size_t nplanes, size_t w, size_t h);
+
+	tiff_ptr _tiff;
+	uint32_t _width;
+	uint32_t _height;
+	uint16_t _num_channels;
+	uint16_t _npages;
+	uint32_t _rows_per_strip;
+	uint32_t _tile_width;
+	uint32_t _tile_height;
+	compression_t _compression;
+	int _level;
+	size_t _nthreads;
+	bool _planar;
+	size_t _pyramid_levels;
+	std::string _description;
+	std::vector<uint16_t> _extrasamples;
+	std::vector<uint16_t> _levels[2]; /* The last two pyramid levels made, each level's made from the one before. */
+	std::vector<std::vector<uint8_t>> _encoded; /* Encoded strips or tiles of the current page. */
+};
+
+/* bigtiff.cpp */
+/*
+ * Uncompressed BigTIFF writer that doesn't use libtiff. The file is laid out and
+ * preallocated up front, pages are written with pwrite() straight from the caller.
+ * Not available on Windows.
+ */
+class bigtiff_writer : public page_writer
+{
+public:
+	/* If planar, pages are PLANARCONFIG_SEPARATE and only write_page_planar() is allowed. */
+	bigtiff_writer(const std::filesystem::path& path, size_t w, size_t h, size_t num_channels, size_t npages, size_t rows_per_strip, bool planar);
+	~bigtiff_writer() override;
+
+	bigtiff_writer(const bigtiff_writer&) = delete;
+	bigtiff_writer& operator=(const bigtiff_writer&) = delete;
+
+	void write_page_contig(size_t page, uint16_t *data) override;
+	void write_page_planar(size_t page, const uint16_t* const *planes) override;
+
+	/* mmap()s the whole file. */
+	uint16_t *map_pages() override;
+
+	/* Unmaps, fsync()s and closes the file. */
+	void finish() override;
+
+private:
+	void pwrite_all(const void *data, size_t size, uint64_t offset);
+
+	int _fd;
+	size_t _num_channels;
+	bool _planar;
+	uint64_t _page_size;
+	uint64_t _data_offset;
+	uint64_t _file_size;
+	void *_map;
+};
+
+/* zarr.cpp */
+struct zarr_opts_t
+{
+	size_t chunk_x; /* The chunk shape, the T and C of each chunk are 1. */
+	size_t chunk_y;
+	size_t chunk_z;
+	compression_t compression; /* none, deflate or zstd. */
+	int level; /* 0 for the codec's default. */
+	size_t threads; /* Chunks are encoded and written on this many threads. */
+};
+
+/* What's in an OME-Zarr store's metadata. */
+struct zarr_image_t
+{
+	std::string name;
+	size_t t, c, z, y, x;
+	double scale[3]; /* x, y, z size of a voxel, in unit. */
+	double origin[3]; /* x, y, z of the first voxel, in unit. */
+	std::string unit; /* An OME-Zarr unit name, or empty if unknown. */
+};
+
+/*
+ * The Zarr chunk shape {x, y, z} for a TimePoint: --zarr-chunks if given, otherwise its HDF5
+ * chunks' (or 256x256x16 if it isn't chunked). Never bigger than the image.
+ */
+void get_zarr_chunk_shape(hid_t tp, const region_t& region, size_t nchan, size_t xs, size_t ys, size_t zs, const args_t& args, size_t shape[3]);
+
+/* Where a TimePoint's chunks go in a store. */
+std::filesystem::path zarr_timepoint_path(const std::filesystem::path& store, size_t timepoint);
+
+/* Write a store's .zgroup, .zattrs and the array's .zarray. Throws tiff_exception. */
+void write_zarr_metadata(const std::filesystem::path& store, const zarr_image_t& image, const zarr_opts_t& opts);
+
+/*
+ * Writes a TimePoint's pages as the Zarr chunks under dir (see zarr_timepoint_path()). Pages
+ * must come in order. Each layer of chunks is written once its last page is.
+ */
+class zarr_writer : public page_writer
+{
+public:
+	zarr_writer(const std::filesystem::path& dir, size_t w, size_t h, size_t num_channels, size_t npages, const zarr_opts_t& opts);
+
+	void write_page_contig(size_t page, uint16_t *data) override;
+	void write_page_planar(size_t page, const uint16_t* const *planes) override;
+	void finish() override;
+
+private:
+	size_t layer_depth() const noexcept;
+	uint16_t *layer_plane(size_t page, size_t c);
+	void flush_layer();
+
+	std::filesystem::path _dir;
+	size_t _width;
+	size_t _height;
+	size_t _num_channels;
+	size_t _npages;
+	zarr_opts_t _opts;
+	size_t _layer; /* The layer of chunks being filled. */
+	size_t _filled; /* Pages of it written. */
+	std::vector<uint16_t> _buffer; /* The layer's planes, [c][z][y][x]. */
+};
+
+/* ome.cpp */
+/* What goes in a TIFF's OME-XML. */
+struct ome_image_t
+{
+	std::string name;
+	size_t x, y, z, c;
+	bool planar;
+	double scale[3]; /* x, y, z size of a voxel, in unit. */
+	std::string unit; /* As in zarr_image_t, empty if unknown. */
+};
+
+/* How many times w x h has to be halved to fit in size x size. */
+size_t count_pyramid_levels(size_t w, size_t h, size_t size) noexcept;
+
+/*
+ * Halve a w x h plane of spp interleaved samples in X and Y, averaging each 2x2 block,
+ * into dst ((w + 1) / 2 x (h + 1) / 2). Rows are spread over nthreads threads.
+ */
+void downsample_2x(const uint16_t *src, size_t w, size_t h, size_t spp, uint16_t *dst, size_t nthreads);
+
+std::string build_ome_xml(const ome_image_t& image);
+
+/* threads.cpp */
+/*
+ * Call proc(i) for each i in [0, n), spread over at most nthreads threads
+ * (including the caller). If any call throws, no new work is started and
+ * the first exception is rethrown once everything has finished.
+ */
+void parallel_for(size_t n, size_t nthreads, const std::function<void(size_t)>& proc);
+
+/*
+ * Call proc(i, share) for each task in [0, costs.size()) on at most nworkers threads (including
+ * the caller). Task i only starts while its costs[i] fits in budget alongside the running ones,
+ * though one always runs. Workers take the first waiting task that fits, so order them biggest
+ * first. share is the task's share of nthreads, which grows once there are fewer tasks left than
+ * workers. Exceptions are handled like parallel_for().
+ */
+void run_scheduled(const std::vector<uint64_t>& costs, size_t nworkers, size_t nthreads, uint64_t budget, const std::function<void(size_t, size_t)>& proc);
+
+struct pipeline_stats_t
+{
+	size_t read_stalls; /* Times the producer waited on a free buffer or a full queue. */
+	double read_stall_time;
+	size_t write_stalls; /* Times the consumer waited on an empty queue. */
+	double write_stall_time;
+};
+
+using pipeline_proc = std::function<void(size_t item, size_t buffer)>;
+
+/*
+ * Two-stage pipeline over items [0, n). produce(i, b) fills buffer b on the calling
+ * thread, consume(i, b) drains it, in order, on a second thread. At most depth
+ * filled buffers wait between the stages. With a single buffer it runs in series.
+ */
+void run_pipeline(size_t n, size_t nbuffers, size_t depth, const pipeline_proc& produce, const pipeline_proc& consume, pipeline_stats_t& stats);
+
+/* stats.cpp */
+enum class stage_t
+{
+	read, /* Reading the source, including any decompression done inside HDF5. */
+	decompress, /* Decompressing chunks ourselves, see chunk_reader. */
+	interleave, /* Rearranging samples into pages. */
+	write, /* Writing pages, including any TIFF compression. */
+};
+constexpr size_t num_stages = 4;
+
+const char *stage_name(stage_t stage) noexcept;
+
+/* Time, bytes and calls spent in each stage of a conversion. Safe to update from any thread. */
+class stage_stats
+{
+public:
+	struct totals_t
+	{
+		double seconds; /* Summed over threads, so can exceed wall time. */
+		uint64_t bytes;
+		uint64_t calls;
+	};
+
+	void add(stage_t stage, uint64_t ns, uint64_t bytes) noexcept;
+	totals_t get(stage_t stage) const noexcept;
+
+	/* Add everything in other to this. */
+	void merge(const stage_stats& other) noexcept;
+
+private:
+	std::atomic<uint64_t> _ns[num_stages] = {};
+	std::atomic<uint64_t> _bytes[num_stages] = {};
+	std::atomic<uint64_t> _calls[num_stages] = {};
+};
+
+/* Counts the time until it goes out of scope against a stage. Costs nothing if stats is nullptr. */
+class stage_timer
+{
+public:
+	stage_timer(stage_stats *stats, stage_t stage, uint64_t bytes) noexcept;
+	~stage_timer();
+
+	stage_timer(const stage_timer&) = delete;
+	stage_timer& operator=(const stage_timer&) = delete;
+
+private:
+	stage_stats *_stats;
+	stage_t _stage;
+	uint64_t _bytes;
+	uint64_t _start;
+};
+
+/* Counts every page written to out as the write stage. */
+class timed_writer : public page_writer
+{
+public:
+	timed_writer(page_writer& out, stage_stats& stats, size_t page_bytes) noexcept;
+
+	void write_page_contig(size_t page, uint16_t *data) override;
+	void write_page_planar(size_t page, const uint16_t* const *planes) override;
+	uint16_t *map_pages() override;
+	void finish() override;
+
+private:
+	page_writer& _out;
+	stage_stats& _stats;
+	size_t _page_bytes;
+};
+
+/* Write s as a quoted JSON string. */
+void write_json_string(FILE *out, const std::string& s);
+
+/* Write a stage_stats as a JSON object, keyed by stage name. */
+void write_stats_json(FILE *out, const stage_stats& stats);
+
+/* progress.cpp */
+/*
+ * Pages, bytes and TimePoints done out of the total, reported every interval seconds from
+ * its own thread: a bar if out is a terminal, otherwise a line of key=value pairs.
+ * Counting is a relaxed atomic add, so call it as often as you like.
+ */
+class progress_meter
+{
+public:
+	/* An interval of 0 is every 0.5s on a terminal, every 10s otherwise. */
+	progress_meter(FILE *out, double interval, uint64_t pages, uint64_t bytes, size_t timepoints);
+	~progress_meter();
+
+	progress_meter(const progress_meter&) = delete;
+	progress_meter& operator=(const progress_meter&) = delete;
+
+	void add_pages(uint64_t pages, uint64_t bytes) noexcept
+	{
+		_pages.fetch_add(pages, std::memory_order_relaxed);
+		_bytes.fetch_add(bytes, std::memory_order_relaxed);
+	}
+
+	void add_timepoint() noexcept { _timepoints.fetch_add(1, std::memory_order_relaxed); }
+
+	/* Stop reporting, and print where it ended up. */
+	void finish();
+
+private:
+	void run();
+	void report(bool last);
+
+	FILE *_out;
+	bool _tty;
+	double _interval;
+	uint64_t _total_pages;
+	uint64_t _total_bytes;
+	size_t _total_timepoints;
+	std::chrono::steady_clock::time_point _start;
+
+	alignas(64) std::atomic<uint64_t> _pages{0};
+	std::atomic<uint64_t> _bytes{0};
+	std::atomic<size_t> _timepoints{0};
+
+	/* Recent (seconds, bytes) samples, for the rolling rate. */
+	std::vector<std::pair<double, uint64_t>> _samples;
+
+	std::mutex _mutex;
+	std::condition_variable _cv;
+	bool _stop = false;
+	std::thread _thread;
+};
+
+/* Counts every page written to out. */
+class progress_writer : public page_writer
+{
+public:
+	progress_writer(page_writer& out, progress_meter& progress, size_t page_bytes) noexcept;
+
+	void write_page_contig(size_t page, uint16_t *data) override;
+	void write_page_planar(size_t page, const uint16_t* const *planes) override;
+	uint16_t *map_pages() override;
+	void finish() override;
+
+private:
+	page_writer& _out;
+	progress_meter& _progress;
+	size_t _page_bytes;
+};
+
+/* resume.cpp */
+/* A line of the output manifest: a finished output, and what it was converted from and how. */
+struct manifest_entry_t
+{
+	std::string output; /* File name, relative to the output directory. */
+	uint64_t size;
+	size_t pages;
+	std::string source;
+	size_t timepoint;
+	size_t x, y, z, c; /* Of the source. */
+	uint32_t crc32;
+	std::string settings; /* Everything else that changes the output. */
+};
+
+/* The finished outputs in an output directory. Appending is thread-safe. */
+class output_manifest
+{
+public:
+	/* Read what's there, and open it for appending. Returns nullptr if it can't be. */
+	static std::unique_ptr<output_manifest> open(const std::filesystem::path& outdir);
+
+	~output_manifest();
+
+	output_manifest(const output_manifest&) = delete;
+	output_manifest& operator=(const output_manifest&) = delete;
+
+	const manifest_entry_t *find(const std::string& output) const noexcept;
+
+	void append(const manifest_entry_t& entry);
+
+private:
+	output_manifest() = default;
+
+	std::unordered_map<std::string, manifest_entry_t> _entries;
+	FILE *_file = nullptr;
+	std::mutex _mutex;
+};
+
+/* Where an output is written before it's complete. */
+std::filesystem::path partial_path(const std::filesystem::path& path);
+
+/* CRC-32 of a file, or of the names and contents of every file under a directory. */
+uint32_t crc32_file(const std::filesystem::path& path);
+
+/* Size of a file, or the total of every file under a directory. */
+uint64_t output_size(const std::filesystem::path& path, std::error_code& ec);
+
+/*
+ * Is the output at path what expected describes, going by its manifest entry (nullptr if
+ * none) and size? If verify, also check its CRC.
+ */
+bool output_complete(const manifest_entry_t& expected, const manifest_entry_t *entry, const std::filesystem::path& path, bool verify);
+
+/* follow.cpp */
+/* Open a file that may still be being written, for reading. HDF5's errors aren't printed. */
+hid_t open_growing_file(const std::filesystem::path& path) noexcept;
+
+/* How many TimePoints a resolution level has, counting "TimePoint %u" groups up from 0. */
+size_t count_timepoints(hid_t rlevel) noexcept;
+
+/* Watches a file's size and modification time, to tell when its writer has finished. */
+class growth_watch
+{
+public:
+	explicit growth_watch(const std::filesystem::path& path);
+
+	/* Look at the file again. Returns true if it's changed. */
+	bool poll();
+
+	/* Seconds since poll() last saw it change. */
+	double idle_seconds() const noexcept;
+
+private:
+	std::filesystem::path _path;
+	uintmax_t _size;
+	std::filesystem::file_time_type _mtime;
+	std::chrono::steady_clock::time_point _changed;
+};
+
+/* compress.cpp */
+/* Was support for c built in? */
+bool compression_supported(compression_t c) noexcept;
+
+/* Encode a TIFF strip into out. level of 0 is the codec's default. */
+void compress_strip(compression_t c, int level, const uint8_t *src, size_t size, std::vector<uint8_t>& out);
+
+/* srcmap.cpp */
+/* Is this something we can memcpy() into a uint16_t? */
+bool dataset_is_native_u16(hid_t dataset) noexcept;
+
+/* Name of the file obj lives in, if addresses in it are file offsets. Empty otherwise. */
+std::string get_raw_file_name(hid_t obj);
+
+/* Read-only mapping of the source file. */
+class source_map
+{
+public:
+	/* Map the file obj lives in. nullptr if it can't be (e.g. on Windows). */
+	static std::shared_ptr<source_map> open(hid_t obj);
+
+	~source_map();
+
+	source_map(const source_map&) = delete;
+	source_map& operator=(const source_map&) = delete;
+
+	const uint8_t *data() const noexcept { return _data; }
+	uint64_t size() const noexcept { return _size; }
 
-void tiff_write_page_contig(TIFF *tiff, size_t w, size_t h, size_t num_channels, size_t page, size_t maxPage, uint16_t *data);
+	/* Hint that [offset, offset + size) will be read once, in order. */
+	void advise_sequential(uint64_t offset, uint64_t size) const noexcept;
 
-using convert_proc = void(*)(TIFF *tiff, hid_t timepoint, size_t xs, size_t ys, size_t zs, size_t nchan);
+	/*
+	 * Where channel c's planes of the region are, if it's a contiguous, unfiltered, native
+	 * uint16 dataset that's only padded in Z, and the region covers whole planes. nullptr otherwise.
+	 */
+	const uint16_t *map_channel(hid_t timepoint, const region_t& region, size_t c, size_t xs, size_t ys, size_t zs) const;
+
+private:
+	source_map() = default;
+
+	const uint8_t *_data = nullptr;
+	uint64_t _size = 0;
+};
+
+/* chunks.cpp */
+struct chunk_info_t
+{
+	size_t channel; /* Of the region. */
+	hsize_t offset[3]; /* Chunk origin in the dataset, {z, y, x}. */
+	haddr_t addr; /* HADDR_UNDEF if not allocated. */
+	hsize_t size; /* Stored (i.e. compressed) size. */
+	unsigned filter_mask;
+};
+
+/* Index every chunk of every channel of the region, in channel/z/y/x order. Needs HDF5 1.10.5+. */
+int build_chunk_index(hid_t timepoint, const region_t& region, size_t nchan, std::vector<chunk_info_t>& index) noexcept;
+
+/* Print a TimePoint's chunk index, and a summary of how it's laid out. */
+void dump_chunk_map(FILE *out, size_t timepoint, const std::vector<chunk_info_t>& index);
+
+/*
+ * Reads a TimePoint's chunks with H5Dread_chunk() and decompresses them on worker
+ * threads, instead of going through HDF5's single-threaded filter pipeline.
+ */
+class chunk_reader
+{
+public:
+	/* Returns nullptr if the layout, type or filters aren't supported. Use H5Dread() instead. */
+	static std::unique_ptr<chunk_reader> open(hid_t timepoint, const region_t& region, size_t xs, size_t ys, size_t zs, size_t nchan, stage_stats *stats);
+
+	~chunk_reader();
+
+	/* Worst-case scratch memory each reading thread needs. layer_bytes is the stored size of a chunk layer. */
+	static size_t scratch_size(size_t chunk_bytes, uint64_t layer_bytes) noexcept;
+
+	chunk_reader(const chunk_reader&) = delete;
+	chunk_reader& operator=(const chunk_reader&) = delete;
+
+	/* Read planes [z0, z0 + nz) of the region's channels, interleaved into dst. Only chunks in the region are read. */
+	void read_slab_contig(size_t z0, size_t nz, uint16_t *dst, size_t nthreads);
+
+	/* Read planes [z0, z0 + nz) of the region's channels, nz planes of each channel in turn. */
+	void read_slab_planar(size_t z0, size_t nz, uint16_t *dst, size_t nthreads);
+
+private:
+	chunk_reader() = default;
+
+	void build_runs(hid_t timepoint, std::vector<chunk_info_t>&& index);
+	void read_raw(uint64_t addr, uint8_t *buf, size_t size);
+	void read_slab(size_t z0, size_t nz, uint16_t *dst, bool planar, size_t nthreads);
+	void scatter(size_t c, const hsize_t *offset, const uint16_t *src, size_t z0, size_t nz, uint16_t *dst, bool planar) const noexcept;
+
+	/* A single read covering index[first, first + count). */
+	struct run_t
+	{
+		uint64_t addr;
+		uint64_t size;
+		size_t first;
+		size_t count;
+	};
+
+	struct channel_t
+	{
+		h5d_ptr dataset;
+		std::vector<H5Z_filter_t> filters;
+		uint16_t fill;
+	};
+
+	size_t _xs, _ys, _zs;
+	size_t _x0, _y0, _z0; /* Where the region starts in the dataset. */
+	hsize_t _xcs, _ycs, _zcs;
+	std::vector<channel_t> _channels;
+	stage_stats *_stats = nullptr;
+
+	/* Only used when reading from the file directly. */
+	FILE *_raw = nullptr;
+	std::shared_ptr<source_map> _map;
+	std::vector<chunk_info_t> _index; /* By chunk layer, then file order. */
+	std::vector<run_t> _runs;
+	std::vector<size_t> _layer_runs; /* Layer k is _runs[_layer_runs[k], _layer_runs[k + 1]) */
+};
+
+/* interleave.cpp */
+/*
+ * Interleave count pixels from nchan planes into dst, i.e. dst[i * nchan + c] = planes[c][i].
+ * Uses the best SIMD kernel the CPU supports, picked on first use.
+ */
+void interleave(const uint16_t * const *planes, size_t nchan, size_t count, uint16_t *dst) noexcept;
+
+/*
+ * As above, but for nplanes planes of plane_size pixels each. Each plane is cut into
+ * cache-sized tiles and the tiles are spread over nthreads threads.
+ */
+void interleave_tiled(const uint16_t * const *planes, size_t nchan, size_t plane_size, size_t nplanes, uint16_t *dst, size_t nthreads);
+
+/* The name of the instruction set interleave() is using. */
+const char *interleave_isa() noexcept;
+
+using convert_proc = void(*)(page_writer& out, hid_t timepoint, size_t xs, size_t ys, size_t zs, size_t nchan, const convert_opts_t& opts);
 
 /* cvt_bigload.cpp */
-void converter_bigload(TIFF *tiff, hid_t timepoint, size_t xs, size_t ys, size_t zs, size_t nchan);
+void converter_bigload(page_writer& out, hid_t timepoint, size_t xs, size_t ys, size_t zs, size_t nchan, const convert_opts_t& opts);
 
 /* cvt_chunk.cpp */
-void converter_chunk(TIFF *tiff, hid_t timepoint, size_t xs, size_t ys, size_t zs, size_t nchan);
+/* Get the chunk size and make sure it's the same for all of the region's nchan channels. */
+int get_chunk_size(hid_t tp, const region_t& region, size_t nchan, hsize_t& xs, hsize_t& ys, hsize_t& zs);
+
+void converter_chunk(page_writer& out, hid_t timepoint, size_t xs, size_t ys, size_t zs, size_t nchan, const convert_opts_t& opts);
+
+/* cvt_slab.cpp */
+/* Planes per slab: the chunk Z size, or about 64MiB's worth if not chunked. */
+size_t get_slab_depth(hid_t timepoint, const region_t& region, size_t xs, size_t ys, size_t zs, size_t nchan);
+
+/*
+ * A region's zs planes, starting at z0 in the source, cut into slabs of up to depth planes
+ * that line up with the source's chunk layers. The first and last may be short.
+ */
+struct slabs_t
+{
+	slabs_t(size_t z0, size_t zs, size_t depth) noexcept;
+
+	size_t count() const noexcept;
+
+	/* Slab s is planes [first(s), first(s) + size(s)) of the region. */
+	size_t first(size_t s) const noexcept;
+	size_t size(size_t s) const noexcept;
+
+	size_t zs;
+	size_t depth;
+	size_t lead; /* Planes of the first chunk layer before the region. */
+};
+
+void converter_slab(page_writer& out, hid_t timepoint, size_t xs, size_t ys, size_t zs, size_t nchan, const convert_opts_t& opts);
+
+/* cvt_mmap.cpp */
+void converter_mmap(page_writer& out, hid_t timepoint, size_t xs, size_t ys, size_t zs, size_t nchan, const convert_opts_t& opts);
 
 /* cvt_hyperslab.cpp */
-void converter_hyperslab(TIFF *tiff, hid_t timepoint, size_t xs, size_t ys, size_t zs, size_t nchan);
+void converter_hyperslab(page_writer& out, hid_t timepoint, size_t xs, size_t ys, size_t zs, size_t nchan, const convert_opts_t& opts);
+
+/* planner.cpp */
+struct plan_t
+{
+	conversion_method_t method;
+	size_t inflight;
+	size_t buffers;
+	bool direct; /* Chunks are read with chunk_reader. */
+	uint64_t budget;
+	uint64_t peak_memory;
+	uint64_t bytes_read;
+	uint64_t bytes_written;
+};
+
+/* Available physical memory in bytes, or 0 if unknown. */
+uint64_t get_available_memory() noexcept;
+
+/*
+ * Pick the fastest method (if args.method is automatic) and the most TimePoints
+ * in flight that fit in budget bytes. Sized from timepoint, which should be the first converted.
+ */
+plan_t plan_conversion(hid_t timepoint, const region_t& region, size_t xs, size_t ys, size_t zs, size_t nchan, size_t nt, const args_t& args, uint64_t budget);
+
+void print_plan(FILE *out, const plan_t& plan, size_t threads);
+
+const char *method_name(conversion_method_t m) noexcept;
+
+/* Human-readable size. Returns buf. */
+const char *format_size(uint64_t v, char (&buf)[32]) noexcept;
 
 }
 
@@ -0,0 +1,525 @@
+/*
+Dragonfly IMS to TiFF converter
+https://github.com/UQ-RCC/ims2tif
+
+SPDX-License-Identifier: Apache-2.0
+Copyright (c) 2019 The University of Queensland
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+/*
+ * Planar-to-contiguous interleaving kernels.
+ *
+ * Each kernel is specialised for 1-4 channels, everything else goes through the
+ * generic path. The vector kernels only do whole vectors and leave the tail
+ * to the scalar ones. The best kernel for the CPU is picked on first use.
+ */
+
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include "ims2tif.hpp"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#	define IMS_X86 1
+#	include <immintrin.h>
+#	if defined(_MSC_VER)
+#		include <intrin.h>
+#		define IMS_TARGET(x)
+#	else
+#		define IMS_TARGET(x) __attribute__((target(x)))
+#	endif
+#endif
+
+using namespace ims;
+
+using kernel_proc = void(*)(const uint16_t * const *planes, size_t count, uint16_t *dst);
+
+template <size_t N>
+static void interleave_scalar_n(const uint16_t * const *planes, size_t begin, size_t end, uint16_t *dst) noexcept
+{
+	for(size_t i = begin; i < end; ++i)
+	{
+		for(size_t c = 0; c < N; ++c)
+			dst[i * N + c] = planes[c][i];
+	}
+}
+
+template <>
+void interleave_scalar_n<1>(const uint16_t * const *planes, size_t begin, size_t end, uint16_t *dst) noexcept
+{
+	memcpy(dst + begin, planes[0] + begin, (end - begin) * sizeof(uint16_t));
+}
+
+template <size_t N>
+static void interleave_scalar(const uint16_t * const *planes, size_t count, uint16_t *dst)
+{
+	interleave_scalar_n<N>(planes, 0, count, dst);
+}
+
+/*
+ * N channels. Work in blocks so the destination stays in cache while
+ * each channel is scattered into it.
+ */
+static void interleave_generic(const uint16_t * const *planes, size_t nchan, size_t count, uint16_t *dst) noexcept
+{
+	constexpr size_t block = 2048;
+
+	for(size_t b = 0; b < count; b += block)
+	{
+		size_t end = std::min(b + block, count);
+		for(size_t c = 0; c < nchan; ++c)
+		{
+			const uint16_t *p = planes[c];
+			uint16_t *d = dst + c;
+			for(size_t i = b; i < end; ++i)
+				d[i * nchan] = p[i];
+		}
+	}
+}
+
+#if defined(IMS_X86)
+
+IMS_TARGET("sse2")
+static void interleave_sse2_2(const uint16_t * const *planes, size_t count, uint16_t *dst)
+{
+	size_t i = 0;
+	for(; i + 8 <= count; i += 8)
+	{
+		__m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(planes[0] + i));
+		__m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(planes[1] + i));
+
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * 2 + 0), _mm_unpacklo_epi16(a, b));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * 2 + 8), _mm_unpackhi_epi16(a, b));
+	}
+
+	interleave_scalar_n<2>(planes, i, count, dst);
+}
+
+IMS_TARGET("sse2")
+static void interleave_sse2_4(const uint16_t * const *planes, size_t count, uint16_t *dst)
+{
+	size_t i = 0;
+	for(; i + 8 <= count; i += 8)
+	{
+		__m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(planes[0] + i));
+		__m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(planes[1] + i));
+		__m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(planes[2] + i));
+		__m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(planes[3] + i));
+
+		__m128i ablo = _mm_unpacklo_epi16(a, b), abhi = _mm_unpackhi_epi16(a, b);
+		__m128i cdlo = _mm_unpacklo_epi16(c, d), cdhi = _mm_unpackhi_epi16(c, d);
+
+		__m128i *out = reinterpret_cast<__m128i*>(dst + i * 4);
+		_mm_storeu_si128(out + 0, _mm_unpacklo_epi32(ablo, cdlo));
+		_mm_storeu_si128(out + 1, _mm_unpackhi_epi32(ablo, cdlo));
+		_mm_storeu_si128(out + 2, _mm_unpacklo_epi32(abhi, cdhi));
+		_mm_storeu_si128(out + 3, _mm_unpackhi_epi32(abhi, cdhi));
+	}
+
+	interleave_scalar_n<4>(planes, i, count, dst);
+}
+
+/*
+ * 3 channels needs a byte shuffle, so this is SSSE3. 8 pixels become 3 vectors,
+ * each one is the OR of the three shuffled inputs. These are the shuffles,
+ * red, green then blue for each output vector. -1 (0x80) zeroes the byte.
+ */
+alignas(16) static const int8_t shuffle_3[9][16] = {
+	{ 0,  1, -1, -1, -1, -1,  2,  3, -1, -1, -1, -1,  4,  5, -1, -1},
+	{-1, -1,  0,  1, -1, -1, -1, -1,  2,  3, -1, -1, -1, -1,  4,  5},
+	{-1, -1, -1, -1,  0,  1, -1, -1, -1, -1,  2,  3, -1, -1, -1, -1},
+
+	{-1, -1,  6,  7, -1, -1, -1, -1,  8,  9, -1, -1, -1, -1, 10, 11},
+	{-1, -1, -1, -1,  6,  7, -1, -1, -1, -1,  8,  9, -1, -1, -1, -1},
+	{ 4,  5, -1, -1, -1, -1,  6,  7, -1, -1, -1, -1,  8,  9, -1, -1},
+
+	{-1, -1, -1, -1, 12, 13, -1, -1, -1, -1, 14, 15, -1, -1, -1, -1},
+	{10, 11, -1, -1, -1, -1, 12, 13, -1, -1, -1, -1, 14, 15, -1, -1},
+	{-1, -1, 10, 11, -1, -1, -1, -1, 12, 13, -1, -1, -1, -1, 14, 15},
+};
+
+IMS_TARGET("ssse3")
+static void interleave_ssse3_3(const uint16_t * const *planes, size_t count, uint16_t *dst)
+{
+	__m128i m[9];
+	for(size_t k = 0; k < 9; ++k)
+		m[k] = _mm_load_si128(reinterpret_cast<const __m128i*>(shuffle_3[k]));
+
+	size_t i = 0;
+	for(; i + 8 <= count; i += 8)
+	{
+		__m128i r = _mm_loadu_si128(reinterpret_cast<const __m128i*>(planes[0] + i));
+		__m128i g = _mm_loadu_si128(reinterpret_cast<const __m128i*>(planes[1] + i));
+		__m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(planes[2] + i));
+
+		__m128i *out = reinterpret_cast<__m128i*>(dst + i * 3);
+		for(size_t k = 0; k < 3; ++k)
+			_mm_storeu_si128(out + k, _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(r, m[k * 3 + 0]), _mm_shuffle_epi8(g, m[k * 3 + 1])), _mm_shuffle_epi8(b, m[k * 3 + 2])));
+	}
+
+	interleave_scalar_n<3>(planes, i, count, dst);
+}
+
+IMS_TARGET("avx2")
+static void interleave_avx2_2(const uint16_t * const *planes, size_t count, uint16_t *dst)
+{
+	size_t i = 0;
+	for(; i + 16 <= count; i += 16)
+	{
+		__m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(planes[0] + i));
+		__m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(planes[1] + i));
+
+		/* unpack works within 128-bit lanes, put the halves back in order. */
+		__m256i lo = _mm256_unpacklo_epi16(a, b);
+		__m256i hi = _mm256_unpackhi_epi16(a, b);
+
+		__m256i *out = reinterpret_cast<__m256i*>(dst + i * 2);
+		_mm256_storeu_si256(out + 0, _mm256_permute2x128_si256(lo, hi, 0x20));
+		_mm256_storeu_si256(out + 1, _mm256_permute2x128_si256(lo, hi, 0x31));
+	}
+
+	interleave_scalar_n<2>(planes, i, count, dst);
+}
+
+/*
+ * The SSSE3 shuffles on both 128-bit lanes at once: the low lanes make the first
+ * three 128-bit vectors of output, the high lanes the next three. Then they're
+ * put back in order, two to a store.
+ */
+IMS_TARGET("avx2")
+static void interleave_avx2_3(const uint16_t * const *planes, size_t count, uint16_t *dst)
+{
+	__m256i m[9];
+	for(size_t k = 0; k < 9; ++k)
+		m[k] = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(shuffle_3[k])));
+
+	size_t i = 0;
+	for(; i + 16 <= count; i += 16)
+	{
+		__m256i r = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(planes[0] + i));
+		__m256i g = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(planes[1] + i));
+		__m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(planes[2] + i));
+
+		/* v[k] is output vector k in its low lane and k + 3 in its high lane. */
+		__m256i v[3];
+		for(size_t k = 0; k < 3; ++k)
+			v[k] = _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(r, m[k * 3 + 0]), _mm256_shuffle_epi8(g, m[k * 3 + 1])), _mm256_shuffle_epi8(b, m[k * 3 + 2]));
+
+		__m256i *out = reinterpret_cast<__m256i*>(dst + i * 3);
+		_mm256_storeu_si256(out + 0, _mm256_permute2x128_si256(v[0], v[1], 0x20));
+		_mm256_storeu_si256(out + 1, _mm256_permute2x128_si256(v[2], v[0], 0x30));
+		_mm256_storeu_si256(out + 2, _mm256_permute2x128_si256(v[1], v[2], 0x31));
+	}
+
+	interleave_scalar_n<3>(planes, i, count, dst);
+}
+
+IMS_TARGET("avx2")
+static void interleave_avx2_4(const uint16_t * const *planes, size_t count, uint16_t *dst)
+{
+	size_t i = 0;
+	for(; i + 16 <= count; i += 16)
+	{
+		__m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(planes[0] + i));
+		__m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(planes[1] + i));
+		__m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(planes[2] + i));
+		__m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(planes[3] + i));
+
+		__m256i ablo = _mm256_unpacklo_epi16(a, b), abhi = _mm256_unpackhi_epi16(a, b);
+		__m256i cdlo = _mm256_unpacklo_epi16(c, d), cdhi = _mm256_unpackhi_epi16(c, d);
+
+		/* Pixels {0,1 | 8,9}, {2,3 | 10,11}, {4,5 | 12,13}, {6,7 | 14,15} */
+		__m256i q0 = _mm256_unpacklo_epi32(ablo, cdlo);
+		__m256i q1 = _mm256_unpackhi_epi32(ablo, cdlo);
+		__m256i q2 = _mm256_unpacklo_epi32(abhi, cdhi);
+		__m256i q3 = _mm256_unpackhi_epi32(abhi, cdhi);
+
+		__m256i *out = reinterpret_cast<__m256i*>(dst + i * 4);
+		_mm256_storeu_si256(out + 0, _mm256_permute2x128_si256(q0, q1, 0x20));
+		_mm256_storeu_si256(out + 1, _mm256_permute2x128_si256(q2, q3, 0x20));
+		_mm256_storeu_si256(out + 2, _mm256_permute2x128_si256(q0, q1, 0x31));
+		_mm256_storeu_si256(out + 3, _mm256_permute2x128_si256(q2, q3, 0x31));
+	}
+
+	interleave_scalar_n<4>(planes, i, count, dst);
+}
+
+/*
+ * AVX-512BW has a full cross-lane word permute across two registers, so every
+ * output vector is a single vpermt2w (or two for 3 channels).
+ */
+template <size_t N>
+struct avx512_tables
+{
+	/* For output vector k, element e: which pixel and channel it comes from. */
+	alignas(64) uint16_t idx[N][32];
+
+	avx512_tables() noexcept
+	{
+		for(size_t k = 0; k < N; ++k)
+		{
+			for(size_t e = 0; e < 32; ++e)
+			{
+				size_t g = k * 32 + e;
+				size_t pix = g / N, chan = g % N;
+				/* Channels 0/2 come from the first register, 1/3 from the second (+32). */
+				idx[k][e] = static_cast<uint16_t>(pix + ((chan & 1) ? 32 : 0));
+			}
+		}
+	}
+};
+
+IMS_TARGET("avx512f,avx512bw")
+static void interleave_avx512_2(const uint16_t * const *planes, size_t count, uint16_t *dst)
+{
+	static const avx512_tables<2> t;
+	const __m512i i0 = _mm512_load_si512(t.idx[0]);
+	const __m512i i1 = _mm512_load_si512(t.idx[1]);
+
+	size_t i = 0;
+	for(; i + 32 <= count; i += 32)
+	{
+		__m512i a = _mm512_loadu_si512(planes[0] + i);
+		__m512i b = _mm512_loadu_si512(planes[1] + i);
+
+		_mm512_storeu_si512(dst + i * 2 +  0, _mm512_permutex2var_epi16(a, i0, b));
+		_mm512_storeu_si512(dst + i * 2 + 32, _mm512_permutex2var_epi16(a, i1, b));
+	}
+
+	interleave_scalar_n<2>(planes, i, count, dst);
+}
+
+IMS_TARGET("avx512f,avx512bw")
+static void interleave_avx512_3(const uint16_t * const *planes, size_t count, uint16_t *dst)
+{
+	static const avx512_tables<3> t;
+	const __m512i i0 = _mm512_load_si512(t.idx[0]);
+	const __m512i i1 = _mm512_load_si512(t.idx[1]);
+	const __m512i i2 = _mm512_load_si512(t.idx[2]);
+
+	/* Mask of the elements holding the third channel. */
+	__mmask32 m[3] = {0, 0, 0};
+	for(size_t k = 0; k < 3; ++k)
+	{
+		for(size_t e = 0; e < 32; ++e)
+		{
+			if((k * 32 + e) % 3 == 2)
+				m[k] |= static_cast<__mmask32>(1u << e);
+		}
+	}
+
+	const __m512i low = _mm512_set1_epi16(31);
+
+	size_t i = 0;
+	for(; i + 32 <= count; i += 32)
+	{
+		__m512i r = _mm512_loadu_si512(planes[0] + i);
+		__m512i g = _mm512_loadu_si512(planes[1] + i);
+		__m512i b = _mm512_loadu_si512(planes[2] + i);
+
+		/* Red/green from the pair, then blend blue over the masked elements. Blue's index is the pixel, so (idx & 31). */
+		_mm512_storeu_si512(dst + i * 3 +  0, _mm512_mask_permutexvar_epi16(_mm512_permutex2var_epi16(r, i0, g), m[0], _mm512_and_si512(i0, low), b));
+		_mm512_storeu_si512(dst + i * 3 + 32, _mm512_mask_permutexvar_epi16(_mm512_permutex2var_epi16(r, i1, g), m[1], _mm512_and_si512(i1, low), b));
+		_mm512_storeu_si512(dst + i * 3 + 64, _mm512_mask_permutexvar_epi16(_mm512_permutex2var_epi16(r, i2, g), m[2], _mm512_and_si512(i2, low), b));
+	}
+
+	interleave_scalar_n<3>(planes, i, count, dst);
+}
+
+IMS_TARGET("avx512f,avx512bw")
+static void interleave_avx512_4(const uint16_t * const *planes, size_t count, uint16_t *dst)
+{
+	/* Two rounds of 2-way: (a,b) and (c,d) as words, then the results as dwords. */
+	static const avx512_tables<2> t;
+	const __m512i w0 = _mm512_load_si512(t.idx[0]);
+	const __m512i w1 = _mm512_load_si512(t.idx[1]);
+	const __m512i d0 = _mm512_setr_epi32(0, 16, 1, 17, 2, 18, 3, 19, 4, 20, 5, 21, 6, 22, 7, 23);
+	const __m512i d1 = _mm512_setr_epi32(8, 24, 9, 25, 10, 26, 11, 27, 12, 28, 13, 29, 14, 30, 15, 31);
+
+	size_t i = 0;
+	for(; i + 32 <= count; i += 32)
+	{
+		__m512i a = _mm512_loadu_si512(planes[0] + i);
+		__m512i b = _mm512_loadu_si512(planes[1] + i);
+		__m512i c = _mm512_loadu_si512(planes[2] + i);
+		__m512i d = _mm512_loadu_si512(planes[3] + i);
+
+		__m512i ab0 = _mm512_permutex2var_epi16(a, w0, b), ab1 = _mm512_permutex2var_epi16(a, w1, b);
+		__m512i cd0 = _mm512_permutex2var_epi16(c, w0, d), cd1 = _mm512_permutex2var_epi16(c, w1, d);
+
+		_mm512_storeu_si512(dst + i * 4 +  0, _mm512_permutex2var_epi32(ab0, d0, cd0));
+		_mm512_storeu_si512(dst + i * 4 + 32, _mm512_permutex2var_epi32(ab0, d1, cd0));
+		_mm512_storeu_si512(dst + i * 4 + 64, _mm512_permutex2var_epi32(ab1, d0, cd1));
+		_mm512_storeu_si512(dst + i * 4 + 96, _mm512_permutex2var_epi32(ab1, d1, cd1));
+	}
+
+	interleave_scalar_n<4>(planes, i, count, dst);
+}
+
+#endif
+
+enum class isa_t { scalar, sse2, ssse3, avx2, avx512 };
+
+static const char *isa_names[] = {"scalar", "sse2", "ssse3", "avx2", "avx512"};
+
+#if defined(IMS_X86) && defined(_MSC_VER)
+static isa_t detect_isa() noexcept
+{
+	int r[4];
+	__cpuid(r, 0);
+	int maxleaf = r[0];
+
+	__cpuid(r, 1);
+	bool sse2 = (r[3] & (1 << 26)) != 0;
+	bool ssse3 = (r[2] & (1 << 9)) != 0;
+	bool osxsave = (r[2] & (1 << 27)) != 0;
+
+	unsigned long long xcr0 = osxsave ? _xgetbv(0) : 0;
+	bool ymm = (xcr0 & 0x06) == 0x06;
+	bool zmm = (xcr0 & 0xe6) == 0xe6;
+
+	bool avx2 = false, avx512 = false;
+	if(maxleaf >= 7)
+	{
+		__cpuidex(r, 7, 0);
+		avx2 = ymm && (r[1] & (1 << 5)) != 0;
+		avx512 = zmm && (r[1] & (1 << 16)) != 0 && (r[1] & (1 << 30)) != 0;
+	}
+
+	if(avx512)
+		return isa_t::avx512;
+	if(avx2)
+		return isa_t::avx2;
+	if(ssse3)
+		return isa_t::ssse3;
+	if(sse2)
+		return isa_t::sse2;
+	return isa_t::scalar;
+}
+#elif defined(IMS_X86)
+static isa_t detect_isa() noexcept
+{
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+		return isa_t::avx512;
+	if(__builtin_cpu_supports("avx2"))
+		return isa_t::avx2;
+	if(__builtin_cpu_supports("ssse3"))
+		return isa_t::ssse3;
+	if(__builtin_cpu_supports("sse2"))
+		return isa_t::sse2;
+	return isa_t::scalar;
+}
+#else
+static isa_t detect_isa() noexcept
+{
+	return isa_t::scalar;
+}
+#endif
+
+struct dispatch_t
+{
+	isa_t isa;
+	kernel_proc kernels[5]; /* Indexed by channel count, [0] is unused. */
+};
+
+static dispatch_t build_dispatch() noexcept
+{
+	isa_t isa = detect_isa();
+
+	/* Allow capping the level, handy for benchmarking and debugging. */
+	if(const char *env = getenv("IMS2TIF_ISA"))
+	{
+		for(size_t i = 0; i < sizeof(isa_names) / sizeof(isa_names[0]); ++i)
+		{
+			if(!strcmp(env, isa_names[i]) && static_cast<isa_t>(i) < isa)
+				isa = static_cast<isa_t>(i);
+		}
+	}
+
+	dispatch_t d{isa, {nullptr, interleave_scalar<1>, interleave_scalar<2>, interleave_scalar<3>, interleave_scalar<4>}};
+
+#if defined(IMS_X86)
+	if(isa >= isa_t::sse2)
+	{
+		d.kernels[2] = interleave_sse2_2;
+		d.kernels[4] = interleave_sse2_4;
+	}
+
+	if(isa >= isa_t::ssse3)
+		d.kernels[3] = interleave_ssse3_3;
+
+	if(isa >= isa_t::avx2)
+	{
+		d.kernels[2] = interleave_avx2_2;
+		d.kernels[3] = interleave_avx2_3;
+		d.kernels[4] = interleave_avx2_4;
+	}
+
+	if(isa >= isa_t::avx512)
+	{
+		d.kernels[2] = interleave_avx512_2;
+		d.kernels[3] = interleave_avx512_3;
+		d.kernels[4] = interleave_avx512_4;
+	}
+#endif
+
+	return d;
+}
+
+static const dispatch_t& get_dispatch() noexcept
+{
+	static const dispatch_t d = build_dispatch();
+	return d;
+}
+
+const char *ims::interleave_isa() noexcept
+{
+	return isa_names[static_cast<size_t>(get_dispatch().isa)];
+}
+
+void ims::interleave(const uint16_t * const *planes, size_t nchan, size_t count, uint16_t *dst) noexcept
+{
+	const dispatch_t& d = get_dispatch();
+
+	if(nchan >= 1 && nchan <= 4)
+		d.kernels[nchan](planes, count, dst);
+	else
+		interleave_generic(planes, nchan, count, dst);
+}
+
+void ims::interleave_tiled(const uint16_t * const *planes, size_t nchan, size_t plane_size, size_t nplanes, uint16_t *dst, size_t nthreads)
+{
+	/*
+	 * Size tiles so one tile's sources and destination (2 * nchan * tile * 2 bytes)
+	 * sit comfortably in L2. Keep them a multiple of the widest vector.
+	 */
+	constexpr size_t tile_bytes = 128 * 1024;
+	size_t tile = std::max<size_t>(tile_bytes / (2 * nchan * sizeof(uint16_t)) & ~size_t(63), 64);
+	size_t ntiles = plane_size / tile + static_cast<size_t>(!!(plane_size % tile));
+
+	parallel_for(nplanes * ntiles, nthreads, [&](size_t n) {
+		size_t z = n / ntiles;
+		size_t start = (n % ntiles) * tile;
+		size_t count = std::min(tile, plane_size - start);
+		size_t off = z * plane_size + start;
+
+		std::vector<const uint16_t*> tp(nchan);
+		for(size_t c = 0; c < nchan; ++c)
+			tp[c] = planes[c] + off;
+
+		interleave(tp.data(), nchan, count, dst + off * nchan);
+	});
+}
@@ -0,0 +1,138 @@
+/*
+Dragonfly IMS to TiFF converter
+https://github.com/UQ-RCC/ims2tif
+
+SPDX-License-Identifier: Apache-2.0
+Copyright (c) 2019 The University of Queensland
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+/*
+ * Pyramidal OME-TIFF.
+ *
+ * Each page's reduced-resolution levels go in its SubIFDs, each half the size of the one
+ * above, as Bio-Formats (and so QuPath, napari, etc.) expect. They're made from the page
+ * while it's on its way to the file, so nothing's read twice, and add about a third to it.
+ * The first page's ImageDescription is OME-XML describing the whole file.
+ */
+
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include "ims2tif.hpp"
+
+using namespace ims;
+
+size_t ims::count_pyramid_levels(size_t w, size_t h, size_t size) noexcept
+{
+	size_t n = 0;
+	for(; std::max(w, h) > std::max<size_t>(size, 1); ++n)
+	{
+		w = (w + 1) / 2;
+		h = (h + 1) / 2;
+	}
+	return n;
+}
+
+void ims::downsample_2x(const uint16_t *src, size_t w, size_t h, size_t spp, uint16_t *dst, size_t nthreads)
+{
+	const size_t dw = (w + 1) / 2, dh = (h + 1) / 2;
+	const size_t rows_per_task = std::max<size_t>(dh / (nthreads * 4), 16);
+	const size_t ntasks = (dh + rows_per_task - 1) / rows_per_task;
+
+	parallel_for(ntasks, nthreads, [&](size_t t) {
+		for(size_t y = t * rows_per_task; y < std::min(dh, (t + 1) * rows_per_task); ++y)
+		{
+			/* On an odd edge the last row or column is used twice, which averages to the same thing. */
+			const uint16_t *r0 = src + 2 * y * w * spp;
+			const uint16_t *r1 = src + std::min(2 * y + 1, h - 1) * w * spp;
+			uint16_t *out = dst + y * dw * spp;
+
+			for(size_t x = 0; x < dw; ++x)
+			{
+				const size_t c0 = 2 * x * spp, c1 = std::min(2 * x + 1, w - 1) * spp;
+				for(size_t s = 0; s < spp; ++s)
+				{
+					uint32_t sum = uint32_t(r0[c0 + s]) + r0[c1 + s] + r1[c0 + s] + r1[c1 + s];
+					out[x * spp + s] = static_cast<uint16_t>((sum + 2) / 4);
+				}
+			}
+		}
+	});
+}
+
+static std::string xml_escape(const std::string& s)
+{
+	std::string out;
+	for(char c : s)
+	{
+		switch(c)
+		{
+			case '&':	out += "&amp;"; break;
+			case '<':	out += "&lt;"; break;
+			case '>':	out += "&gt;"; break;
+			case '"':	out += "&quot;"; break;
+			default:	out += c; break;
+		}
+	}
+	return out;
+}
+
+/* OME wants the unit's symbol. */
+static const char *ome_unit(const std::string& unit) noexcept
+{
+	if(unit == "micrometer")
+		return "\xc2\xb5m";
+	if(unit == "nanometer")
+		return "nm";
+	if(unit == "millimeter")
+		return "mm";
+	if(unit == "meter")
+		return "m";
+	return nullptr;
+}
+
+std::string ims::build_ome_xml(const ome_image_t& image)
+{
+	std::ostringstream ss;
+	ss << std::setprecision(9);
+
+	ss << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+		<< "<OME xmlns=\"http://www.openmicroscopy.org/Schemas/OME/2016-06\""
+		<< " xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\""
+		<< " xsi:schemaLocation=\"http://www.openmicroscopy.org/Schemas/OME/2016-06 http://www.openmicroscopy.org/Schemas/OME/2016-06/ome.xsd\""
+		<< " Creator=\"ims2tif\">\n"
+		<< "  <Image ID=\"Image:0\" Name=\"" << xml_escape(image.name) << "\">\n"
+		<< "    <Pixels ID=\"Pixels:0\" DimensionOrder=\"XYCZT\" Type=\"uint16\""
+		<< " SizeX=\"" << image.x << "\" SizeY=\"" << image.y << "\" SizeZ=\"" << image.z << "\""
+		<< " SizeC=\"" << image.c << "\" SizeT=\"1\" Interleaved=\"" << (image.planar ? "false" : "true") << "\"";
+
+	/* Without a unit, they're in voxels, which is OME's "pixel". */
+	const char *unit = ome_unit(image.unit);
+	const char *axes[] = {"X", "Y", "Z"};
+	for(int i = 0; i < 3; ++i)
+	{
+		ss << " PhysicalSize" << axes[i] << "=\"" << image.scale[i] << "\""
+			<< " PhysicalSize" << axes[i] << "Unit=\"" << (unit != nullptr ? unit : "pixel") << "\"";
+	}
+	ss << ">\n";
+
+	/* Every channel's in each page, like RGB. */
+	ss << "      <Channel ID=\"Channel:0:0\" SamplesPerPixel=\"" << image.c << "\"/>\n"
+		<< "      <TiffData IFD=\"0\" PlaneCount=\"" << image.z << "\"/>\n"
+		<< "    </Pixels>\n"
+		<< "  </Image>\n"
+		<< "</OME>\n";
+
+	return ss.str();
+}
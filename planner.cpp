@@ -0,0 +1,295 @@
+/*
+Dragonfly IMS to TiFF converter
+https://github.com/UQ-RCC/ims2tif
+
+SPDX-License-Identifier: Apache-2.0
+Copyright (c) 2019 The University of Queensland
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+/*
+ * Pick a conversion method, and how many TimePoints and buffers to run at once,
+ * that fits in a memory budget.
+ *
+ * Fastest first: bigload reads each channel in one go, slab and chunked stream
+ * Z slabs (chunked first if it can decompress in parallel), hyperslab only ever
+ * holds a single plane. Each is sized with the most TimePoints (and for chunked,
+ * buffers) that fit. Estimates are from the first TimePoint converted.
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include "ims2tif.hpp"
+
+#if defined(_WIN32)
+#	define WIN32_LEAN_AND_MEAN
+#	include <windows.h>
+#else
+#	include <unistd.h>
+#endif
+
+using namespace ims;
+
+/* HDF5's default per-dataset chunk cache. */
+constexpr uint64_t H5_CHUNK_CACHE_SIZE = 1024 * 1024;
+
+uint64_t ims::get_available_memory() noexcept
+{
+#if defined(_WIN32)
+	MEMORYSTATUSEX ms;
+	ms.dwLength = sizeof(ms);
+	if(GlobalMemoryStatusEx(&ms))
+		return ms.ullAvailPhys;
+	return 0;
+#else
+	/* MemAvailable counts reclaimable cache, _SC_AVPHYS_PAGES doesn't. */
+	if(FILE *f = fopen("/proc/meminfo", "r"))
+	{
+		char line[256];
+		unsigned long long kb = 0;
+		bool found = false;
+		while(!found && fgets(line, sizeof(line), f))
+			found = sscanf(line, "MemAvailable: %llu kB", &kb) == 1;
+		fclose(f);
+
+		if(found)
+			return static_cast<uint64_t>(kb) * 1024;
+	}
+
+#	if defined(_SC_AVPHYS_PAGES)
+	long pages = sysconf(_SC_AVPHYS_PAGES), pagesize = sysconf(_SC_PAGESIZE);
+	if(pages > 0 && pagesize > 0)
+		return static_cast<uint64_t>(pages) * static_cast<uint64_t>(pagesize);
+#	endif
+	return 0;
+#endif
+}
+
+const char *ims::method_name(conversion_method_t m) noexcept
+{
+	switch(m)
+	{
+		case conversion_method_t::bigload:		return "bigload";
+		case conversion_method_t::chunked:		return "chunked";
+		case conversion_method_t::hyperslab:	return "hyperslab";
+		case conversion_method_t::slab:			return "slab";
+		case conversion_method_t::mmap:			return "mmap";
+		case conversion_method_t::automatic:	return "auto";
+	}
+	return "?";
+}
+
+/* Stored (i.e. compressed) size of the region's channels, scaled down to the part of them it covers. */
+static uint64_t get_storage_size(hid_t timepoint, const region_t& region, size_t xs, size_t ys, size_t zs, size_t nchan)
+{
+	uint64_t size = 0;
+	for(size_t c = 0; c < nchan; ++c)
+	{
+		char cbuf[32];
+		sprintf(cbuf, "Channel %zu", region.channel(c));
+		h5g_ptr chan(H5Gopen2(timepoint, cbuf, H5P_DEFAULT));
+		if(!chan)
+			throw hdf5_exception();
+
+		h5d_ptr dataset(H5Dopen2(chan.get(), "Data", H5P_DEFAULT));
+		if(!dataset)
+			throw hdf5_exception();
+
+		h5s_ptr dspace(H5Dget_space(dataset.get()));
+		hsize_t dims[3];
+		if(!dspace || H5Sget_simple_extent_dims(dspace.get(), dims, nullptr) != 3)
+			throw hdf5_exception();
+
+		double covered = static_cast<double>(xs) * ys * zs / (static_cast<double>(dims[0]) * dims[1] * dims[2]);
+		size += static_cast<uint64_t>(H5Dget_storage_size(dataset.get()) * std::min(covered, 1.0));
+	}
+	return size;
+}
+
+plan_t ims::plan_conversion(hid_t timepoint, const region_t& region, size_t xs, size_t ys, size_t zs, size_t nchan, size_t nt, const args_t& args, uint64_t budget)
+{
+	hdf5_lock l(hdf5_mutex());
+
+	const uint64_t plane_size = static_cast<uint64_t>(xs) * ys * nchan * sizeof(uint16_t);
+	const uint64_t stack_size = plane_size * zs;
+	const uint64_t stored = get_storage_size(timepoint, region, xs, ys, zs, nchan);
+
+	hsize_t xcs = 0, ycs = 0, zcs = 0;
+	const bool chunked = get_chunk_size(timepoint, region, nchan, xcs, ycs, zcs) == 0;
+	const uint64_t chunk_bytes = static_cast<uint64_t>(xcs) * ycs * zcs * sizeof(uint16_t);
+
+	/* The Zarr writer holds a layer of chunks. */
+	uint64_t out_size = 0;
+	if(args.zarr)
+	{
+		size_t shape[3];
+		get_zarr_chunk_shape(timepoint, region, nchan, xs, ys, zs, args, shape);
+		out_size = shape[2] * plane_size;
+	}
+
+	l.unlock();
+
+	/* Can we decompress the chunks ourselves? */
+	const bool direct = chunked && chunk_reader::open(timepoint, region, xs, ys, zs, nchan, nullptr) != nullptr;
+	const size_t slab_depth = get_slab_depth(timepoint, region, xs, ys, zs, nchan);
+
+	plan_t plan{};
+	plan.budget = budget;
+	plan.direct = direct;
+	plan.bytes_written = stack_size * nt;
+
+	/* Fit as many TimePoints as we can, and see what's left for each. */
+	auto fit = [&](conversion_method_t method, uint64_t per_tp, size_t buffers) {
+		per_tp += out_size;
+		size_t inflight = std::min({args.inflight, args.threads, nt});
+		while(inflight > 1 && per_tp * inflight > budget)
+			--inflight;
+
+		if(per_tp * inflight > budget)
+			return false;
+
+		plan.method = method;
+		plan.inflight = inflight;
+		plan.buffers = buffers;
+		plan.peak_memory = per_tp * inflight;
+		return true;
+	};
+
+	/* Memory for one TimePoint with the chunked method and the given buffers. */
+	auto chunked_size = [&](size_t buffers, size_t inflight) -> uint64_t {
+		size_t threads = std::max<size_t>(args.threads / std::max<size_t>(inflight, 1), 1);
+		if(zcs == 0)
+			return 0;
+
+		uint64_t nlayers = zs / zcs + static_cast<uint64_t>(!!(zs % zcs));
+		uint64_t scratch = direct ? threads * chunk_reader::scratch_size(chunk_bytes, stored / nlayers) : 0;
+		return buffers * zcs * plane_size + scratch;
+	};
+
+	auto try_method = [&](conversion_method_t method) {
+		if(method == conversion_method_t::bigload)
+		{
+			plan.bytes_read = stored * nt;
+			return fit(method, (args.planar ? 1 : 2) * stack_size, args.buffers);
+		}
+
+		if(method == conversion_method_t::chunked)
+		{
+			if(!chunked)
+				return false;
+
+			plan.bytes_read = stored * nt;
+			for(size_t b = args.buffers; b >= 1; --b)
+			{
+				size_t inflight = std::min({args.inflight, args.threads, nt});
+				if(fit(method, chunked_size(b, inflight), b))
+					return true;
+			}
+			return false;
+		}
+
+		if(method == conversion_method_t::slab)
+		{
+			/* Planar buffers in the pipeline, plus the contiguous one. */
+			plan.bytes_read = stored * nt;
+			for(size_t b = args.buffers; b >= 1; --b)
+			{
+				if(fit(method, (b + !args.planar) * slab_depth * plane_size, b))
+					return true;
+			}
+			return false;
+		}
+
+		/* Reads straight into the output's page cache, interleaving stages a channel's layer. */
+		if(method == conversion_method_t::mmap)
+		{
+			plan.bytes_read = stored * nt;
+			return fit(method, args.planar ? 0 : slab_depth * plane_size / nchan, args.buffers);
+		}
+
+		/* Chunks that don't fit in HDF5's cache are read again for every plane. */
+		plan.bytes_read = stored * nt;
+		if(chunked && chunk_bytes > H5_CHUNK_CACHE_SIZE)
+			plan.bytes_read *= zcs;
+		return fit(method, plane_size, args.buffers);
+	};
+
+	if(args.method != conversion_method_t::automatic)
+	{
+		/* Honour the method, only scale it down. */
+		if(!try_method(args.method))
+		{
+			plan.method = args.method;
+			plan.bytes_read = stored * nt;
+			plan.inflight = 1;
+			plan.buffers = 1;
+			plan.peak_memory = args.method == conversion_method_t::bigload ? (args.planar ? 1 : 2) * stack_size :
+				args.method == conversion_method_t::chunked ? chunked_size(1, 1) :
+				args.method == conversion_method_t::slab ? (1 + !args.planar) * slab_depth * plane_size :
+				args.method == conversion_method_t::mmap ? (args.planar ? 0 : slab_depth * plane_size / nchan) : plane_size;
+			plan.peak_memory += out_size;
+		}
+		return plan;
+	}
+
+	/* Without parallel decompression, chunked is just a slower slab. */
+	conversion_method_t streaming[2] = {conversion_method_t::slab, conversion_method_t::chunked};
+	if(direct)
+		std::swap(streaming[0], streaming[1]);
+
+	for(conversion_method_t m : {conversion_method_t::bigload, streaming[0], streaming[1], conversion_method_t::hyperslab})
+	{
+		if(try_method(m))
+			return plan;
+	}
+
+	/* Nothing fits, go with the smallest and hope. */
+	plan.method = conversion_method_t::hyperslab;
+	plan.inflight = 1;
+	plan.buffers = 1;
+	plan.peak_memory = plane_size + out_size;
+	return plan;
+}
+
+const char *ims::format_size(uint64_t v, char (&buf)[32]) noexcept
+{
+	static const char *units[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+	double d = static_cast<double>(v);
+	size_t u = 0;
+	for(; d >= 1024.0 && u + 1 < sizeof(units) / sizeof(units[0]); ++u)
+		d /= 1024.0;
+
+	snprintf(buf, sizeof(buf), u == 0 ? "%.0f %s" : "%.2f %s", d, units[u]);
+	return buf;
+}
+
+void ims::print_plan(FILE *out, const plan_t& plan, size_t threads)
+{
+	fprintf(out, "plan: method %s%s, %zu TimePoint(s) in flight, %zu thread(s) each",
+		method_name(plan.method), plan.method == conversion_method_t::chunked && !plan.direct ? " (H5Dread)" : "",
+		plan.inflight, std::max<size_t>(threads / plan.inflight, 1)
+	);
+
+	if(plan.method == conversion_method_t::chunked || plan.method == conversion_method_t::slab)
+		fprintf(out, ", %zu buffer(s)", plan.buffers);
+
+	char b0[32], b1[32], b2[32], b3[32];
+	fprintf(out, "\nplan: peak memory %s of %s, reads %s, writes %s\n",
+		format_size(plan.peak_memory, b0), format_size(plan.budget, b1), format_size(plan.bytes_read, b2), format_size(plan.bytes_written, b3)
+	);
+
+	if(plan.peak_memory > plan.budget)
+		fprintf(out, "plan: warning: nothing fits in the memory budget\n");
+}
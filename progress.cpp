@@ -0,0 +1,177 @@
+/*
+Dragonfly IMS to TiFF converter
+https://github.com/UQ-RCC/ims2tif
+
+SPDX-License-Identifier: Apache-2.0
+Copyright (c) 2019 The University of Queensland
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include <cstdio>
+#include <algorithm>
+#include "ims2tif.hpp"
+
+#if defined(_WIN32)
+#	include <io.h>
+#	define isatty _isatty
+#	define fileno _fileno
+#else
+#	include <unistd.h>
+#endif
+
+using namespace ims;
+
+/* How far back the rolling rate looks. */
+constexpr double RATE_WINDOW = 10.0;
+
+/* Width of the bar, in characters. */
+constexpr size_t BAR_WIDTH = 30;
+
+ims::progress_meter::progress_meter(FILE *out, double interval, uint64_t pages, uint64_t bytes, size_t timepoints) :
+	_out(out),
+	_tty(isatty(fileno(out)) != 0),
+	_interval(interval > 0.0 ? interval : _tty ? 0.5 : 10.0),
+	_total_pages(pages),
+	_total_bytes(bytes),
+	_total_timepoints(timepoints),
+	_start(std::chrono::steady_clock::now())
+{
+	_thread = std::thread([this]() { run(); });
+}
+
+ims::progress_meter::~progress_meter()
+{
+	{
+		std::lock_guard<std::mutex> l(_mutex);
+		_stop = true;
+	}
+	_cv.notify_all();
+
+	if(_thread.joinable())
+		_thread.join();
+}
+
+void ims::progress_meter::finish()
+{
+	{
+		std::lock_guard<std::mutex> l(_mutex);
+		if(_stop)
+			return;
+		_stop = true;
+	}
+	_cv.notify_all();
+	_thread.join();
+
+	report(true);
+}
+
+void ims::progress_meter::run()
+{
+	std::unique_lock<std::mutex> l(_mutex);
+	while(!_cv.wait_for(l, std::chrono::duration<double>(_interval), [this]() { return _stop; }))
+	{
+		l.unlock();
+		report(false);
+		l.lock();
+	}
+}
+
+/* h:mm:ss */
+static const char *format_duration(double secs, char (&buf)[32]) noexcept
+{
+	unsigned long long s = static_cast<unsigned long long>(std::max(secs, 0.0) + 0.5);
+	snprintf(buf, sizeof(buf), "%llu:%02llu:%02llu", s / 3600, (s / 60) % 60, s % 60);
+	return buf;
+}
+
+void ims::progress_meter::report(bool last)
+{
+	const double now = std::chrono::duration<double>(std::chrono::steady_clock::now() - _start).count();
+	const uint64_t pages = _pages.load(std::memory_order_relaxed);
+	const uint64_t bytes = _bytes.load(std::memory_order_relaxed);
+	const size_t timepoints = _timepoints.load(std::memory_order_relaxed);
+
+	/* Rate over the last RATE_WINDOW seconds, or since the start if that's all there is. */
+	_samples.emplace_back(now, bytes);
+	auto first = std::find_if(_samples.begin(), _samples.end(), [now](const std::pair<double, uint64_t>& s) { return now - s.first <= RATE_WINDOW; });
+	if(first != _samples.begin())
+		--first;
+	_samples.erase(_samples.begin(), first);
+
+	double rate;
+	if(last || _samples.size() < 2)
+		rate = now > 0.0 ? bytes / now : 0.0;
+	else
+		rate = (bytes - _samples.front().second) / (now - _samples.front().first);
+
+	const double fraction = _total_bytes > 0 ? static_cast<double>(bytes) / _total_bytes : 1.0;
+	const double eta = rate > 0.0 ? (_total_bytes - std::min(bytes, _total_bytes)) / rate : -1.0;
+
+	char b0[32], b1[32], b2[32];
+	if(_tty)
+	{
+		char bar[BAR_WIDTH + 1];
+		size_t filled = std::min(static_cast<size_t>(fraction * BAR_WIDTH), BAR_WIDTH);
+		std::fill(bar, bar + filled, '=');
+		std::fill(bar + filled, bar + BAR_WIDTH, ' ');
+		bar[BAR_WIDTH] = '\0';
+
+		fprintf(_out, "\r[%s] %3.0f%% %zu/%zu TimePoints, %llu/%llu pages, %s of %s, %.1f MB/s, %s %s ",
+			bar, fraction * 100.0, timepoints, _total_timepoints,
+			static_cast<unsigned long long>(pages), static_cast<unsigned long long>(_total_pages),
+			format_size(bytes, b0), format_size(_total_bytes, b1),
+			rate / 1e6, last ? "took" : "ETA", last ? format_duration(now, b2) : eta < 0.0 ? "?" : format_duration(eta, b2)
+		);
+
+		if(last)
+			fputc('\n', _out);
+	}
+	else
+	{
+		fprintf(_out, "progress: elapsed=%.1f timepoints=%zu/%zu pages=%llu/%llu bytes=%llu/%llu mb_per_sec=%.1f eta=%.0f%s\n",
+			now, timepoints, _total_timepoints,
+			static_cast<unsigned long long>(pages), static_cast<unsigned long long>(_total_pages),
+			static_cast<unsigned long long>(bytes), static_cast<unsigned long long>(_total_bytes),
+			rate / 1e6, last ? 0.0 : eta, last ? " done" : ""
+		);
+	}
+	fflush(_out);
+}
+
+ims::progress_writer::progress_writer(page_writer& out, progress_meter& progress, size_t page_bytes) noexcept :
+	_out(out),
+	_progress(progress),
+	_page_bytes(page_bytes)
+{}
+
+void ims::progress_writer::write_page_contig(size_t page, uint16_t *data)
+{
+	_out.write_page_contig(page, data);
+	_progress.add_pages(1, _page_bytes);
+}
+
+void ims::progress_writer::write_page_planar(size_t page, const uint16_t* const *planes)
+{
+	_out.write_page_planar(page, planes);
+	_progress.add_pages(1, _page_bytes);
+}
+
+uint16_t *ims::progress_writer::map_pages()
+{
+	return _out.map_pages();
+}
+
+void ims::progress_writer::finish()
+{
+	_out.finish();
+}
@@ -0,0 +1,359 @@
+/*
+Dragonfly IMS to TiFF converter
+https://github.com/UQ-RCC/ims2tif
+
+SPDX-License-Identifier: Apache-2.0
+Copyright (c) 2019 The University of Queensland
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+/*
+ * Resumable runs.
+ *
+ * Each output is written under a temporary name and renamed once it's closed, so a file
+ * with its final name is always complete. A Zarr TimePoint is a directory of chunks, which is
+ * handled the same way. A line is then appended to the manifest in the
+ * output directory (ims2tif.done), recording what it was converted from and how. On the next
+ * run, outputs with a matching line and the right size are skipped.
+ *
+ * The manifest is plain text, one tab-separated line per output, later lines replacing
+ * earlier ones:
+ *
+ *   output  size  pages  source  timepoint  X  Y  Z  C  crc32  settings
+ */
+
+#include <cstring>
+#include <cerrno>
+#include <vector>
+#include <algorithm>
+#include <array>
+#include <stdexcept>
+#include <system_error>
+#include "ims2tif.hpp"
+
+#if defined(IMS2TIF_HAVE_ZLIB)
+#	include <zlib.h>
+#endif
+
+namespace fs = std::filesystem;
+
+using namespace ims;
+
+static const char *MANIFEST_NAME = "ims2tif.done";
+static const char *MANIFEST_HEADER = "# ims2tif done v1\n";
+
+#if !defined(IMS2TIF_HAVE_ZLIB)
+/* Plain table-driven CRC-32 (IEEE), the same as zlib's. */
+static uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t size) noexcept
+{
+	static const auto table = []() {
+		std::array<uint32_t, 256> t;
+		for(uint32_t i = 0; i < 256; ++i)
+		{
+			uint32_t c = i;
+			for(int k = 0; k < 8; ++k)
+				c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+			t[i] = c;
+		}
+		return t;
+	}();
+
+	crc = ~crc;
+	for(size_t i = 0; i < size; ++i)
+		crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+#endif
+
+static uint32_t crc32_add(uint32_t crc, const uint8_t *data, size_t size) noexcept
+{
+#if defined(IMS2TIF_HAVE_ZLIB)
+	return static_cast<uint32_t>(::crc32(crc, data, static_cast<uInt>(size)));
+#else
+	return crc32_update(crc, data, size);
+#endif
+}
+
+static uint32_t crc32_add_file(uint32_t crc, const fs::path& path)
+{
+	FILE *f = fopen(path.u8string().c_str(), "rb");
+	if(f == nullptr)
+	{
+		fprintf(stderr, "Unable to open %s: %s\n", path.u8string().c_str(), strerror(errno));
+		throw tiff_exception();
+	}
+
+	std::vector<uint8_t> buf(1 << 20);
+	for(size_t n; (n = fread(buf.data(), 1, buf.size(), f)) > 0; )
+		crc = crc32_add(crc, buf.data(), n);
+
+	bool failed = ferror(f) != 0;
+	fclose(f);
+	if(failed)
+	{
+		fprintf(stderr, "Error reading %s.\n", path.u8string().c_str());
+		throw tiff_exception();
+	}
+
+	return crc;
+}
+
+/* The regular files under a directory, in name order. */
+static std::vector<fs::path> list_files(const fs::path& dir, std::error_code& ec)
+{
+	std::vector<fs::path> files;
+	for(fs::recursive_directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec))
+	{
+		if(it->is_regular_file(ec))
+			files.push_back(it->path());
+	}
+
+	std::sort(files.begin(), files.end());
+	return files;
+}
+
+uint32_t ims::crc32_file(const fs::path& path)
+{
+	std::error_code ec;
+	if(!fs::is_directory(path, ec))
+		return crc32_add_file(0, path);
+
+	/* Names as well, so a chunk in the wrong place doesn't match. */
+	std::vector<fs::path> files = list_files(path, ec);
+	if(ec)
+	{
+		fprintf(stderr, "Error reading %s: %s\n", path.u8string().c_str(), ec.message().c_str());
+		throw tiff_exception();
+	}
+
+	uint32_t crc = 0;
+	for(const fs::path& f : files)
+	{
+		std::string name = f.lexically_relative(path).generic_u8string();
+		crc = crc32_add(crc, reinterpret_cast<const uint8_t*>(name.c_str()), name.size() + 1);
+		crc = crc32_add_file(crc, f);
+	}
+	return crc;
+}
+
+uint64_t ims::output_size(const fs::path& path, std::error_code& ec)
+{
+	if(!fs::is_directory(path, ec))
+		return ec ? 0 : fs::file_size(path, ec);
+
+	uint64_t size = 0;
+	for(const fs::path& f : list_files(path, ec))
+	{
+		if(ec)
+			break;
+		size += fs::file_size(f, ec);
+	}
+	return ec ? 0 : size;
+}
+
+fs::path ims::partial_path(const fs::path& path)
+{
+	fs::path p = path;
+	p += ".partial";
+	return p;
+}
+
+/* Fields can't have tabs or newlines in them, or the line won't parse. */
+static bool valid_field(const std::string& s) noexcept
+{
+	return s.find_first_of("\t\r\n") == std::string::npos;
+}
+
+static bool parse_entry(const std::string& line, manifest_entry_t& e)
+{
+	std::vector<std::string> fields;
+	for(size_t p = 0;;)
+	{
+		size_t q = line.find('\t', p);
+		fields.push_back(line.substr(p, q == std::string::npos ? std::string::npos : q - p));
+		if(q == std::string::npos)
+			break;
+		p = q + 1;
+	}
+
+	if(fields.size() != 11)
+		return false;
+
+	char *end;
+	auto num = [&end](const std::string& s, int base = 10) {
+		errno = 0;
+		unsigned long long v = strtoull(s.c_str(), &end, base);
+		if(errno != 0 || end == s.c_str() || *end != '\0')
+			throw std::invalid_argument(s);
+		return v;
+	};
+
+	try
+	{
+		e.output = fields[0];
+		e.size = num(fields[1]);
+		e.pages = num(fields[2]);
+		e.source = fields[3];
+		e.timepoint = num(fields[4]);
+		e.x = num(fields[5]);
+		e.y = num(fields[6]);
+		e.z = num(fields[7]);
+		e.c = num(fields[8]);
+		e.crc32 = static_cast<uint32_t>(num(fields[9], 16));
+		e.settings = fields[10];
+	}
+	catch(std::invalid_argument&)
+	{
+		return false;
+	}
+
+	return true;
+}
+
+static void write_entry(FILE *f, const manifest_entry_t& e)
+{
+	fprintf(f, "%s\t%llu\t%zu\t%s\t%zu\t%zu\t%zu\t%zu\t%zu\t%08x\t%s\n",
+		e.output.c_str(), static_cast<unsigned long long>(e.size), e.pages, e.source.c_str(),
+		e.timepoint, e.x, e.y, e.z, e.c, e.crc32, e.settings.c_str()
+	);
+}
+
+std::unique_ptr<output_manifest> ims::output_manifest::open(const fs::path& outdir)
+{
+	std::unique_ptr<output_manifest> m(new output_manifest());
+	fs::path path = outdir / MANIFEST_NAME;
+
+	bool exists = false;
+	size_t nlines = 0;
+	if(FILE *f = fopen(path.u8string().c_str(), "r"))
+	{
+		exists = true;
+
+		std::string line;
+		for(int ch; (ch = fgetc(f)) != EOF; )
+		{
+			if(ch != '\n')
+			{
+				line.push_back(static_cast<char>(ch));
+				continue;
+			}
+
+			/* A line cut short by a crash doesn't parse, and is ignored. */
+			manifest_entry_t e;
+			if(!line.empty() && line[0] != '#')
+			{
+				++nlines;
+				if(parse_entry(line, e))
+					m->_entries[e.output] = std::move(e);
+			}
+			line.clear();
+		}
+
+		fclose(f);
+	}
+
+	/* Reruns replace lines, so drop the replaced ones. Written aside and renamed, as it's all we have. */
+	if(nlines > m->_entries.size())
+	{
+		fs::path partial = partial_path(path);
+		if(FILE *f = fopen(partial.u8string().c_str(), "w"))
+		{
+			fputs(MANIFEST_HEADER, f);
+			for(const auto& it : m->_entries)
+				write_entry(f, it.second);
+
+			bool failed = ferror(f) != 0;
+			failed = fclose(f) != 0 || failed;
+
+			std::error_code ec;
+			if(!failed)
+				fs::rename(partial, path, ec);
+			else
+				fs::remove(partial, ec);
+		}
+	}
+
+	m->_file = fopen(path.u8string().c_str(), "a");
+	if(m->_file == nullptr)
+	{
+		fprintf(stderr, "Unable to open %s: %s\n", path.u8string().c_str(), strerror(errno));
+		return nullptr;
+	}
+
+	if(!exists)
+	{
+		fputs(MANIFEST_HEADER, m->_file);
+		fflush(m->_file);
+	}
+
+	return m;
+}
+
+ims::output_manifest::~output_manifest()
+{
+	if(_file != nullptr)
+		fclose(_file);
+}
+
+const manifest_entry_t *ims::output_manifest::find(const std::string& output) const noexcept
+{
+	auto it = _entries.find(output);
+	return it == _entries.end() ? nullptr : &it->second;
+}
+
+void ims::output_manifest::append(const manifest_entry_t& e)
+{
+	/* Anything that can't be written back out safely just isn't resumable. */
+	if(!valid_field(e.output) || !valid_field(e.source) || !valid_field(e.settings))
+		return;
+
+	std::lock_guard<std::mutex> l(_mutex);
+	write_entry(_file, e);
+
+	/* So a crash loses at most the outputs in flight. */
+	if(fflush(_file) != 0)
+	{
+		fprintf(stderr, "Error writing manifest: %s\n", strerror(errno));
+		throw tiff_exception();
+	}
+}
+
+bool ims::output_complete(const manifest_entry_t& expected, const manifest_entry_t *entry, const fs::path& path, bool verify)
+{
+	if(entry == nullptr)
+		return false;
+
+	if(entry->pages != expected.pages || entry->source != expected.source || entry->timepoint != expected.timepoint ||
+		entry->x != expected.x || entry->y != expected.y || entry->z != expected.z || entry->c != expected.c ||
+		entry->settings != expected.settings)
+		return false;
+
+	std::error_code ec;
+	uint64_t size = output_size(path, ec);
+	if(ec || size != entry->size)
+		return false;
+
+	if(verify)
+	{
+		try
+		{
+			return crc32_file(path) == entry->crc32;
+		}
+		catch(std::exception&)
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
@@ -0,0 +1,179 @@
+/*
+Dragonfly IMS to TiFF converter
+https://github.com/UQ-RCC/ims2tif
+
+SPDX-License-Identifier: Apache-2.0
+Copyright (c) 2019 The University of Queensland
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+/*
+ * Read-only mapping of the source file, for data HDF5 would only copy.
+ *
+ * Uncompressed data is stored as-is, so once we know where it is (H5Dget_offset()
+ * for contiguous datasets, the chunk index for chunked ones) it can be read straight
+ * from the page cache without going through H5Dread().
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include "ims2tif.hpp"
+
+#if !defined(_WIN32)
+#	include <fcntl.h>
+#	include <unistd.h>
+#	include <sys/mman.h>
+#	include <sys/stat.h>
+#endif
+
+using namespace ims;
+
+bool ims::dataset_is_native_u16(hid_t dataset) noexcept
+{
+	hid_t type = H5Dget_type(dataset);
+	if(type < 0)
+		return false;
+
+	bool ok = H5Tequal(type, H5T_NATIVE_UINT16) > 0;
+	H5Tclose(type);
+	return ok;
+}
+
+std::string ims::get_raw_file_name(hid_t obj)
+{
+	hdf5_lock l(hdf5_mutex());
+
+	/* Addresses are relative to the end of the user block. Imaris files don't have one, so don't bother. */
+	h5f_ptr file(H5Iget_file_id(obj));
+	if(!file)
+		return std::string();
+
+	h5p_ptr fcpl(H5Fget_create_plist(file.get()));
+	hsize_t userblock = 0;
+	if(!fcpl || H5Pget_userblock(fcpl.get(), &userblock) < 0 || userblock != 0)
+		return std::string();
+
+	ssize_t len = H5Fget_name(obj, nullptr, 0);
+	if(len <= 0)
+		return std::string();
+
+	std::string name(static_cast<size_t>(len), '\0');
+	if(H5Fget_name(obj, &name[0], name.size() + 1) < 0)
+		return std::string();
+
+	return name;
+}
+
+std::shared_ptr<source_map> ims::source_map::open(hid_t obj)
+{
+#if !defined(_WIN32)
+	std::string name = get_raw_file_name(obj);
+	if(name.empty())
+		return nullptr;
+
+	int fd = ::open(name.c_str(), O_RDONLY);
+	if(fd < 0)
+		return nullptr;
+
+	struct stat st;
+	if(fstat(fd, &st) < 0 || st.st_size <= 0)
+	{
+		close(fd);
+		return nullptr;
+	}
+
+	void *p = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(p == MAP_FAILED)
+		return nullptr;
+
+	std::shared_ptr<source_map> map(new source_map());
+	map->_data = reinterpret_cast<const uint8_t*>(p);
+	map->_size = static_cast<uint64_t>(st.st_size);
+	return map;
+#else
+	(void)obj;
+	return nullptr;
+#endif
+}
+
+ims::source_map::~source_map()
+{
+#if !defined(_WIN32)
+	if(_data != nullptr)
+		munmap(const_cast<uint8_t*>(_data), static_cast<size_t>(_size));
+#endif
+}
+
+void ims::source_map::advise_sequential(uint64_t offset, uint64_t size) const noexcept
+{
+#if !defined(_WIN32)
+	/* madvise() wants a page-aligned start. */
+	uint64_t pagesize = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+	uint64_t start = offset & ~(pagesize - 1);
+	uint64_t end = std::min(offset + size, _size);
+	if(start < end)
+		madvise(const_cast<uint8_t*>(_data) + start, static_cast<size_t>(end - start), MADV_SEQUENTIAL);
+#else
+	(void)offset; (void)size;
+#endif
+}
+
+const uint16_t *ims::source_map::map_channel(hid_t timepoint, const region_t& region, size_t c, size_t xs, size_t ys, size_t zs) const
+{
+	/* Planes have to be back to back, so only whole ones will do. */
+	if(region.x0 != 0 || region.y0 != 0)
+		return nullptr;
+
+	hdf5_lock l(hdf5_mutex());
+
+	char cbuf[32];
+	sprintf(cbuf, "Channel %zu", region.channel(c));
+	h5g_ptr chan(H5Gopen2(timepoint, cbuf, H5P_DEFAULT));
+	if(!chan)
+		return nullptr;
+
+	h5d_ptr dataset(H5Dopen2(chan.get(), "Data", H5P_DEFAULT));
+	if(!dataset)
+		return nullptr;
+
+	h5p_ptr cparms(H5Dget_create_plist(dataset.get()));
+	if(!cparms || H5Pget_layout(cparms.get()) != H5D_CONTIGUOUS || H5Pget_nfilters(cparms.get()) != 0)
+		return nullptr;
+
+	if(!dataset_is_native_u16(dataset.get()))
+		return nullptr;
+
+	/* Likewise, only Z can be padded. */
+	h5s_ptr dspace(H5Dget_space(dataset.get()));
+	hsize_t dims[3];
+	if(!dspace || H5Sget_simple_extent_dims(dspace.get(), dims, nullptr) != 3)
+		return nullptr;
+
+	if(dims[0] < region.z0 + zs || dims[1] != ys || dims[2] != xs)
+		return nullptr;
+
+	/* HADDR_UNDEF if it's never been written. */
+	haddr_t offset = H5Dget_offset(dataset.get());
+	if(offset == HADDR_UNDEF)
+		return nullptr;
+
+	offset += static_cast<uint64_t>(region.z0) * ys * xs * sizeof(uint16_t);
+	uint64_t size = static_cast<uint64_t>(zs) * ys * xs * sizeof(uint16_t);
+	if(offset > _size || _size - offset < size || offset % alignof(uint16_t) != 0)
+		return nullptr;
+
+	return reinterpret_cast<const uint16_t*>(_data + offset);
+}
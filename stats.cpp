@@ -0,0 +1,151 @@
+/*
+Dragonfly IMS to TiFF converter
+https://github.com/UQ-RCC/ims2tif
+
+SPDX-License-Identifier: Apache-2.0
+Copyright (c) 2019 The University of Queensland
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+/*
+ * Per-stage instrumentation for --stats.
+ *
+ * Each stage is a handful of relaxed atomic adds per call, and calls are coarse (a channel,
+ * a slab, a chunk or a page), so it's cheap enough to leave on. With no stats, a stage_timer
+ * doesn't even read the clock.
+ */
+
+#include <chrono>
+#include "ims2tif.hpp"
+
+using namespace ims;
+
+static uint64_t now_ns() noexcept
+{
+	return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()
+	).count());
+}
+
+const char *ims::stage_name(stage_t stage) noexcept
+{
+	switch(stage)
+	{
+		case stage_t::read:			return "read";
+		case stage_t::decompress:	return "decompress";
+		case stage_t::interleave:	return "interleave";
+		case stage_t::write:		return "write";
+	}
+	return "?";
+}
+
+void ims::stage_stats::add(stage_t stage, uint64_t ns, uint64_t bytes) noexcept
+{
+	size_t s = static_cast<size_t>(stage);
+	_ns[s].fetch_add(ns, std::memory_order_relaxed);
+	_bytes[s].fetch_add(bytes, std::memory_order_relaxed);
+	_calls[s].fetch_add(1, std::memory_order_relaxed);
+}
+
+stage_stats::totals_t ims::stage_stats::get(stage_t stage) const noexcept
+{
+	size_t s = static_cast<size_t>(stage);
+	return {
+		_ns[s].load(std::memory_order_relaxed) / 1e9,
+		_bytes[s].load(std::memory_order_relaxed),
+		_calls[s].load(std::memory_order_relaxed),
+	};
+}
+
+void ims::stage_stats::merge(const stage_stats& other) noexcept
+{
+	for(size_t s = 0; s < num_stages; ++s)
+	{
+		_ns[s].fetch_add(other._ns[s].load(std::memory_order_relaxed), std::memory_order_relaxed);
+		_bytes[s].fetch_add(other._bytes[s].load(std::memory_order_relaxed), std::memory_order_relaxed);
+		_calls[s].fetch_add(other._calls[s].load(std::memory_order_relaxed), std::memory_order_relaxed);
+	}
+}
+
+ims::stage_timer::stage_timer(stage_stats *stats, stage_t stage, uint64_t bytes) noexcept :
+	_stats(stats),
+	_stage(stage),
+	_bytes(bytes),
+	_start(stats != nullptr ? now_ns() : 0)
+{}
+
+ims::stage_timer::~stage_timer()
+{
+	if(_stats != nullptr)
+		_stats->add(_stage, now_ns() - _start, _bytes);
+}
+
+ims::timed_writer::timed_writer(page_writer& out, stage_stats& stats, size_t page_bytes) noexcept :
+	_out(out),
+	_stats(stats),
+	_page_bytes(page_bytes)
+{}
+
+void ims::timed_writer::write_page_contig(size_t page, uint16_t *data)
+{
+	stage_timer t(&_stats, stage_t::write, _page_bytes);
+	_out.write_page_contig(page, data);
+}
+
+void ims::timed_writer::write_page_planar(size_t page, const uint16_t* const *planes)
+{
+	stage_timer t(&_stats, stage_t::write, _page_bytes);
+	_out.write_page_planar(page, planes);
+}
+
+uint16_t *ims::timed_writer::map_pages()
+{
+	return _out.map_pages();
+}
+
+void ims::timed_writer::finish()
+{
+	/* libtiff does most of its writing as the file's closed. */
+	stage_timer t(&_stats, stage_t::write, 0);
+	_out.finish();
+}
+
+void ims::write_json_string(FILE *out, const std::string& s)
+{
+	fputc('"', out);
+	for(unsigned char c : s)
+	{
+		if(c == '"' || c == '\\')
+			fprintf(out, "\\%c", c);
+		else if(c < 0x20)
+			fprintf(out, "\\u%04x", c);
+		else
+			fputc(c, out);
+	}
+	fputc('"', out);
+}
+
+void ims::write_stats_json(FILE *out, const stage_stats& stats)
+{
+	fprintf(out, "{");
+	for(size_t s = 0; s < num_stages; ++s)
+	{
+		stage_stats::totals_t t = stats.get(static_cast<stage_t>(s));
+		fprintf(out, "%s\"%s\": {\"seconds\": %.6f, \"bytes\": %llu, \"calls\": %llu, \"mb_per_sec\": %.1f}",
+			s == 0 ? "" : ", ", stage_name(static_cast<stage_t>(s)), t.seconds,
+			static_cast<unsigned long long>(t.bytes), static_cast<unsigned long long>(t.calls),
+			t.seconds > 0.0 ? t.bytes / t.seconds / 1e6 : 0.0
+		);
+	}
+	fprintf(out, "}");
+}
@@ -0,0 +1,271 @@
+/*
+Dragonfly IMS to TiFF converter
+https://github.com/UQ-RCC/ims2tif
+
+SPDX-License-Identifier: Apache-2.0
+Copyright (c) 2019 The University of Queensland
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include <atomic>
+#include <thread>
+#include <deque>
+#include <chrono>
+#include <condition_variable>
+#include <algorithm>
+#include "ims2tif.hpp"
+
+std::recursive_mutex& ims::hdf5_mutex() noexcept
+{
+	static std::recursive_mutex m;
+	return m;
+}
+
+void ims::parallel_for(size_t n, size_t nthreads, const std::function<void(size_t)>& proc)
+{
+	nthreads = std::min(nthreads, n);
+	if(nthreads <= 1)
+	{
+		for(size_t i = 0; i < n; ++i)
+			proc(i);
+		return;
+	}
+
+	std::atomic<size_t> next(0);
+	std::atomic<bool> failed(false);
+	std::exception_ptr ex;
+	std::mutex exlock;
+
+	auto worker = [&]() {
+		for(size_t i; !failed && (i = next++) < n; )
+		{
+			try
+			{
+				proc(i);
+			}
+			catch(...)
+			{
+				std::lock_guard<std::mutex> l(exlock);
+				if(!ex)
+					ex = std::current_exception();
+				failed = true;
+			}
+		}
+	};
+
+	std::vector<std::thread> workers;
+	workers.reserve(nthreads - 1);
+	for(size_t i = 1; i < nthreads; ++i)
+		workers.emplace_back(worker);
+
+	worker();
+
+	for(std::thread& t : workers)
+		t.join();
+
+	if(ex)
+		std::rethrow_exception(ex);
+}
+
+void ims::run_scheduled(const std::vector<uint64_t>& costs, size_t nworkers, size_t nthreads, uint64_t budget, const std::function<void(size_t, size_t)>& proc)
+{
+	const size_t n = costs.size();
+	nworkers = std::max<size_t>(std::min(nworkers, n), 1);
+
+	std::mutex m;
+	std::condition_variable cv;
+	std::vector<bool> started(n, false);
+	size_t nstarted = 0, running = 0;
+	uint64_t inuse = 0;
+	bool failed = false;
+	std::exception_ptr ex;
+
+	auto worker = [&]() {
+		std::unique_lock<std::mutex> l(m);
+		for(;;)
+		{
+			/* The first task that fits. Something always runs, however big. */
+			size_t i = n;
+			cv.wait(l, [&]() {
+				if(failed || nstarted == n)
+					return true;
+
+				for(i = 0; i < n; ++i)
+				{
+					if(!started[i] && (running == 0 || inuse + costs[i] <= budget))
+						return true;
+				}
+				return false;
+			});
+
+			if(failed || nstarted == n)
+				return;
+
+			started[i] = true;
+			++nstarted;
+			++running;
+			inuse += costs[i];
+
+			/* Once there are fewer tasks than workers, the idle workers' threads go to the rest. */
+			size_t share = std::max<size_t>(nthreads / std::min(nworkers, running + (n - nstarted)), 1);
+
+			l.unlock();
+			try
+			{
+				proc(i, share);
+			}
+			catch(...)
+			{
+				l.lock();
+				if(!ex)
+					ex = std::current_exception();
+				failed = true;
+				l.unlock();
+			}
+			l.lock();
+
+			--running;
+			inuse -= costs[i];
+			cv.notify_all();
+		}
+	};
+
+	std::vector<std::thread> workers;
+	workers.reserve(nworkers - 1);
+	for(size_t i = 1; i < nworkers; ++i)
+		workers.emplace_back(worker);
+
+	worker();
+
+	for(std::thread& t : workers)
+		t.join();
+
+	if(ex)
+		std::rethrow_exception(ex);
+}
+
+void ims::run_pipeline(size_t n, size_t nbuffers, size_t depth, const pipeline_proc& produce, const pipeline_proc& consume, pipeline_stats_t& stats)
+{
+	using clock = std::chrono::steady_clock;
+
+	stats = pipeline_stats_t{};
+	nbuffers = std::max<size_t>(nbuffers, 1);
+	depth = std::max<size_t>(depth, 1);
+
+	/* Nothing to overlap, do it in series. */
+	if(nbuffers == 1 || n <= 1)
+	{
+		for(size_t i = 0; i < n; ++i)
+		{
+			produce(i, 0);
+			consume(i, 0);
+		}
+		return;
+	}
+
+	std::mutex m;
+	std::condition_variable cv;
+	std::deque<size_t> free_bufs;
+	std::deque<std::pair<size_t, size_t>> queue; /* {item, buffer} */
+	bool failed = false;
+	std::exception_ptr ex;
+
+	for(size_t b = 0; b < nbuffers; ++b)
+		free_bufs.push_back(b);
+
+	auto fail = [&]() {
+		std::lock_guard<std::mutex> l(m);
+		if(!ex)
+			ex = std::current_exception();
+		failed = true;
+		cv.notify_all();
+	};
+
+	/* Wait for pred, counting it as a stall if we had to. */
+	auto wait = [&](std::unique_lock<std::mutex>& l, size_t& stalls, double& stall_time, auto pred) {
+		if(pred())
+			return;
+
+		auto start = clock::now();
+		cv.wait(l, pred);
+		++stalls;
+		stall_time += std::chrono::duration<double>(clock::now() - start).count();
+	};
+
+	std::thread writer([&]() {
+		try
+		{
+			for(size_t i = 0; i < n; ++i)
+			{
+				std::pair<size_t, size_t> item;
+				{
+					std::unique_lock<std::mutex> l(m);
+					wait(l, stats.write_stalls, stats.write_stall_time, [&]() { return failed || !queue.empty(); });
+					if(failed)
+						return;
+
+					item = queue.front();
+					queue.pop_front();
+					cv.notify_all();
+				}
+
+				consume(item.first, item.second);
+
+				std::lock_guard<std::mutex> l(m);
+				free_bufs.push_back(item.second);
+				cv.notify_all();
+			}
+		}
+		catch(...)
+		{
+			fail();
+		}
+	});
+
+	try
+	{
+		for(size_t i = 0; i < n; ++i)
+		{
+			size_t b;
+			{
+				std::unique_lock<std::mutex> l(m);
+				wait(l, stats.read_stalls, stats.read_stall_time, [&]() { return failed || !free_bufs.empty(); });
+				if(failed)
+					break;
+
+				b = free_bufs.front();
+				free_bufs.pop_front();
+			}
+
+			produce(i, b);
+
+			std::unique_lock<std::mutex> l(m);
+			wait(l, stats.read_stalls, stats.read_stall_time, [&]() { return failed || queue.size() < depth; });
+			if(failed)
+				break;
+
+			queue.emplace_back(i, b);
+			cv.notify_all();
+		}
+	}
+	catch(...)
+	{
+		fail();
+	}
+
+	writer.join();
+
+	if(ex)
+		std::rethrow_exception(ex);
+}
@@ -0,0 +1,526 @@
+/*
+Dragonfly IMS to TiFF converter
+https://github.com/UQ-RCC/ims2tif
+
+SPDX-License-Identifier: Apache-2.0
+Copyright (c) 2019 The University of Queensland
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <chrono>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <system_error>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include "../parg/parg.h"
+#include "synth.hpp"
+
+#define ARGDEF_OUTDIR	'o'
+#define ARGDEF_METHODS	'm'
+#define ARGDEF_THREADS	'j'
+#define ARGDEF_HELP		'h'
+
+/* Long-only options. */
+#define ARGDEF_SHAPES	256
+#define ARGDEF_CHUNKS	257
+#define ARGDEF_GZIP		258
+#define ARGDEF_REPEAT	259
+#define ARGDEF_FORMAT	260
+#define ARGDEF_PLANAR	261
+#define ARGDEF_COLD		262
+#define ARGDEF_KEEP		263
+
+static struct parg_option argdefs[] = {
+	{"outdir",	PARG_REQARG,	nullptr,	ARGDEF_OUTDIR},
+	{"methods",	PARG_REQARG,	nullptr,	ARGDEF_METHODS},
+	{"threads",	PARG_REQARG,	nullptr,	ARGDEF_THREADS},
+	{"shapes",	PARG_REQARG,	nullptr,	ARGDEF_SHAPES},
+	{"chunks",	PARG_REQARG,	nullptr,	ARGDEF_CHUNKS},
+	{"gzip",	PARG_REQARG,	nullptr,	ARGDEF_GZIP},
+	{"repeat",	PARG_REQARG,	nullptr,	ARGDEF_REPEAT},
+	{"format",	PARG_REQARG,	nullptr,	ARGDEF_FORMAT},
+	{"planar",	PARG_NOARG,		nullptr,	ARGDEF_PLANAR},
+	{"cold",	PARG_NOARG,		nullptr,	ARGDEF_COLD},
+	{"keep",	PARG_NOARG,		nullptr,	ARGDEF_KEEP},
+	{"help",	PARG_NOARG,		nullptr,	ARGDEF_HELP},
+	{nullptr,	0,				nullptr,	0}
+};
+
+static const char *USAGE_OPTIONS =
+"  -h, --help\n"
+"                          Display this message.\n"
+"  -o, --outdir\n"
+"                          Where to write the generated IMS files and the TIFFs.\n"
+"                          If unspecified, use the current directory.\n"
+"      --shapes\n"
+"                          The image shapes, as a comma-separated list of \"XxYxZxC\".\n"
+"                          If unspecified, use \"512x512x64x2,1024x1024x128x2\".\n"
+"      --chunks\n"
+"                          The chunk sizes, as a comma-separated list of \"XxYxZ\" or \"none\".\n"
+"                          If unspecified, use \"256x256x16,none\".\n"
+"      --gzip\n"
+"                          The gzip levels, as a comma-separated list. If unspecified, use \"0\".\n"
+"  -m, --methods\n"
+"                          The conversion methods, as a comma-separated list.\n"
+"                          If unspecified, use \"bigload,slab,chunked,hyperslab,mmap\".\n"
+"  -j, --threads\n"
+"                          The threads given to each conversion. If unspecified, use 1.\n"
+"      --repeat\n"
+"                          The number of runs of each conversion. If unspecified, use 3.\n"
+"      --planar\n"
+"                          Write planar TIFFs.\n"
+"      --cold\n"
+"                          Drop the IMS file from the page cache before each run.\n"
+"      --keep\n"
+"                          Keep the generated IMS files.\n"
+"      --format\n"
+"                          The report format on stdout. If unspecified, use \"csv\".\n"
+"                          Available formats are \"csv\" and \"json\".\n"
+"";
+
+namespace fs = std::filesystem;
+
+using namespace ims;
+
+struct bench_method_t
+{
+	const char *name;
+	convert_proc proc;
+	bool needs_chunks; /* Skipped on contiguous data. */
+};
+
+static const bench_method_t all_methods[] = {
+	{"bigload",		converter_bigload,		false},
+	{"slab",		converter_slab,			false},
+	{"chunked",		converter_chunk,		true},
+	{"hyperslab",	converter_hyperslab,	false},
+	{"mmap",		converter_mmap,			false},
+};
+
+struct bench_case_t
+{
+	synth_opts_t synth;
+	std::string shape;
+	std::string chunk;
+};
+
+struct bench_result_t
+{
+	std::string shape;
+	std::string chunk;
+	int gzip;
+	const char *method;
+	size_t threads;
+	size_t run;
+	double seconds; /* Of the conversion, not counting process startup. */
+	double mb_per_sec;
+	double peak_rss_mb; /* Of the whole process. */
+	bool ok;
+};
+
+static int parse_size(const char *s, size_t& val) noexcept
+{
+	char *end;
+	errno = 0;
+	unsigned long long v = strtoull(s, &end, 10);
+	if(errno != 0 || end == s || *end != '\0' || s[0] == '-')
+		return -1;
+
+	val = static_cast<size_t>(v);
+	return 0;
+}
+
+static std::vector<std::string> split_list(const char *s)
+{
+	std::vector<std::string> items;
+	for(const char *p = s;; ++p)
+	{
+		const char *e = strchr(p, ',');
+		items.emplace_back(p, e == nullptr ? strlen(p) : static_cast<size_t>(e - p));
+		if(e == nullptr)
+			break;
+		p = e;
+	}
+	return items;
+}
+
+/*
+ * Run proc in a child process, so each run starts from a clean heap and gets its own
+ * peak RSS from wait4(). The child sends back its result, which is 0 on failure.
+ */
+template <typename F>
+static bool run_child(F&& proc, double& result, double& peak_rss_mb)
+{
+	int fds[2];
+	if(pipe(fds) < 0)
+		return false;
+
+	fflush(stdout);
+	fflush(stderr);
+
+	pid_t pid = fork();
+	if(pid < 0)
+	{
+		close(fds[0]);
+		close(fds[1]);
+		return false;
+	}
+
+	if(pid == 0)
+	{
+		close(fds[0]);
+		double r = 0.0;
+		try
+		{
+			r = proc();
+		}
+		catch(std::exception&)
+		{
+			r = 0.0;
+		}
+
+		ssize_t n = write(fds[1], &r, sizeof(r));
+		_exit(n == sizeof(r) && r > 0.0 ? 0 : 1);
+	}
+
+	close(fds[1]);
+	ssize_t n;
+	do
+		n = read(fds[0], &result, sizeof(result));
+	while(n < 0 && errno == EINTR);
+	close(fds[0]);
+
+	int status;
+	struct rusage ru;
+	while(wait4(pid, &status, 0, &ru) < 0)
+	{
+		if(errno != EINTR)
+			return false;
+	}
+
+#if defined(__APPLE__)
+	peak_rss_mb = ru.ru_maxrss / 1e6; /* Bytes. */
+#else
+	peak_rss_mb = ru.ru_maxrss / 1e3; /* KiB, near enough. */
+#endif
+
+	return n == sizeof(result) && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/* Evict a file's pages, so the next run reads it from disk. Not every system honours this. */
+static void drop_cache(const fs::path& path) noexcept
+{
+#if defined(POSIX_FADV_DONTNEED)
+	int fd = open(path.c_str(), O_RDONLY);
+	if(fd < 0)
+		return;
+
+	fdatasync(fd);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	close(fd);
+#else
+	(void)path;
+#endif
+}
+
+/* Convert TimePoint 0 of ResolutionLevel 0 with the native writer, returning the time taken. */
+static double convert_once(const fs::path& ims, const fs::path& tif, const synth_opts_t& synth, convert_proc proc, size_t threads, bool planar)
+{
+	auto start = std::chrono::steady_clock::now();
+	{
+		h5f_ptr file(H5Fopen(ims.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT));
+		if(!file)
+			throw hdf5_exception();
+
+		h5g_ptr tp(H5Gopen2(file.get(), "DataSet/ResolutionLevel 0/TimePoint 0", H5P_DEFAULT));
+		if(!tp)
+			throw hdf5_exception();
+
+		convert_opts_t opts;
+		opts.threads = threads;
+		opts.buffers = 2;
+		opts.queue_depth = 1;
+		opts.planar = planar;
+		opts.verbose = false;
+		opts.stats = nullptr;
+		opts.progress = nullptr;
+
+		bigtiff_writer out(tif, synth.x, synth.y, synth.c, synth.z, 0, planar);
+		proc(out, tp.get(), synth.x, synth.y, synth.z, synth.c, opts);
+	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	return std::max(elapsed.count(), 1e-9);
+}
+
+static void print_csv_header(FILE *f)
+{
+	fprintf(f, "shape,chunk,gzip,method,threads,run,seconds,mb_per_sec,peak_rss_mb,status\n");
+}
+
+static void print_csv(FILE *f, const bench_result_t& r)
+{
+	fprintf(f, "%s,%s,%d,%s,%zu,%zu,%.6f,%.1f,%.1f,%s\n",
+		r.shape.c_str(), r.chunk.c_str(), r.gzip, r.method, r.threads, r.run,
+		r.seconds, r.mb_per_sec, r.peak_rss_mb, r.ok ? "ok" : "error"
+	);
+	fflush(f);
+}
+
+static void print_json(FILE *f, const std::vector<bench_result_t>& results)
+{
+	fprintf(f, "[\n");
+	for(size_t i = 0; i < results.size(); ++i)
+	{
+		const bench_result_t& r = results[i];
+		fprintf(f, "  {\"shape\": \"%s\", \"chunk\": \"%s\", \"gzip\": %d, \"method\": \"%s\", \"threads\": %zu, \"run\": %zu, "
+			"\"seconds\": %.6f, \"mb_per_sec\": %.1f, \"peak_rss_mb\": %.1f, \"ok\": %s}%s\n",
+			r.shape.c_str(), r.chunk.c_str(), r.gzip, r.method, r.threads, r.run,
+			r.seconds, r.mb_per_sec, r.peak_rss_mb, r.ok ? "true" : "false",
+			i + 1 < results.size() ? "," : ""
+		);
+	}
+	fprintf(f, "]\n");
+}
+
+int main(int argc, char **argv)
+{
+	parg_state ps;
+	parg_init(&ps);
+
+	auto usage = [&argv](int val, FILE *s){
+		fprintf(s, "Usage: %s [OPTIONS]\nOptions:\n%s", argv[0], USAGE_OPTIONS);
+		return val;
+	};
+
+	fs::path outdir = ".";
+	std::vector<std::string> shapes = {"512x512x64x2", "1024x1024x128x2"};
+	std::vector<std::string> chunks = {"256x256x16", "none"};
+	std::vector<std::string> gzips = {"0"};
+	std::vector<std::string> methods;
+	size_t threads = 1;
+	size_t repeat = 3;
+	bool json = false;
+	bool planar = false;
+	bool cold = false;
+	bool keep = false;
+
+	for(int c; (c = parg_getopt_long(&ps, argc, argv, "ho:m:j:", argdefs, nullptr)) != -1; )
+	{
+		switch(c)
+		{
+			case ARGDEF_HELP:
+				return usage(2, stdout);
+
+			case ARGDEF_OUTDIR:
+				outdir = ps.optarg;
+				break;
+
+			case ARGDEF_SHAPES:
+				shapes = split_list(ps.optarg);
+				break;
+
+			case ARGDEF_CHUNKS:
+				chunks = split_list(ps.optarg);
+				break;
+
+			case ARGDEF_GZIP:
+				gzips = split_list(ps.optarg);
+				break;
+
+			case ARGDEF_METHODS:
+				methods = split_list(ps.optarg);
+				break;
+
+			case ARGDEF_THREADS:
+				if(parse_size(ps.optarg, threads) < 0 || threads == 0)
+					return usage(2, stdout);
+				break;
+
+			case ARGDEF_REPEAT:
+				if(parse_size(ps.optarg, repeat) < 0 || repeat == 0)
+					return usage(2, stdout);
+				break;
+
+			case ARGDEF_FORMAT:
+				if(!strcmp(ps.optarg, "csv"))
+					json = false;
+				else if(!strcmp(ps.optarg, "json"))
+					json = true;
+				else
+					return usage(2, stdout);
+				break;
+
+			case ARGDEF_PLANAR:
+				planar = true;
+				break;
+
+			case ARGDEF_COLD:
+				cold = true;
+				break;
+
+			case ARGDEF_KEEP:
+				keep = true;
+				break;
+
+			case '?':
+			case ':':
+			case 1:
+			default:
+				return usage(2, stdout);
+		}
+	}
+
+	std::vector<bench_method_t> selected;
+	if(methods.empty())
+	{
+		selected.assign(std::begin(all_methods), std::end(all_methods));
+	}
+	else
+	{
+		for(const std::string& m : methods)
+		{
+			auto it = std::find_if(std::begin(all_methods), std::end(all_methods), [&m](const bench_method_t& bm) { return m == bm.name; });
+			if(it == std::end(all_methods))
+				return usage(2, stdout);
+			selected.push_back(*it);
+		}
+	}
+
+	/* Every combination of shape, chunk and gzip level. */
+	std::vector<bench_case_t> cases;
+	for(const std::string& shape : shapes)
+	{
+		for(const std::string& chunk : chunks)
+		{
+			for(const std::string& gz : gzips)
+			{
+				bench_case_t bc;
+				bc.shape = shape;
+				bc.chunk = chunk;
+
+				unsigned long long x, y, z, c;
+				int n;
+				if(sscanf(shape.c_str(), "%llux%llux%llux%llu%n", &x, &y, &z, &c, &n) != 4 || shape[n] != '\0' || x == 0 || y == 0 || z == 0 || c == 0)
+					return usage(2, stdout);
+
+				bc.synth.x = x;
+				bc.synth.y = y;
+				bc.synth.z = z;
+				bc.synth.c = c;
+				bc.synth.pattern = synth_pattern_t::noise;
+
+				if(chunk == "none")
+				{
+					bc.synth.chunk_x = bc.synth.chunk_y = bc.synth.chunk_z = 0;
+				}
+				else
+				{
+					if(sscanf(chunk.c_str(), "%llux%llux%llu%n", &x, &y, &z, &n) != 3 || chunk[n] != '\0' || x == 0 || y == 0 || z == 0)
+						return usage(2, stdout);
+
+					bc.synth.chunk_x = x;
+					bc.synth.chunk_y = y;
+					bc.synth.chunk_z = z;
+				}
+
+				size_t level;
+				if(parse_size(gz.c_str(), level) < 0 || level > 9)
+					return usage(2, stdout);
+				bc.synth.gzip = static_cast<int>(level);
+
+				/* Contiguous datasets can't be compressed. */
+				if(bc.synth.chunk_x == 0 && bc.synth.gzip != 0)
+					continue;
+
+				cases.push_back(std::move(bc));
+			}
+		}
+	}
+
+	std::error_code ec;
+	fs::create_directories(outdir, ec);
+	if(ec)
+	{
+		fprintf(stderr, "Error creating output directory: %s\n", ec.message().c_str());
+		return 1;
+	}
+
+	if(!json)
+		print_csv_header(stdout);
+
+	std::vector<bench_result_t> results;
+	for(const bench_case_t& bc : cases)
+	{
+		fs::path ims = outdir / ("bench_" + bc.shape + "_" + bc.chunk + "_gz" + std::to_string(bc.synth.gzip) + ".ims");
+		fs::path tif = outdir / "bench.tif";
+
+		/* Generated in a child too, so none of its memory is inherited by the runs. */
+		double dummy, rss;
+		if(!run_child([&]() { write_synthetic_ims(ims, bc.synth); return 1.0; }, dummy, rss))
+		{
+			fprintf(stderr, "Error writing %s.\n", ims.u8string().c_str());
+			return 1;
+		}
+
+		const double mb = static_cast<double>(bc.synth.x) * bc.synth.y * bc.synth.z * bc.synth.c * sizeof(uint16_t) / 1e6;
+		for(const bench_method_t& m : selected)
+		{
+			if(m.needs_chunks && bc.synth.chunk_x == 0)
+				continue;
+
+			for(size_t run = 0; run < repeat; ++run)
+			{
+				if(cold)
+					drop_cache(ims);
+
+				bench_result_t r;
+				r.shape = bc.shape;
+				r.chunk = bc.chunk;
+				r.gzip = bc.synth.gzip;
+				r.method = m.name;
+				r.threads = threads;
+				r.run = run;
+				r.seconds = 0.0;
+				r.peak_rss_mb = 0.0;
+				r.ok = run_child([&]() { return convert_once(ims, tif, bc.synth, m.proc, threads, planar); }, r.seconds, r.peak_rss_mb);
+				r.mb_per_sec = r.ok ? mb / r.seconds : 0.0;
+
+				fs::remove(tif, ec);
+
+				if(!json)
+					print_csv(stdout, r);
+				results.push_back(std::move(r));
+
+				/* A method that can't handle this layout won't on the next run either. */
+				if(!results.back().ok)
+					break;
+			}
+		}
+
+		if(!keep)
+			fs::remove(ims, ec);
+	}
+
+	if(json)
+		print_json(stdout, results);
+
+	return 0;
+}
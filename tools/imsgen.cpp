@@ -0,0 +1,225 @@
+/*
+Dragonfly IMS to TiFF converter
+https://github.com/UQ-RCC/ims2tif
+
+SPDX-License-Identifier: Apache-2.0
+Copyright (c) 2019 The University of Queensland
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include "../parg/parg.h"
+#include "synth.hpp"
+
+#define ARGDEF_SIZE		's'
+#define ARGDEF_CHANNELS	'c'
+#define ARGDEF_TIMEPOINTS	't'
+#define ARGDEF_HELP		'h'
+
+/* Long-only options. */
+#define ARGDEF_CHUNK	256
+#define ARGDEF_PAD		257
+#define ARGDEF_GZIP		258
+#define ARGDEF_SHUFFLE	259
+#define ARGDEF_LEVELS	260
+#define ARGDEF_PATTERN	261
+
+static struct parg_option argdefs[] = {
+	{"size",		PARG_REQARG,	nullptr,	ARGDEF_SIZE},
+	{"channels",	PARG_REQARG,	nullptr,	ARGDEF_CHANNELS},
+	{"timepoints",	PARG_REQARG,	nullptr,	ARGDEF_TIMEPOINTS},
+	{"chunk",		PARG_REQARG,	nullptr,	ARGDEF_CHUNK},
+	{"pad",			PARG_REQARG,	nullptr,	ARGDEF_PAD},
+	{"gzip",		PARG_REQARG,	nullptr,	ARGDEF_GZIP},
+	{"shuffle",		PARG_NOARG,		nullptr,	ARGDEF_SHUFFLE},
+	{"levels",		PARG_REQARG,	nullptr,	ARGDEF_LEVELS},
+	{"pattern",		PARG_REQARG,	nullptr,	ARGDEF_PATTERN},
+	{"help",		PARG_NOARG,		nullptr,	ARGDEF_HELP},
+	{nullptr,		0,				nullptr,	0}
+};
+
+static const char *USAGE_OPTIONS =
+"  -h, --help\n"
+"                          Display this message.\n"
+"  -s, --size\n"
+"                          The image size, as \"XxYxZ\". If unspecified, use \"1024x1024x128\".\n"
+"  -c, --channels\n"
+"                          The number of channels. If unspecified, use 2.\n"
+"  -t, --timepoints\n"
+"                          The number of TimePoints. If unspecified, use 1.\n"
+"      --chunk\n"
+"                          The chunk size, as \"XxYxZ\", or \"none\" for contiguous datasets.\n"
+"                          If unspecified, use \"256x256x16\".\n"
+"      --pad\n"
+"                          How to pad the datasets past the image size. If unspecified, use \"chunk\".\n"
+"                          Available paddings are \"none\", \"chunk\" (to a multiple of the chunk size,\n"
+"                          like Imaris), and \"pot\" (to a power of two).\n"
+"      --gzip\n"
+"                          The gzip level of the chunks, 0-9. If unspecified, use 0 (uncompressed).\n"
+"      --shuffle\n"
+"                          Add HDF5's byte shuffle filter.\n"
+"      --levels\n"
+"                          The number of resolution levels. If unspecified, use 1.\n"
+"      --pattern\n"
+"                          What to fill the image with. If unspecified, use \"ramp\".\n"
+"                          Available patterns are \"ramp\" (a function of the coordinates)\n"
+"                          and \"noise\" (speckle that compresses like real data).\n"
+"";
+
+using namespace ims;
+
+static int parse_size(const char *s, size_t& val) noexcept
+{
+	char *end;
+	errno = 0;
+	unsigned long long v = strtoull(s, &end, 10);
+	if(errno != 0 || end == s || *end != '\0' || s[0] == '-')
+		return -1;
+
+	val = static_cast<size_t>(v);
+	return 0;
+}
+
+static int parse_xyz(const char *s, size_t& x, size_t& y, size_t& z) noexcept
+{
+	unsigned long long vx, vy, vz;
+	int n;
+	if(sscanf(s, "%llux%llux%llu%n", &vx, &vy, &vz, &n) != 3 || s[n] != '\0')
+		return -1;
+
+	if(vx == 0 || vy == 0 || vz == 0)
+		return -1;
+
+	x = static_cast<size_t>(vx);
+	y = static_cast<size_t>(vy);
+	z = static_cast<size_t>(vz);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	parg_state ps;
+	parg_init(&ps);
+
+	auto usage = [&argv](int val, FILE *s){
+		fprintf(s, "Usage: %s [OPTIONS] <out.ims>\nOptions:\n%s", argv[0], USAGE_OPTIONS);
+		return val;
+	};
+
+	synth_opts_t opts;
+	const char *path = nullptr;
+	size_t gzip;
+
+	for(int c; (c = parg_getopt_long(&ps, argc, argv, "hs:c:t:", argdefs, nullptr)) != -1; )
+	{
+		switch(c)
+		{
+			case ARGDEF_HELP:
+				return usage(2, stdout);
+
+			case ARGDEF_SIZE:
+				if(parse_xyz(ps.optarg, opts.x, opts.y, opts.z) < 0)
+					return usage(2, stdout);
+				break;
+
+			case ARGDEF_CHANNELS:
+				if(parse_size(ps.optarg, opts.c) < 0 || opts.c == 0)
+					return usage(2, stdout);
+				break;
+
+			case ARGDEF_TIMEPOINTS:
+				if(parse_size(ps.optarg, opts.t) < 0 || opts.t == 0)
+					return usage(2, stdout);
+				break;
+
+			case ARGDEF_CHUNK:
+				if(!strcmp(ps.optarg, "none"))
+					opts.chunk_x = opts.chunk_y = opts.chunk_z = 0;
+				else if(parse_xyz(ps.optarg, opts.chunk_x, opts.chunk_y, opts.chunk_z) < 0)
+					return usage(2, stdout);
+				break;
+
+			case ARGDEF_PAD:
+				if(!strcmp(ps.optarg, "none"))
+					opts.pad = synth_pad_t::none;
+				else if(!strcmp(ps.optarg, "chunk"))
+					opts.pad = synth_pad_t::chunk;
+				else if(!strcmp(ps.optarg, "pot"))
+					opts.pad = synth_pad_t::pot;
+				else
+					return usage(2, stdout);
+				break;
+
+			case ARGDEF_GZIP:
+				if(parse_size(ps.optarg, gzip) < 0 || gzip > 9)
+					return usage(2, stdout);
+				opts.gzip = static_cast<int>(gzip);
+				break;
+
+			case ARGDEF_SHUFFLE:
+				opts.shuffle = true;
+				break;
+
+			case ARGDEF_LEVELS:
+				if(parse_size(ps.optarg, opts.levels) < 0 || opts.levels == 0)
+					return usage(2, stdout);
+				break;
+
+			case ARGDEF_PATTERN:
+				if(!strcmp(ps.optarg, "ramp"))
+					opts.pattern = synth_pattern_t::ramp;
+				else if(!strcmp(ps.optarg, "noise"))
+					opts.pattern = synth_pattern_t::noise;
+				else
+					return usage(2, stdout);
+				break;
+
+			case 1:
+				if(path != nullptr)
+					return usage(2, stdout);
+				path = ps.optarg;
+				break;
+
+			case '?':
+			case ':':
+			default:
+				return usage(2, stdout);
+		}
+	}
+
+	if(path == nullptr)
+		return usage(2, stdout);
+
+	/* Filters need chunks. */
+	if(opts.chunk_x == 0 && (opts.gzip != 0 || opts.shuffle))
+	{
+		fprintf(stderr, "Contiguous datasets can't be compressed.\n");
+		return 1;
+	}
+
+	try
+	{
+		write_synthetic_ims(path, opts);
+	}
+	catch(std::exception&)
+	{
+		/* HDF5 has already printed the error. */
+		fprintf(stderr, "Error writing %s.\n", path);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,211 @@
+/*
+Dragonfly IMS to TiFF converter
+https://github.com/UQ-RCC/ims2tif
+
+SPDX-License-Identifier: Apache-2.0
+Copyright (c) 2019 The University of Queensland
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "synth.hpp"
+
+using namespace ims;
+
+static void write_string_attribute(hid_t id, const char *name, const std::string& value)
+{
+	/* Imaris stores everything as an array of single characters. */
+	hsize_t size = value.size();
+	h5s_ptr space(H5Screate_simple(1, &size, nullptr));
+	if(!space)
+		throw hdf5_exception();
+
+	h5a_ptr att(H5Acreate2(id, name, H5T_C_S1, space.get(), H5P_DEFAULT, H5P_DEFAULT));
+	if(!att)
+		throw hdf5_exception();
+
+	if(H5Awrite(att.get(), H5T_C_S1, value.data()) < 0)
+		throw hdf5_exception();
+}
+
+static h5g_ptr create_group(hid_t parent, const std::string& name)
+{
+	h5g_ptr g(H5Gcreate2(parent, name.c_str(), H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT));
+	if(!g)
+		throw hdf5_exception();
+	return g;
+}
+
+static size_t pad_size(size_t size, size_t chunk, synth_pad_t pad) noexcept
+{
+	switch(pad)
+	{
+		case synth_pad_t::none:
+			break;
+
+		case synth_pad_t::chunk:
+			if(chunk != 0)
+				return (size + chunk - 1) / chunk * chunk;
+			break;
+
+		case synth_pad_t::pot:
+		{
+			size_t p = 1;
+			while(p < size)
+				p <<= 1;
+			return p;
+		}
+	}
+	return size;
+}
+
+static uint16_t synth_noise(size_t t, size_t c, size_t z, size_t y, size_t x) noexcept
+{
+	/* splitmix64 of the coordinates. */
+	uint64_t r = (((t * 64 + c) * 65536 + z) * 65536 + y) * 65536 + x;
+	r += 0x9e3779b97f4a7c15ull;
+	r = (r ^ (r >> 30)) * 0xbf58476d1ce4e5b9ull;
+	r = (r ^ (r >> 27)) * 0x94d049bb133111ebull;
+	r ^= r >> 31;
+
+	uint16_t v = static_cast<uint16_t>(100 + (r & 15));
+	if(((r >> 8) & 255) == 0)
+		v += static_cast<uint16_t>(1000 + ((r >> 16) & 4095));
+	return v;
+}
+
+static void write_channel(hid_t channel, const synth_opts_t& opts, size_t level, size_t t, size_t c)
+{
+	const size_t xs = std::max<size_t>(opts.x >> level, 1);
+	const size_t ys = std::max<size_t>(opts.y >> level, 1);
+	const size_t zs = opts.z;
+	const bool chunked = opts.chunk_x != 0 && opts.chunk_y != 0 && opts.chunk_z != 0;
+
+	write_string_attribute(channel, "ImageSizeX", std::to_string(xs));
+	write_string_attribute(channel, "ImageSizeY", std::to_string(ys));
+	write_string_attribute(channel, "ImageSizeZ", std::to_string(zs));
+
+	hsize_t dims[3] = {
+		pad_size(zs, opts.chunk_z, opts.pad),
+		pad_size(ys, opts.chunk_y, opts.pad),
+		pad_size(xs, opts.chunk_x, opts.pad),
+	};
+
+	h5s_ptr space(H5Screate_simple(3, dims, nullptr));
+	if(!space)
+		throw hdf5_exception();
+
+	h5p_ptr dcpl(H5Pcreate(H5P_DATASET_CREATE));
+	if(!dcpl)
+		throw hdf5_exception();
+
+	if(chunked)
+	{
+		hsize_t chunk[3] = {
+			std::min<hsize_t>(opts.chunk_z, dims[0]),
+			std::min<hsize_t>(opts.chunk_y, dims[1]),
+			std::min<hsize_t>(opts.chunk_x, dims[2]),
+		};
+
+		if(H5Pset_chunk(dcpl.get(), 3, chunk) < 0)
+			throw hdf5_exception();
+
+		if(opts.shuffle && H5Pset_shuffle(dcpl.get()) < 0)
+			throw hdf5_exception();
+
+		if(opts.gzip > 0 && H5Pset_deflate(dcpl.get(), static_cast<unsigned>(opts.gzip)) < 0)
+			throw hdf5_exception();
+	}
+
+	h5d_ptr data(H5Dcreate2(channel, "Data", H5T_STD_U16LE, space.get(), H5P_DEFAULT, dcpl.get(), H5P_DEFAULT));
+	if(!data)
+		throw hdf5_exception();
+
+	/* A layer of chunks at a time, so every chunk is written whole, once. */
+	const size_t depth = chunked ? std::min<size_t>(opts.chunk_z, dims[0]) : 1;
+	const size_t plane = dims[1] * dims[2];
+	std::vector<uint16_t> buf(depth * plane);
+
+	for(hsize_t z0 = 0; z0 < dims[0]; z0 += depth)
+	{
+		const size_t nz = std::min<size_t>(depth, dims[0] - z0);
+		for(size_t z = 0; z < nz; ++z)
+		{
+			for(size_t y = 0; y < dims[1]; ++y)
+			{
+				uint16_t *row = buf.data() + z * plane + y * dims[2];
+				for(size_t x = 0; x < dims[2]; ++x)
+				{
+					if(z0 + z >= zs || y >= ys || x >= xs)
+						row[x] = 0xdead;
+					else if(opts.pattern == synth_pattern_t::ramp)
+						row[x] = synth_ramp(t, c, z0 + z, y << level, x << level);
+					else
+						row[x] = synth_noise(t, c, z0 + z, y << level, x << level);
+				}
+			}
+		}
+
+		hsize_t start[3] = {z0, 0, 0};
+		hsize_t count[3] = {nz, dims[1], dims[2]};
+		if(H5Sselect_hyperslab(space.get(), H5S_SELECT_SET, start, nullptr, count, nullptr) < 0)
+			throw hdf5_exception();
+
+		h5s_ptr memspace(H5Screate_simple(3, count, nullptr));
+		if(!memspace)
+			throw hdf5_exception();
+
+		if(H5Dwrite(data.get(), H5T_NATIVE_UINT16, memspace.get(), space.get(), H5P_DEFAULT, buf.data()) < 0)
+			throw hdf5_exception();
+	}
+}
+
+void ims::write_synthetic_ims(const std::filesystem::path& path, const synth_opts_t& opts)
+{
+	h5f_ptr file(H5Fcreate(path.string().c_str(), H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT));
+	if(!file)
+		throw hdf5_exception();
+
+	{
+		h5g_ptr dsi = create_group(file.get(), "DataSetInfo");
+
+		h5g_ptr image = create_group(dsi.get(), "Image");
+		write_string_attribute(image.get(), "X", std::to_string(opts.x));
+		write_string_attribute(image.get(), "Y", std::to_string(opts.y));
+		write_string_attribute(image.get(), "Z", std::to_string(opts.z));
+
+		for(size_t c = 0; c < opts.c; ++c)
+			create_group(dsi.get(), "Channel " + std::to_string(c));
+
+		h5g_ptr ti = create_group(dsi.get(), "TimeInfo");
+		write_string_attribute(ti.get(), "FileTimePoints", std::to_string(opts.t));
+	}
+
+	h5g_ptr ds = create_group(file.get(), "DataSet");
+	for(size_t l = 0; l < opts.levels; ++l)
+	{
+		h5g_ptr rlevel = create_group(ds.get(), "ResolutionLevel " + std::to_string(l));
+		for(size_t t = 0; t < opts.t; ++t)
+		{
+			h5g_ptr tp = create_group(rlevel.get(), "TimePoint " + std::to_string(t));
+			for(size_t c = 0; c < opts.c; ++c)
+			{
+				h5g_ptr channel = create_group(tp.get(), "Channel " + std::to_string(c));
+				write_channel(channel.get(), opts, l, t, c);
+			}
+		}
+	}
+}
@@ -0,0 +1,75 @@
+/*
+Dragonfly IMS to TiFF converter
+https://github.com/UQ-RCC/ims2tif
+
+SPDX-License-Identifier: Apache-2.0
+Copyright (c) 2019 The University of Queensland
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#ifndef _IMS2TIF_SYNTH_HPP
+#define _IMS2TIF_SYNTH_HPP
+
+#include <cstdint>
+#include <filesystem>
+#include "../ims2tif.hpp"
+
+namespace ims {
+
+/* How the datasets are padded past the image size. Imaris pads to a multiple of the chunk size. */
+enum class synth_pad_t { none, chunk, pot };
+
+/* What to fill the image with. */
+enum class synth_pattern_t
+{
+	ramp, /* synth_ramp(), so outputs can be checked. */
+	noise /* Dim speckle on a dark background, which compresses about as well as real data. */
+};
+
+struct synth_opts_t
+{
+	size_t x = 1024;
+	size_t y = 1024;
+	size_t z = 128;
+	size_t c = 2;
+	size_t t = 1;
+	size_t chunk_x = 256; /* All 0 for contiguous datasets. */
+	size_t chunk_y = 256;
+	size_t chunk_z = 16;
+	synth_pad_t pad = synth_pad_t::chunk;
+	int gzip = 0; /* 0 for none. */
+	bool shuffle = false;
+	size_t levels = 1;
+	synth_pattern_t pattern = synth_pattern_t::ramp;
+};
+
+/* The ramp pattern's value, in ResolutionLevel 0 coordinates. */
+inline uint16_t synth_ramp(size_t t, size_t c, size_t z, size_t y, size_t x) noexcept
+{
+	return static_cast<uint16_t>(t * 7 + c * 1000 + z * 31 + y * 3 + x);
+}
+
+/*
+ * Write an IMS file with everything read_image_info() and the converters look at:
+ * DataSetInfo/Image X/Y/Z, a DataSetInfo/Channel group per channel, DataSetInfo/TimeInfo
+ * FileTimePoints, and DataSet/ResolutionLevel L/TimePoint T/Channel C/Data. Each level
+ * is half the size of the one above in X and Y, with its size in the channels' ImageSizeX/Y/Z.
+ * Padding is filled with 0xdead, which should never appear in an output.
+ *
+ * Throws hdf5_exception.
+ */
+void write_synthetic_ims(const std::filesystem::path& path, const synth_opts_t& opts);
+
+}
+
+#endif /* _IMS2TIF_SYNTH_HPP */
@@ -0,0 +1,286 @@
+/*
+Dragonfly IMS to TiFF converter
+https://github.com/UQ-RCC/ims2tif
+
+SPDX-License-Identifier: Apache-2.0
+Copyright (c) 2019 The University of Queensland
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+/*
+ * OME-Zarr output.
+ *
+ * Each input becomes a Zarr (v2) store holding one TCZYX uint16 array, "0", described as a
+ * single-scale OME-Zarr 0.4 image. Chunks are 1 x 1 x Z x Y x X, so every TimePoint and
+ * channel has its own, and with "/" as the dimension separator each TimePoint's chunks are
+ * all under "0/<t>". That directory is the TimePoint's output, as far as the rest of the
+ * converter's concerned.
+ *
+ * Pages are buffered a layer of chunks deep, then the layer's chunks are encoded and
+ * written in parallel. The TimePoint is never held in full.
+ */
+
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <system_error>
+#include "ims2tif.hpp"
+
+namespace fs = std::filesystem;
+
+using namespace ims;
+
+/* If the source's chunks don't help, something of about the same size. */
+static const size_t DEFAULT_CHUNK[3] = {256, 256, 16};
+
+static const char *zarr_dtype() noexcept
+{
+	const uint16_t one = 1;
+	return *reinterpret_cast<const uint8_t*>(&one) == 1 ? "<u2" : ">u2";
+}
+
+static void write_file(const fs::path& path, const void *data, size_t size)
+{
+	FILE *f = fopen(path.u8string().c_str(), "wb");
+	if(f == nullptr)
+	{
+		fprintf(stderr, "Unable to open %s: %s\n", path.u8string().c_str(), strerror(errno));
+		throw tiff_exception();
+	}
+
+	bool failed = fwrite(data, 1, size, f) != size;
+	failed = fclose(f) != 0 || failed;
+	if(failed)
+	{
+		fprintf(stderr, "Error writing %s.\n", path.u8string().c_str());
+		throw tiff_exception();
+	}
+}
+
+static void make_directories(const fs::path& path)
+{
+	std::error_code ec;
+	fs::create_directories(path, ec);
+	if(ec)
+	{
+		fprintf(stderr, "Error creating %s: %s\n", path.u8string().c_str(), ec.message().c_str());
+		throw tiff_exception();
+	}
+}
+
+void ims::get_zarr_chunk_shape(hid_t tp, const region_t& region, size_t nchan, size_t xs, size_t ys, size_t zs, const args_t& args, size_t shape[3])
+{
+	hsize_t xcs, ycs, zcs;
+	if(args.zarr_chunks[0] != 0)
+		std::copy(args.zarr_chunks, args.zarr_chunks + 3, shape);
+	else if(get_chunk_size(tp, region, nchan, xcs, ycs, zcs) == 0)
+		shape[0] = static_cast<size_t>(xcs), shape[1] = static_cast<size_t>(ycs), shape[2] = static_cast<size_t>(zcs);
+	else
+		std::copy(DEFAULT_CHUNK, DEFAULT_CHUNK + 3, shape);
+
+	/* No point padding a small image out to a big chunk. */
+	shape[0] = std::min(shape[0], xs);
+	shape[1] = std::min(shape[1], ys);
+	shape[2] = std::min(shape[2], zs);
+}
+
+fs::path ims::zarr_timepoint_path(const fs::path& store, size_t timepoint)
+{
+	return store / "0" / std::to_string(timepoint);
+}
+
+void ims::write_zarr_metadata(const fs::path& store, const zarr_image_t& image, const zarr_opts_t& opts)
+{
+	make_directories(store / "0");
+
+	auto write_json = [](const fs::path& path, const std::function<void(FILE*)>& proc) {
+		FILE *f = fopen(path.u8string().c_str(), "w");
+		if(f == nullptr)
+		{
+			fprintf(stderr, "Unable to open %s: %s\n", path.u8string().c_str(), strerror(errno));
+			throw tiff_exception();
+		}
+
+		proc(f);
+
+		bool failed = ferror(f) != 0;
+		failed = fclose(f) != 0 || failed;
+		if(failed)
+		{
+			fprintf(stderr, "Error writing %s.\n", path.u8string().c_str());
+			throw tiff_exception();
+		}
+	};
+
+	write_json(store / ".zgroup", [](FILE *f) {
+		fprintf(f, "{\n  \"zarr_format\": 2\n}\n");
+	});
+
+	write_json(store / ".zattrs", [&image](FILE *f) {
+		fprintf(f, "{\n  \"multiscales\": [\n    {\n      \"version\": \"0.4\",\n      \"name\": ");
+		write_json_string(f, image.name);
+		fprintf(f, ",\n      \"axes\": [\n");
+		fprintf(f, "        {\"name\": \"t\", \"type\": \"time\"},\n");
+		fprintf(f, "        {\"name\": \"c\", \"type\": \"channel\"},\n");
+		for(const char *axis : {"z", "y", "x"})
+		{
+			fprintf(f, "        {\"name\": \"%s\", \"type\": \"space\"", axis);
+			if(!image.unit.empty())
+			{
+				fprintf(f, ", \"unit\": ");
+				write_json_string(f, image.unit);
+			}
+			fprintf(f, "}%s\n", axis[0] == 'x' ? "" : ",");
+		}
+		fprintf(f, "      ],\n      \"datasets\": [\n        {\n          \"path\": \"0\",\n");
+		fprintf(f, "          \"coordinateTransformations\": [\n");
+		fprintf(f, "            {\"type\": \"scale\", \"scale\": [1, 1, %.9g, %.9g, %.9g]}",
+			image.scale[2], image.scale[1], image.scale[0]);
+		if(image.origin[0] != 0.0 || image.origin[1] != 0.0 || image.origin[2] != 0.0)
+		{
+			fprintf(f, ",\n            {\"type\": \"translation\", \"translation\": [0, 0, %.9g, %.9g, %.9g]}",
+				image.origin[2], image.origin[1], image.origin[0]);
+		}
+		fprintf(f, "\n          ]\n        }\n      ]\n    }\n  ]\n}\n");
+	});
+
+	write_json(store / "0" / ".zarray", [&image, &opts](FILE *f) {
+		fprintf(f, "{\n  \"zarr_format\": 2,\n");
+		fprintf(f, "  \"shape\": [%zu, %zu, %zu, %zu, %zu],\n", image.t, image.c, image.z, image.y, image.x);
+		fprintf(f, "  \"chunks\": [1, 1, %zu, %zu, %zu],\n", opts.chunk_z, opts.chunk_y, opts.chunk_x);
+		fprintf(f, "  \"dtype\": \"%s\",\n", zarr_dtype());
+
+		/* Both numcodecs' zlib and zstd take what compress_strip() makes. */
+		if(opts.compression == compression_t::deflate)
+			fprintf(f, "  \"compressor\": {\"id\": \"zlib\", \"level\": %d},\n", opts.level > 0 ? opts.level : 6);
+		else if(opts.compression == compression_t::zstd)
+			fprintf(f, "  \"compressor\": {\"id\": \"zstd\", \"level\": %d},\n", opts.level > 0 ? opts.level : 9);
+		else
+			fprintf(f, "  \"compressor\": null,\n");
+
+		fprintf(f, "  \"fill_value\": 0,\n  \"order\": \"C\",\n  \"filters\": null,\n  \"dimension_separator\": \"/\"\n}\n");
+	});
+}
+
+ims::zarr_writer::zarr_writer(const fs::path& dir, size_t w, size_t h, size_t num_channels, size_t npages, const zarr_opts_t& opts) :
+	_dir(dir),
+	_width(w),
+	_height(h),
+	_num_channels(num_channels),
+	_npages(npages),
+	_opts(opts),
+	_layer(0),
+	_filled(0),
+	_buffer(num_channels * opts.chunk_z * h * w)
+{
+	/* Chunks left over from an earlier attempt may not be overwritten. */
+	std::error_code ec;
+	fs::remove_all(_dir, ec);
+	make_directories(_dir);
+}
+
+size_t ims::zarr_writer::layer_depth() const noexcept
+{
+	return std::min(_opts.chunk_z, _npages - _layer * _opts.chunk_z);
+}
+
+uint16_t *ims::zarr_writer::layer_plane(size_t page, size_t c)
+{
+	if(page / _opts.chunk_z != _layer)
+	{
+		fprintf(stderr, "Zarr pages must be written in order.\n");
+		throw tiff_exception();
+	}
+
+	return _buffer.data() + (c * _opts.chunk_z + page % _opts.chunk_z) * _height * _width;
+}
+
+void ims::zarr_writer::write_page_contig(size_t page, uint16_t *data)
+{
+	const size_t plane_size = _width * _height;
+	for(size_t c = 0; c < _num_channels; ++c)
+	{
+		uint16_t *plane = layer_plane(page, c);
+		for(size_t i = 0; i < plane_size; ++i)
+			plane[i] = data[i * _num_channels + c];
+	}
+
+	if(++_filled == layer_depth())
+		flush_layer();
+}
+
+void ims::zarr_writer::write_page_planar(size_t page, const uint16_t* const *planes)
+{
+	for(size_t c = 0; c < _num_channels; ++c)
+		memcpy(layer_plane(page, c), planes[c], _width * _height * sizeof(uint16_t));
+
+	if(++_filled == layer_depth())
+		flush_layer();
+}
+
+void ims::zarr_writer::flush_layer()
+{
+	const size_t cx = _opts.chunk_x, cy = _opts.chunk_y, cz = _opts.chunk_z;
+	const size_t nx = (_width + cx - 1) / cx;
+	const size_t ny = (_height + cy - 1) / cy;
+	const size_t depth = layer_depth();
+
+	/* Chunk keys are c/z/y/x. */
+	const std::string zname = std::to_string(_layer);
+	for(size_t c = 0; c < _num_channels; ++c)
+	{
+		for(size_t y = 0; y < ny; ++y)
+			make_directories(_dir / std::to_string(c) / zname / std::to_string(y));
+	}
+
+	parallel_for(_num_channels * ny * nx, _opts.threads, [&](size_t i) {
+		const size_t c = i / (ny * nx), y = (i / nx) % ny, x = i % nx;
+		const size_t x0 = x * cx, y0 = y * cy;
+		const size_t w = std::min(cx, _width - x0), h = std::min(cy, _height - y0);
+
+		/* Edge chunks are still full size, padded with the fill value. */
+		std::vector<uint16_t> chunk(cz * cy * cx, 0);
+		for(size_t z = 0; z < depth; ++z)
+		{
+			const uint16_t *plane = _buffer.data() + (c * cz + z) * _height * _width;
+			for(size_t row = 0; row < h; ++row)
+				memcpy(chunk.data() + (z * cy + row) * cx, plane + (y0 + row) * _width + x0, w * sizeof(uint16_t));
+		}
+
+		const fs::path path = _dir / std::to_string(c) / zname / std::to_string(y) / std::to_string(x);
+		const uint8_t *data = reinterpret_cast<const uint8_t*>(chunk.data());
+		const size_t size = chunk.size() * sizeof(uint16_t);
+		if(_opts.compression == compression_t::none)
+		{
+			write_file(path, data, size);
+			return;
+		}
+
+		std::vector<uint8_t> encoded;
+		compress_strip(_opts.compression, _opts.level, data, size, encoded);
+		write_file(path, encoded.data(), encoded.size());
+	});
+
+	++_layer;
+	_filled = 0;
+}
+
+void ims::zarr_writer::finish()
+{
+	/* Each layer's chunks are written and closed as soon as it's full. */
+	if(_layer * _opts.chunk_z < _npages)
+	{
+		fprintf(stderr, "Not every Zarr page was written.\n");
+		throw tiff_exception();
+	}
+}